@@ -0,0 +1,996 @@
+/* MIT License Copyright (c) 2021, h1zzz */
+
+/*
+ * Load generator for the framing core. Each connection runs send/recv round
+ * trips against an echo server and the results are printed as one JSON
+ * object per line, syscalls are the client's socket calls per round trip:
+ *
+ *   {"size":1024,"conns":8,"tls":0,"messages":80000,"seconds":0.912,
+ *    "msgs_per_sec":87719.3,"mb_per_sec":89.8,"p50_us":88.1,
+ *    "p99_us":190.4,"p999_us":402.7,"syscalls_per_msg":2.00}
+ *
+ * Without -H an echo server fixture is started in-process on a loopback
+ * port, it serves every connection from its own thread through
+ * websocket_accept. -H targets any other echo server instead, which is also
+ * how TLS is measured (-t), the fixture only speaks plain TCP.
+ *
+ * -m times the masking kernels instead, each one compiled in and supported
+ * by the CPU over the sizes of -s and a few alignments, after checking its
+ * output against the scalar kernel:
+ *
+ *   {"kernel":"avx2","size":16384,"align":1,"iterations":16384,
+ *    "seconds":0.006,"gb_per_sec":44.73}
+ *
+ * -P checks the frame header parse and build against the cast based code
+ * they replaced, on the boundary lengths of each encoding and on random
+ * ones, then times both parsers and exits non-zero when the new one falls
+ * below 0.8 of the old one's rate, or below -r headers per second:
+ *
+ *   {"headers":65536,"bytes":438812,"headers_per_sec":168128597,
+ *    "old_headers_per_sec":170143833,"ratio":0.99}
+ *
+ * The library is compiled into the benchmark so the static kernels and the
+ * parser can be reached, build it with the net layer it links against, e.g.
+ *
+ *   cc -O2 -I. bench/websocket_bench.c net.c ... -lpthread -lz
+ */
+
+#include "../websocket.c"
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define BENCH_MAX_LIST 32
+#define BENCH_MAX_SIZE (16 * 1024 * 1024)
+
+/* Round trips per connection, fewer when the byte bound is reached */
+#define BENCH_DEFAULT_MESSAGES 10000
+#define BENCH_DEFAULT_BYTES (256 * 1024 * 1024)
+#define BENCH_WARMUP 10
+
+struct bench_config {
+    const char *host;
+    uint16_t port;
+    const char *path;
+    int tls;
+    long messages;   /* round trips per connection */
+    long long bytes; /* bound on the bytes all connections send per run */
+};
+
+struct bench_conn {
+    const struct bench_config *cfg;
+    size_t size;
+    long count;
+    double *lat;       /* round trip times in microseconds */
+    uint64_t syscalls; /* socket calls of the measured round trips */
+    int failed;
+};
+
+static double bench_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Parse "2,1024,16M" into sizes or counts, K and M suffixes are binary */
+static int bench_parse_list(const char *str, long long *list)
+{
+    long long v;
+    char *end;
+    int n = 0;
+
+    while (*str) {
+        if (n == BENCH_MAX_LIST) {
+            fprintf(stderr, "too many list entries\n");
+            return -1;
+        }
+        v = strtoll(str, &end, 10);
+        if (end == str || v <= 0) {
+            fprintf(stderr, "invalid list entry %s\n", str);
+            return -1;
+        }
+        if (*end == 'K' || *end == 'k') {
+            v *= 1024;
+            end++;
+        } else if (*end == 'M' || *end == 'm') {
+            v *= 1024 * 1024;
+            end++;
+        }
+        list[n++] = v;
+        if (*end == ',')
+            end++;
+        else if (*end != '\0') {
+            fprintf(stderr, "invalid list entry %s\n", str);
+            return -1;
+        }
+        str = end;
+    }
+
+    return n;
+}
+
+/* Echo server fixture */
+
+/* Messages are collected piece by piece, a connection holds what it needs */
+struct bench_echo {
+    unsigned char *buf;
+    size_t len, cap;
+    int type;
+};
+
+static int bench_echo_piece(websocket_t *ws, int type, const void *buf,
+                            size_t n, int fin, void *arg)
+{
+    struct bench_echo *echo = arg;
+    unsigned char *p;
+    size_t cap;
+
+    (void)ws;
+    (void)fin;
+
+    if (echo->len + n > echo->cap) {
+        cap = echo->cap ? echo->cap : 4096;
+        while (cap < echo->len + n)
+            cap *= 2;
+        p = realloc(echo->buf, cap);
+        if (!p) {
+            fprintf(stderr, "realloc error\n");
+            return -1;
+        }
+        echo->buf = p;
+        echo->cap = cap;
+    }
+
+    memcpy(echo->buf + echo->len, buf, n);
+    echo->len += n;
+    echo->type = type;
+
+    return 0;
+}
+
+static void *bench_echo_conn(void *arg)
+{
+    struct bench_echo echo;
+    int fd = (int)(intptr_t)arg, type;
+    websocket_t ws;
+
+    if (websocket_accept(&ws, fd) != 0) {
+        fprintf(stderr, "websocket_accept error\n");
+        return NULL;
+    }
+    websocket_set_max_message_size(&ws, BENCH_MAX_SIZE);
+
+    memset(&echo, 0, sizeof(echo));
+    websocket_set_fragment_cb(&ws, bench_echo_piece, &echo);
+
+    for (;;) {
+        echo.len = 0;
+        if (websocket_recv(&ws, &type, NULL, 0) < 0 ||
+            type == WEBSOCKET_CLOSE)
+            break;
+        if (websocket_send(&ws, echo.type, echo.buf, echo.len) == -1)
+            break;
+    }
+
+    websocket_close(&ws);
+    free(echo.buf);
+
+    return NULL;
+}
+
+static void *bench_echo_server(void *arg)
+{
+    int lfd = (int)(intptr_t)arg, fd;
+    pthread_t tid;
+
+    for (;;) {
+        fd = accept(lfd, NULL, NULL);
+        if (fd == -1) {
+            if (errno == EINTR)
+                continue;
+            fprintf(stderr, "accept error\n");
+            return NULL;
+        }
+        if (pthread_create(&tid, NULL, bench_echo_conn,
+                           (void *)(intptr_t)fd) != 0) {
+            fprintf(stderr, "pthread_create error\n");
+            close(fd);
+            continue;
+        }
+        pthread_detach(tid);
+    }
+
+    return NULL;
+}
+
+/* Listen on an ephemeral loopback port and serve it, return the port */
+static int bench_echo_start(void)
+{
+    struct sockaddr_in addr;
+    socklen_t len = sizeof(addr);
+    pthread_t tid;
+    int fd, on = 1;
+
+    fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd == -1) {
+        fprintf(stderr, "socket error\n");
+        return -1;
+    }
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 ||
+        listen(fd, 1024) == -1 ||
+        getsockname(fd, (struct sockaddr *)&addr, &len) == -1) {
+        fprintf(stderr, "bind/listen error\n");
+        close(fd);
+        return -1;
+    }
+
+    if (pthread_create(&tid, NULL, bench_echo_server,
+                       (void *)(intptr_t)fd) != 0) {
+        fprintf(stderr, "pthread_create error\n");
+        close(fd);
+        return -1;
+    }
+    pthread_detach(tid);
+
+    return ntohs(addr.sin_port);
+}
+
+/* Load generator */
+
+static int bench_round_trip(websocket_t *ws, const unsigned char *msg,
+                            unsigned char *buf, size_t size)
+{
+    int type, n;
+
+    if (websocket_send(ws, WEBSOCKET_BINARY, msg, size) != (int)size) {
+        fprintf(stderr, "websocket_send error\n");
+        return -1;
+    }
+
+    n = websocket_recv(ws, &type, buf, size);
+    if (n != (int)size || type != WEBSOCKET_BINARY) {
+        fprintf(stderr, "websocket_recv error\n");
+        return -1;
+    }
+
+    return 0;
+}
+
+static void *bench_client(void *arg)
+{
+    struct bench_conn *conn = arg;
+    const struct bench_config *cfg = conn->cfg;
+    unsigned char *msg, *buf;
+    const struct websocket_stats *stats;
+    uint64_t calls;
+    websocket_t ws;
+    double start;
+    long i;
+
+    conn->failed = 1;
+
+    msg = malloc(conn->size);
+    buf = malloc(conn->size);
+    if (!msg || !buf) {
+        fprintf(stderr, "malloc error\n");
+        goto out;
+    }
+    for (i = 0; i < (long)conn->size; i++)
+        msg[i] = (unsigned char)(i * 31 + 7);
+
+    if (websocket_connect(&ws, cfg->host, cfg->port, cfg->path, cfg->tls,
+                          NULL) != 0) {
+        fprintf(stderr, "websocket_connect error\n");
+        goto out;
+    }
+    websocket_set_max_message_size(&ws, BENCH_MAX_SIZE);
+
+    for (i = 0; i < BENCH_WARMUP && i < conn->count; i++) {
+        if (bench_round_trip(&ws, msg, buf, conn->size) == -1)
+            goto done;
+    }
+
+    stats = websocket_stats(&ws);
+    calls = stats->reads + stats->writes;
+
+    for (i = 0; i < conn->count; i++) {
+        start = bench_now();
+        if (bench_round_trip(&ws, msg, buf, conn->size) == -1)
+            goto done;
+        conn->lat[i] = (bench_now() - start) * 1e6;
+    }
+    conn->syscalls = stats->reads + stats->writes - calls;
+
+    if (memcmp(msg, buf, conn->size) != 0) {
+        fprintf(stderr, "echo mismatch\n");
+        goto done;
+    }
+    conn->failed = 0;
+
+done:
+    websocket_close(&ws);
+out:
+    free(msg);
+    free(buf);
+
+    return NULL;
+}
+
+static int bench_cmp(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+static double bench_percentile(const double *lat, long n, double p)
+{
+    long i = (long)(p * (n - 1) + 0.5);
+
+    return lat[i];
+}
+
+/* Run one size over conns connections and print its line */
+static int bench_run(const struct bench_config *cfg, size_t size, int conns)
+{
+    struct bench_conn *conn;
+    pthread_t *tids;
+    double *lat, start, secs;
+    uint64_t syscalls = 0;
+    long count, total;
+    int i, ret = -1;
+
+    count = cfg->messages;
+    if (count > cfg->bytes / ((long long)size * conns))
+        count = (long)(cfg->bytes / ((long long)size * conns));
+    if (count < 1)
+        count = 1;
+    total = count * conns;
+
+    conn = calloc(conns, sizeof(struct bench_conn));
+    tids = calloc(conns, sizeof(pthread_t));
+    lat = malloc(total * sizeof(double));
+    if (!conn || !tids || !lat) {
+        fprintf(stderr, "malloc error\n");
+        goto out;
+    }
+
+    start = bench_now();
+    for (i = 0; i < conns; i++) {
+        conn[i].cfg = cfg;
+        conn[i].size = size;
+        conn[i].count = count;
+        conn[i].lat = lat + (long)i * count;
+        if (pthread_create(&tids[i], NULL, bench_client, &conn[i]) != 0) {
+            fprintf(stderr, "pthread_create error\n");
+            conns = i;
+            goto join;
+        }
+    }
+    ret = 0;
+
+join:
+    for (i = 0; i < conns; i++) {
+        pthread_join(tids[i], NULL);
+        if (conn[i].failed)
+            ret = -1;
+        syscalls += conn[i].syscalls;
+    }
+    secs = bench_now() - start;
+    if (ret == -1)
+        goto out;
+
+    qsort(lat, total, sizeof(double), bench_cmp);
+    printf("{\"size\":%zu,\"conns\":%d,\"tls\":%d,\"messages\":%ld,"
+           "\"seconds\":%.3f,\"msgs_per_sec\":%.1f,\"mb_per_sec\":%.1f,"
+           "\"p50_us\":%.1f,\"p99_us\":%.1f,\"p999_us\":%.1f,"
+           "\"syscalls_per_msg\":%.2f}\n",
+           size, conns, cfg->tls, total, secs, total / secs,
+           (double)total * size / secs / (1024 * 1024),
+           bench_percentile(lat, total, 0.50),
+           bench_percentile(lat, total, 0.99),
+           bench_percentile(lat, total, 0.999), (double)syscalls / total);
+    fflush(stdout);
+
+out:
+    free(conn);
+    free(tids);
+    free(lat);
+
+    return ret;
+}
+
+/* Masking kernels */
+
+/* Bytes each kernel masks per size and alignment */
+#define BENCH_MASK_BYTES (256 * 1024 * 1024)
+#define BENCH_MASK_KEY 0x5ac3e127u
+
+struct bench_kernel {
+    const char *name;
+    mask_fn fn;
+};
+
+/* Offsets of the source and destination from a 64 byte boundary */
+static const size_t bench_aligns[] = {0, 1, 3, 7};
+#define BENCH_NALIGNS (sizeof(bench_aligns) / sizeof(bench_aligns[0]))
+
+/* The kernels compiled in that the running CPU can execute */
+static int bench_kernels(struct bench_kernel *k)
+{
+    int n = 0;
+
+    k[n].name = "scalar";
+    k[n++].fn = mask_bytes;
+    k[n].name = "word";
+    k[n++].fn = mask_word;
+#if defined(MASK_X86)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse2")) {
+        k[n].name = "sse2";
+        k[n++].fn = mask_sse2;
+    }
+    if (__builtin_cpu_supports("avx2")) {
+        k[n].name = "avx2";
+        k[n++].fn = mask_avx2;
+    }
+#elif defined(MASK_NEON)
+    k[n].name = "neon";
+    k[n++].fn = mask_neon;
+#endif
+
+    return n;
+}
+
+/*
+ * Compare a kernel with the scalar one on every length up to 256 and every
+ * alignment of the source and destination, copying and in place
+ */
+static int bench_mask_check(const struct bench_kernel *k, uint8_t *src,
+                            uint8_t *dst, uint8_t *ref)
+{
+    size_t n, a, b;
+
+    for (n = 0; n <= 256; n++) {
+        for (a = 0; a < 8; a++) {
+            for (b = 0; b < 8; b++) {
+                mask_bytes(ref, src + a, n, BENCH_MASK_KEY);
+                memset(dst, 0, n + 16);
+                k->fn(dst + b, src + a, n, BENCH_MASK_KEY);
+                if (memcmp(dst + b, ref, n) != 0 || dst[b + n] != 0)
+                    goto mismatch;
+                memcpy(dst + b, src + a, n);
+                k->fn(dst + b, dst + b, n, BENCH_MASK_KEY);
+                if (memcmp(dst + b, ref, n) != 0)
+                    goto mismatch;
+            }
+        }
+    }
+
+    return 0;
+
+mismatch:
+    fprintf(stderr, "%s kernel differs from scalar, %zu bytes at %zu/%zu\n",
+            k->name, n, a, b);
+    return -1;
+}
+
+/* Time every kernel over each size and alignment and print its line */
+static int bench_mask(const long long *sizes, int nsizes)
+{
+    struct bench_kernel kernels[8];
+    uint8_t *src, *dst, *ref;
+    size_t size, max = 256, align;
+    double start, secs;
+    long iters, j;
+    int nkernels, i, s, ret = -1;
+    unsigned int a;
+
+    for (s = 0; s < nsizes; s++)
+        if ((size_t)sizes[s] > max)
+            max = (size_t)sizes[s];
+
+    src = dst = ref = NULL;
+    if (posix_memalign((void **)&src, 64, max + 64) != 0 ||
+        posix_memalign((void **)&dst, 64, max + 64) != 0 ||
+        posix_memalign((void **)&ref, 64, max + 64) != 0) {
+        fprintf(stderr, "malloc error\n");
+        goto out;
+    }
+    for (j = 0; j < (long)max + 64; j++)
+        src[j] = (uint8_t)(j * 31 + 7);
+
+    nkernels = bench_kernels(kernels);
+    for (i = 0; i < nkernels; i++) {
+        if (bench_mask_check(&kernels[i], src, dst, ref) == -1)
+            goto out;
+    }
+
+    for (i = 0; i < nkernels; i++) {
+        for (s = 0; s < nsizes; s++) {
+            size = (size_t)sizes[s];
+            iters = (long)(BENCH_MASK_BYTES / size);
+            if (iters < 1)
+                iters = 1;
+            for (a = 0; a < BENCH_NALIGNS; a++) {
+                align = bench_aligns[a];
+
+                /* Checked again at the measured size */
+                mask_bytes(ref, src + align, size, BENCH_MASK_KEY);
+                kernels[i].fn(dst + align, src + align, size, BENCH_MASK_KEY);
+                if (memcmp(dst + align, ref, size) != 0) {
+                    fprintf(stderr, "%s kernel differs from scalar, %zu "
+                            "bytes at %zu\n", kernels[i].name, size, align);
+                    goto out;
+                }
+
+                /* In place, as a receive unmasks, so no pass can be elided */
+                start = bench_now();
+                for (j = 0; j < iters; j++)
+                    kernels[i].fn(dst + align, dst + align, size,
+                                  BENCH_MASK_KEY);
+                secs = bench_now() - start;
+
+                printf("{\"kernel\":\"%s\",\"size\":%zu,\"align\":%zu,"
+                       "\"iterations\":%ld,\"seconds\":%.3f,"
+                       "\"gb_per_sec\":%.2f}\n",
+                       kernels[i].name, size, align, iters, secs,
+                       (double)iters * size / secs / 1e9);
+                fflush(stdout);
+            }
+        }
+    }
+    ret = 0;
+
+out:
+    free(src);
+    free(dst);
+    free(ref);
+
+    return ret;
+}
+
+/* Frame header parsing */
+
+/* Headers per timed pass, passes per parser, and the regression bound */
+#define BENCH_PARSE_HEADERS 65536
+#define BENCH_PARSE_PASSES 200
+#define BENCH_PARSE_RUNS 5
+#define BENCH_PARSE_RATIO 0.8
+#define BENCH_PARSE_RANDOM 100000
+
+/*
+ * The cast based length loads and stores websocket_parse_frame_hdr and
+ * websocket_build_frame_hdr used before the byte-wise ones, as the
+ * reference. memcpy stands in for the unaligned casts with the same result
+ */
+static int bench_old_parse(websocket_t *ws, const unsigned char *buf,
+                           size_t avail, struct frame_hdr *hdr)
+{
+    uint16_t len16;
+    uint64_t len64, len;
+    size_t hdr_len;
+
+    if (avail < 2) {
+        hdr->size = 2;
+        return 1;
+    }
+
+    hdr->fin = buf[0] & FRAME_FIN;
+    hdr->rsv1 = buf[0] & FRAME_RSV1;
+    hdr->opcode = buf[0] & FRAME_OPCODE;
+    if ((buf[0] & (FRAME_RSV2 | FRAME_RSV3)) != 0 ||
+        (hdr->rsv1 && (!ws->zctx || (hdr->opcode & 0x8) ||
+                       hdr->opcode == WEBSOCKET_CONTINUATION)))
+        return -1;
+    hdr->mask = buf[1] & FRAME_MASK;
+    if (!hdr->mask != !ws->server)
+        return -1;
+    len = buf[1] & 0x7f;
+
+    hdr_len = 2;
+    if (len == 126)
+        hdr_len += 2;
+    else if (len == 127)
+        hdr_len += 8;
+    if (hdr->mask)
+        hdr_len += 4;
+    if (avail < hdr_len) {
+        hdr->size = hdr_len;
+        return 1;
+    }
+
+    buf += 2;
+    if (len == 126) {
+        memcpy(&len16, buf, 2);
+        len = ntohs(len16);
+        buf += 2;
+    } else if (len == 127) {
+        memcpy(&len64, buf, 8);
+        len = ((uint64_t)ntohl(len64 & 0xffffffff)) << 32;
+        len |= ntohl((uint32_t)(len64 >> 32));
+        buf += 8;
+    }
+
+    hdr->len = len;
+    if (hdr->mask)
+        memcpy(hdr->mask_key, buf, 4);
+    hdr->size = hdr_len;
+
+    return 0;
+}
+
+static size_t bench_old_build(uint8_t *header, uint8_t b0, uint64_t n,
+                              const uint8_t *mask_key)
+{
+    uint32_t v32;
+    uint16_t v16;
+    size_t len;
+
+    header[0] = b0;
+    header[1] = mask_key ? FRAME_MASK : 0;
+
+    if (n <= 125) {
+        header[1] |= (uint8_t)n;
+        len = 2;
+    } else if (n <= 0xffff) {
+        header[1] |= 126;
+        v16 = htons((uint16_t)n);
+        memcpy(&header[2], &v16, 2);
+        len = 4;
+    } else {
+        header[1] |= 127;
+        v32 = htonl((uint32_t)(n >> 32));
+        memcpy(&header[2], &v32, 4);
+        v32 = htonl((uint32_t)(n & 0xffffffff));
+        memcpy(&header[6], &v32, 4);
+        len = 10;
+    }
+
+    if (mask_key) {
+        memcpy(&header[len], mask_key, 4);
+        len += 4;
+    }
+
+    return len;
+}
+
+static uint64_t bench_rand(uint64_t *state)
+{
+    uint64_t x = *state;
+
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    *state = x;
+
+    return x;
+}
+
+/*
+ * Build and parse one length both ways, at an odd offset and cut one byte
+ * short. Lengths with the most significant bit set are the one difference:
+ * section 5.2 forbids them and only the new parser rejects them
+ */
+static int bench_parse_one(websocket_t *ws, uint64_t n)
+{
+    static const uint8_t key[4] = {0x37, 0xfa, 0x21, 0x3d};
+    uint8_t old[16], buf[1 + 16], *hdr = buf + 1;
+    struct frame_hdr a, b;
+    size_t len;
+    int ret;
+
+    ws->server = (int)(n & 1);
+
+    len = websocket_build_frame_hdr(hdr, FRAME_FIN | WEBSOCKET_BINARY, n,
+                                    ws->server ? key : NULL);
+    if (bench_old_build(old, FRAME_FIN | WEBSOCKET_BINARY, n,
+                        ws->server ? key : NULL) != len ||
+        memcmp(old, hdr, len) != 0) {
+        fprintf(stderr, "header build of length %llu differs\n",
+                (unsigned long long)n);
+        return -1;
+    }
+
+    if (websocket_parse_frame_hdr(ws, hdr, len - 1, &a) != 1 ||
+        bench_old_parse(ws, hdr, len - 1, &b) != 1 || a.size != b.size) {
+        fprintf(stderr, "short header of length %llu differs\n",
+                (unsigned long long)n);
+        return -1;
+    }
+
+    ret = websocket_parse_frame_hdr(ws, hdr, len, &a);
+    if (bench_old_parse(ws, hdr, len, &b) != 0 || b.len != n ||
+        b.size != len) {
+        fprintf(stderr, "reference parse of length %llu failed\n",
+                (unsigned long long)n);
+        return -1;
+    }
+    if (n >> 63) {
+        if (ret == -1)
+            return 0;
+    } else if (ret == 0 && a.len == b.len && a.size == b.size &&
+               a.mask == b.mask &&
+               memcmp(a.mask_key, b.mask_key, a.mask ? 4 : 0) == 0) {
+        return 0;
+    }
+
+    fprintf(stderr, "header parse of length %llu differs\n",
+            (unsigned long long)n);
+    return -1;
+
+}
+
+/* Boundary lengths of each encoding, then random lengths of every width */
+static int bench_parse_check(websocket_t *ws)
+{
+    static const uint64_t lengths[] = {
+        0, 1, 125, 126, 127, 65535, 65536, 65537, 0xffffffffULL,
+        0x100000000ULL, 0x7fffffffffffffffULL, 0x8000000000000000ULL,
+        0xffffffffffffffffULL,
+    };
+    uint64_t state = 0x9e3779b97f4a7c15ULL, n;
+    size_t i;
+
+    for (i = 0; i < sizeof(lengths) / sizeof(lengths[0]); i++) {
+        /* The low bit picks the side, try both */
+        if (bench_parse_one(ws, lengths[i]) == -1 ||
+            bench_parse_one(ws, lengths[i] ^ 1) == -1)
+            return -1;
+    }
+
+    for (i = 0; i < BENCH_PARSE_RANDOM; i++) {
+        n = bench_rand(&state);
+        n >>= bench_rand(&state) % 64;
+        if (bench_parse_one(ws, n) == -1)
+            return -1;
+    }
+
+    return 0;
+}
+
+typedef int (*bench_parse_fn)(websocket_t *ws, const unsigned char *buf,
+                              size_t avail, struct frame_hdr *hdr);
+
+/* Best headers per second of a parser over the back to back headers */
+static double bench_parse_time(websocket_t *ws, bench_parse_fn parse,
+                               const uint8_t *buf, size_t len)
+{
+    double start, secs, best = 0;
+    struct frame_hdr hdr;
+    volatile uint64_t sink;
+    uint64_t sum = 0;
+    size_t pos;
+    int run, pass;
+
+    for (run = 0; run < BENCH_PARSE_RUNS; run++) {
+        start = bench_now();
+        for (pass = 0; pass < BENCH_PARSE_PASSES; pass++) {
+            for (pos = 0; pos < len; pos += hdr.size) {
+                if (parse(ws, buf + pos, len - pos, &hdr) != 0)
+                    return 0;
+                sum += hdr.len;
+            }
+        }
+        secs = bench_now() - start;
+        if (BENCH_PARSE_HEADERS * BENCH_PARSE_PASSES / secs > best)
+            best = BENCH_PARSE_HEADERS * BENCH_PARSE_PASSES / secs;
+    }
+    sink = sum;
+    (void)sink;
+
+    return best;
+}
+
+/*
+ * Check the new header parse and build against the old ones, then time
+ * both parsers over masked client headers of mixed length encodings, as a
+ * server sees them. Fail when the new parser is slower than
+ * BENCH_PARSE_RATIO of the old one or, with min set, below min headers per
+ * second
+ */
+static int bench_parse(double min)
+{
+    static const uint8_t key[4] = {0x37, 0xfa, 0x21, 0x3d};
+    double rate, old_rate;
+    uint64_t state = 0x2545f4914f6cdd1dULL, r, n;
+    uint8_t *buf;
+    size_t len = 0;
+    websocket_t ws;
+    int i, ret = -1;
+
+    /* Rejected lengths are logged, there is no peer to send a CLOSE to */
+    websocket_set_logger(NULL, NULL);
+    websocket_init(&ws, NULL);
+    ws.close_sent = 1;
+
+    if (bench_parse_check(&ws) == -1)
+        return -1;
+
+    buf = malloc(BENCH_PARSE_HEADERS * 14);
+    if (!buf) {
+        fprintf(stderr, "malloc error\n");
+        return -1;
+    }
+
+    /* Mostly short frames, as market data and chat traffic */
+    for (i = 0; i < BENCH_PARSE_HEADERS; i++) {
+        r = bench_rand(&state);
+        if (r % 100 < 80)
+            n = r % 126;
+        else if (r % 100 < 95)
+            n = 126 + (r >> 8) % (65536 - 126);
+        else
+            n = 65536 + (r >> 8) % (1ULL << 40);
+        len += websocket_build_frame_hdr(buf + len, FRAME_FIN |
+                                         WEBSOCKET_BINARY, n, key);
+    }
+
+    ws.server = 1;
+    old_rate = bench_parse_time(&ws, bench_old_parse, buf, len);
+    rate = bench_parse_time(&ws, websocket_parse_frame_hdr, buf, len);
+    if (rate == 0 || old_rate == 0) {
+        fprintf(stderr, "parse error\n");
+        goto out;
+    }
+
+    printf("{\"headers\":%d,\"bytes\":%zu,\"headers_per_sec\":%.0f,"
+           "\"old_headers_per_sec\":%.0f,\"ratio\":%.2f}\n",
+           BENCH_PARSE_HEADERS, len, rate, old_rate, rate / old_rate);
+    fflush(stdout);
+
+    if (rate < old_rate * BENCH_PARSE_RATIO) {
+        fprintf(stderr, "header parse regressed to %.2f of the old one\n",
+                rate / old_rate);
+        goto out;
+    }
+    if (rate < min) {
+        fprintf(stderr, "header parse below %.0f headers per second\n", min);
+        goto out;
+    }
+    ret = 0;
+
+out:
+    free(buf);
+
+    return ret;
+}
+
+static void bench_usage(const char *prog)
+{
+    fprintf(stderr,
+            "usage: %s [-s sizes] [-c conns] [-n messages] [-b bytes]\n"
+            "          [-H host:port] [-p path] [-t] [-m] [-P [-r rate]]\n"
+            "  -s  payload sizes, default 2,16,128,1K,16K,128K,1M,16M\n"
+            "      or 16,64,1K,16K,1M with -m\n"
+            "  -c  connection counts, default 1,4,16\n"
+            "  -n  round trips per connection and size, default %d\n"
+            "  -b  bound on the bytes sent per run, default 256M\n"
+            "  -H  echo server to use instead of the in-process fixture\n"
+            "  -t  connect with TLS, needs -H\n"
+            "  -m  time the masking kernels instead of round trips\n"
+            "  -P  check and time the frame header parser instead\n"
+            "  -r  headers per second -P must reach\n",
+            prog, BENCH_DEFAULT_MESSAGES);
+}
+
+int main(int argc, char *argv[])
+{
+    long long sizes[BENCH_MAX_LIST], conns[BENCH_MAX_LIST];
+    int nsizes = 0, nconns, i, j, opt, port, mask = 0, parse = 0, ret = 0;
+    double rate = 0;
+    struct bench_config cfg;
+    char *colon;
+
+    memset(&cfg, 0, sizeof(cfg));
+    cfg.host = "127.0.0.1";
+    cfg.path = "/";
+    cfg.messages = BENCH_DEFAULT_MESSAGES;
+    cfg.bytes = BENCH_DEFAULT_BYTES;
+
+    nconns = bench_parse_list("1,4,16", conns);
+
+    while ((opt = getopt(argc, argv, "s:c:n:b:H:p:tmPr:h")) != -1) {
+        switch (opt) {
+        case 's':
+            nsizes = bench_parse_list(optarg, sizes);
+            break;
+        case 'c':
+            nconns = bench_parse_list(optarg, conns);
+            break;
+        case 'n':
+            cfg.messages = atol(optarg);
+            break;
+        case 'b':
+            if (bench_parse_list(optarg, &cfg.bytes) != 1)
+                cfg.bytes = 0;
+            break;
+        case 'H':
+            colon = strrchr(optarg, ':');
+            if (!colon) {
+                bench_usage(argv[0]);
+                return 1;
+            }
+            *colon = '\0';
+            cfg.host = optarg;
+            cfg.port = (uint16_t)atoi(colon + 1);
+            break;
+        case 'p':
+            cfg.path = optarg;
+            break;
+        case 't':
+            cfg.tls = 1;
+            break;
+        case 'm':
+            mask = 1;
+            break;
+        case 'P':
+            parse = 1;
+            break;
+        case 'r':
+            rate = atof(optarg);
+            break;
+        default:
+            bench_usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (nsizes == 0)
+        nsizes = bench_parse_list(mask ? "16,64,1K,16K,1M"
+                                       : "2,16,128,1K,16K,128K,1M,16M",
+                                  sizes);
+
+    if (nsizes <= 0 || nconns <= 0 || cfg.messages <= 0 || cfg.bytes <= 0 ||
+        (cfg.tls && cfg.port == 0)) {
+        bench_usage(argv[0]);
+        return 1;
+    }
+    for (i = 0; i < nsizes; i++) {
+        if (sizes[i] > BENCH_MAX_SIZE) {
+            fprintf(stderr, "sizes are limited to %d bytes\n", BENCH_MAX_SIZE);
+            return 1;
+        }
+    }
+
+    if (mask)
+        return bench_mask(sizes, nsizes) == -1;
+    if (parse)
+        return bench_parse(rate) == -1;
+
+    if (cfg.port == 0) {
+        port = bench_echo_start();
+        if (port == -1)
+            return 1;
+        cfg.port = (uint16_t)port;
+    }
+
+    for (j = 0; j < nconns; j++) {
+        for (i = 0; i < nsizes; i++) {
+            if (bench_run(&cfg, (size_t)sizes[i], (int)conns[j]) == -1) {
+                fprintf(stderr, "size %lld with %lld connections failed\n",
+                        sizes[i], conns[j]);
+                ret = 1;
+            }
+        }
+    }
+
+    return ret;
+}
@@ -0,0 +1,270 @@
+/* MIT License Copyright (c) 2021, h1zzz */
+
+/*
+ * Fuzz target for the frame parser. The first input byte picks the side and
+ * the options, the second the buffer size websocket_recv gets (0 for one
+ * that fits everything), the rest is what the peer sent.
+ * websocket_parse_frame_hdr runs on it directly and must stay within the
+ * bytes it was given, then the bytes go through websocket_next_message
+ * twice: once already buffered and received with websocket_recv_view, once
+ * arriving on a socket and received with websocket_recv. Both must see the
+ * same messages, websocket_recv a prefix of those that do not fit, and fail
+ * the same way, anything else aborts. A message cut short only fails the
+ * next websocket_recv, when its discarded rest turns out to be invalid.
+ *
+ * The library is compiled into the target so the static parser can be
+ * reached. With libFuzzer, from the top of the tree:
+ *
+ *   clang -g -O1 -fsanitize=fuzzer,address,undefined -I. \
+ *       fuzz/websocket_fuzz.c net.c ... -lpthread -lz
+ *
+ * Adding -DWEBSOCKET_FUZZ_MAIN (and dropping fuzzer from -fsanitize) builds
+ * a main that runs the files it is given, or stdin, for AFL or to replay a
+ * crash. fuzz/corpus holds the seeds, among them the inputs of fixed bugs,
+ * pass all of its files to the main after a change to the receive paths.
+ */
+
+#include "../websocket.c"
+
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Both copies have to fit the socket buffers, the peer never reads */
+#define FUZZ_MAX_INPUT 65536
+
+#define FUZZ_SERVER 0x01
+#define FUZZ_UTF8 0x02
+#define FUZZ_SMALL 0x04 /* a 256 byte bound on reassembled messages */
+
+/* What one receive call returned */
+struct fuzz_msg {
+    int ret;
+    int type;
+    size_t len;
+    const uint8_t *data;
+};
+
+int LLVMFuzzerInitialize(int *argc, char ***argv);
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size);
+
+/* The parser on its own, for every offset of the input */
+static void fuzz_parse(int server, const uint8_t *data, size_t size)
+{
+    struct frame_hdr hdr;
+    websocket_t ws;
+    size_t off, need;
+    int ret;
+
+    websocket_init(&ws, NULL);
+    ws.server = server;
+    ws.close_sent = 1; /* no peer to tell about the protocol errors */
+
+    for (off = 0; off < size; off++) {
+        ret = websocket_parse_frame_hdr(&ws, data + off, size - off, &hdr);
+        if (ret == -1)
+            continue;
+        if (ret == 1) {
+            if (hdr.size <= size - off || hdr.size > 14)
+                abort();
+            continue;
+        }
+        need = 2 + (hdr.mask ? 4 : 0);
+        if ((data[off + 1] & 0x7f) == 126)
+            need += 2;
+        else if ((data[off + 1] & 0x7f) == 127)
+            need += 8;
+        if (hdr.size != need || hdr.size > size - off || hdr.len >> 63 ||
+            !hdr.mask != !server)
+            abort();
+    }
+}
+
+/* A connection on one end of a socket pair, the peer end goes to *peer */
+static int fuzz_open(websocket_t *ws, int opts, int *peer)
+{
+    struct websocket_options o;
+    int sv[2];
+
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == -1)
+        return -1;
+
+    memset(&o, 0, sizeof(o));
+    o.validate_utf8 = !!(opts & FUZZ_UTF8);
+    websocket_init(ws, &o);
+    ws->net.fd = sv[0];
+    ws->fd = sv[0];
+    ws->server = !!(opts & FUZZ_SERVER);
+    if (opts & FUZZ_SMALL)
+        websocket_set_max_message_size(ws, 256);
+    *peer = sv[1];
+
+    return 0;
+}
+
+/*
+ * Receive until an error or a CLOSE, buffered through websocket_recv_view
+ * when view is set, otherwise from the socket through websocket_recv with
+ * room for at most room bytes. The payloads are copied to out. Return the
+ * number of calls
+ */
+static int fuzz_recv(websocket_t *ws, int view, size_t room,
+                     struct fuzz_msg *msgs, int max, uint8_t *out, size_t cap)
+{
+    struct fuzz_msg *m;
+    size_t used = 0;
+    void *ptr;
+    int n;
+
+    for (n = 0; n < max; n++) {
+        m = &msgs[n];
+        m->type = 0;
+        m->len = 0;
+        m->data = out + used;
+        if (view) {
+            m->ret = websocket_recv_view(ws, &m->type, &ptr, &m->len);
+            if (m->ret == 0) {
+                if (m->len > cap - used)
+                    abort();
+                if (m->len > 0)
+                    memcpy(out + used, ptr, m->len);
+                websocket_release(ws);
+            }
+        } else {
+            m->ret = websocket_recv(ws, &m->type, out + used,
+                                    room < cap - used ? room : cap - used);
+            if (m->ret >= 0)
+                m->len = (size_t)m->ret;
+        }
+        used += m->len;
+        if (m->ret < 0 || m->type == WEBSOCKET_CLOSE)
+            return n + 1;
+    }
+
+    return n;
+}
+
+int LLVMFuzzerInitialize(int *argc, char ***argv)
+{
+    (void)argc;
+    (void)argv;
+
+    /* Failures are expected, and a failed CLOSE must not kill the run */
+    websocket_set_logger(NULL, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    return 0;
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+    static struct fuzz_msg a[FUZZ_MAX_INPUT], b[FUZZ_MAX_INPUT];
+    static uint8_t abuf[FUZZ_MAX_INPUT], bbuf[FUZZ_MAX_INPUT];
+    websocket_t ws;
+    int opts, peer, na, nb, i;
+    size_t room, len;
+
+    if (size < 2 || size > FUZZ_MAX_INPUT)
+        return 0;
+    opts = data[0];
+    room = data[1] ? data[1] : FUZZ_MAX_INPUT;
+    data += 2;
+    size -= 2;
+
+    fuzz_parse(opts & FUZZ_SERVER, data, size);
+
+    /* Everything is buffered already, the socket only reports EOF */
+    if (fuzz_open(&ws, opts, &peer) == -1)
+        return 0;
+    shutdown(peer, SHUT_WR);
+    if (size > 0) {
+        if (websocket_rbuf_reserve(&ws, size) == -1)
+            abort();
+        memcpy(ws.rbuf, data, size);
+        ws.rlen = size;
+    }
+    na = fuzz_recv(&ws, 1, 0, a, FUZZ_MAX_INPUT, abuf, sizeof(abuf));
+    websocket_destroy(&ws);
+    close(peer);
+
+    /* The same bytes from the socket, received with copies */
+    if (fuzz_open(&ws, opts, &peer) == -1)
+        return 0;
+    if ((size > 0 && write(peer, data, size) != (ssize_t)size) ||
+        shutdown(peer, SHUT_WR) == -1)
+        abort();
+    nb = fuzz_recv(&ws, 0, room, b, FUZZ_MAX_INPUT, bbuf, sizeof(bbuf));
+    websocket_destroy(&ws);
+    close(peer);
+
+    /* The type is only meaningful for what was received */
+    for (i = 0; i < na && i < nb; i++) {
+        if (b[i].ret < 0) {
+            if (a[i].ret >= 0)
+                abort();
+            continue;
+        }
+        if (a[i].ret < 0) {
+            /* Allowed when only the discarded rest was bad */
+            if (b[i].len != room || i + 1 != na || nb != na + 1 ||
+                b[i + 1].ret >= 0)
+                abort();
+            continue;
+        }
+        len = a[i].len < room ? a[i].len : room;
+        if (a[i].type != b[i].type || b[i].len != len ||
+            memcmp(a[i].data, b[i].data, len) != 0)
+            abort();
+    }
+    if (na != nb && !(nb == na + 1 && a[na - 1].ret < 0))
+        abort();
+
+    return 0;
+}
+
+#if defined(WEBSOCKET_FUZZ_MAIN)
+static int fuzz_run(FILE *fp)
+{
+    static uint8_t buf[FUZZ_MAX_INPUT + 1];
+    size_t n;
+
+    n = fread(buf, 1, sizeof(buf), fp);
+    if (ferror(fp)) {
+        fprintf(stderr, "read error\n");
+        return -1;
+    }
+    LLVMFuzzerTestOneInput(buf, n);
+
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    FILE *fp;
+    int i, ret = 0;
+
+    LLVMFuzzerInitialize(&argc, &argv);
+
+    if (argc < 2)
+        return fuzz_run(stdin) == -1;
+
+    for (i = 1; i < argc; i++) {
+        fp = fopen(argv[i], "rb");
+        if (!fp) {
+            fprintf(stderr, "can not open %s\n", argv[i]);
+            ret = 1;
+            continue;
+        }
+        if (fuzz_run(fp) == -1)
+            ret = 1;
+        fclose(fp);
+    }
+
+    return ret;
+}
+#endif
@@ -2,19 +2,49 @@
 
 /* https://datatracker.ietf.org/doc/html/rfc6455 */
 
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE /* CPU_SET, sched_setaffinity */
+#endif
+
 #include "websocket.h"
 
 #include <sys/socket.h>
+#include <sys/uio.h>
+#include <poll.h>
+#if defined(__linux__)
+#include <sys/random.h>
+#include <sys/sendfile.h>
+#include <linux/tls.h>
+#include <linux/errqueue.h>
+#include <netinet/tcp.h>
+#endif
 #include <arpa/inet.h>
+#include <netdb.h>
+#include <fcntl.h>
 #include <unistd.h>
+#include <sched.h>
 
+#include <errno.h>
+#include <pthread.h>
+#include <stdarg.h>
 #include <string.h>
+#include <strings.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <time.h>
 
 #include <mbedtls/base64.h>
 #include <mbedtls/sha1.h>
+#include <zlib.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define MASK_X86 1
+#include <immintrin.h>
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define MASK_NEON 1
+#include <arm_neon.h>
+#endif
 
 #define WEBSOCKET_VERSION "13"
 #define WEBSOCKET_GUID "258EAFA5-E914-47DA-95CA-C5AB0DC85B11"
@@ -27,426 +57,5368 @@
 
 #define FRAME_MASK 1 << 7
 
+/* Staging buffer for masked payloads, header and payload share one write */
+#define WEBSOCKET_WBUF_SIZE 65536
+
+/* Receive buffer, one read usually brings in several small frames */
+#define WEBSOCKET_RBUF_SIZE 16384
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+/*
+ * Buffer memory goes through the connection's allocator when it has one.
+ * Buffers that are handed back while idle are only worth it with a pool
+ */
+#define websocket_pooled(ws) ((ws)->opts.allocator != NULL)
+
+static void *websocket_alloc(const websocket_t *ws, size_t size)
+{
+    const struct websocket_allocator *a = ws->opts.allocator;
+
+    return a ? a->alloc(size, a->arg) : malloc(size);
+}
+
+static void *websocket_realloc(const websocket_t *ws, void *ptr,
+                               size_t old_size, size_t size)
+{
+    const struct websocket_allocator *a = ws->opts.allocator;
+
+    if (!a)
+        return realloc(ptr, size);
+    if (!ptr)
+        return a->alloc(size, a->arg);
+    return a->realloc(ptr, old_size, size, a->arg);
+}
+
+static void websocket_free(const websocket_t *ws, void *ptr, size_t size)
+{
+    const struct websocket_allocator *a = ws->opts.allocator;
+
+    if (!ptr)
+        return;
+    if (a)
+        a->free(ptr, size, a->arg);
+    else
+        free(ptr);
+}
+
+static void websocket_log_stderr(const char *msg, void *arg)
+{
+    (void)arg;
+    fputs(msg, stderr);
+}
+
+static websocket_log_cb log_cb = websocket_log_stderr;
+static void *log_arg;
+
+void websocket_set_logger(websocket_log_cb cb, void *arg)
+{
+    log_cb = cb;
+    log_arg = arg;
+}
+
+void websocket_log(const char *fmt, ...)
+{
+    char msg[256];
+    va_list ap;
+
+    /* A silenced logger costs no formatting */
+    if (!log_cb)
+        return;
+
+    va_start(ap, fmt);
+    vsnprintf(msg, sizeof(msg), fmt, ap);
+    va_end(ap);
+
+    log_cb(msg, log_arg);
+}
+
+/* Buffers one sendmsg takes, a frame header plus the caller's iovecs */
+#define WEBSOCKET_IOV_MAX 16
+
+/* Bound for the handshake response head */
+#define WEBSOCKET_HEAD_MAX 8192
+
+/* Hosts whose resolved address is cached, see dns_cache_ttl */
+#define DNS_CACHE_SIZE 16
+
+/* Servers whose TLS session is cached, see tls_session_save */
+#define SESSION_CACHE_SIZE 16
+#define SESSION_MAX 4096
+
+/* Messages shorter than this are not worth compressing */
+#define DEFLATE_MIN_SIZE 128
+
+/* How long closing a connection waits for zerocopy sends to complete */
+#define WEBSOCKET_ZEROCOPY_DRAIN_MS 1000
+
+/* Default bound for a reassembled fragmented message */
+#define WEBSOCKET_MAX_MESSAGE (16 * 1024 * 1024)
+
 struct frame_hdr {
     uint8_t fin;
+    uint8_t rsv1; /* compressed message, permessage-deflate */
     uint8_t opcode;
     uint8_t mask;
+    uint8_t mask_key[4];
+    size_t size;  /* header length */
     uint64_t len; /* payload length */
 };
 
 /*
- * The request MUST include a header field with the name
- * |Sec-WebSocket-Key|.  The value of this header field MUST be a
- * nonce consisting of a randomly selected 16-byte value that has
- * been base64-encoded (see Section 4 of [RFC4648]).  The nonce
- * MUST be selected randomly for each connection.
+ * Network byte order lengths, byte by byte: the header sits at any offset
+ * of the buffer and the host may be big endian. Compilers turn these into
+ * one load or store and a byte swap
+ */
+static uint64_t websocket_load_be64(const uint8_t *p)
+{
+    return (uint64_t)p[0] << 56 | (uint64_t)p[1] << 48 |
+           (uint64_t)p[2] << 40 | (uint64_t)p[3] << 32 |
+           (uint64_t)p[4] << 24 | (uint64_t)p[5] << 16 |
+           (uint64_t)p[6] << 8 | (uint64_t)p[7];
+}
+
+static void websocket_store_be64(uint8_t *p, uint64_t v)
+{
+    p[0] = (uint8_t)(v >> 56);
+    p[1] = (uint8_t)(v >> 48);
+    p[2] = (uint8_t)(v >> 40);
+    p[3] = (uint8_t)(v >> 32);
+    p[4] = (uint8_t)(v >> 24);
+    p[5] = (uint8_t)(v >> 16);
+    p[6] = (uint8_t)(v >> 8);
+    p[7] = (uint8_t)v;
+}
+
+/*
+ * https://datatracker.ietf.org/doc/html/rfc6455#section-5.3
+ * Octet i of the transformed data ("transformed-octet-i") is the XOR of
+ * octet i of the original data ("original-octet-i") with octet at index
+ * i modulo 4 of the masking key ("masking-key-octet-j"):
+ *
+ *   j                   = i MOD 4
+ *   transformed-octet-i = original-octet-i XOR masking-key-octet-j
+ *
+ * The key is kept as a 32-bit word in memory order, so a word/vector load
+ * of the data lines up with the key bytes without any shuffling.
+ */
+typedef void (*mask_fn)(uint8_t *dst, const uint8_t *src, size_t n,
+                        uint32_t key);
+
+static void mask_bytes(uint8_t *dst, const uint8_t *src, size_t n,
+                       uint32_t key)
+{
+    uint8_t k[4];
+    size_t i;
+
+    memcpy(k, &key, sizeof(k));
+    for (i = 0; i < n; i++)
+        dst[i] = src[i] ^ k[i & 3];
+}
+
+static void mask_word(uint8_t *dst, const uint8_t *src, size_t n,
+                      uint32_t key)
+{
+    uint64_t k, w;
+    size_t i = 0;
+
+    k = ((uint64_t)key << 32) | key;
+    for (; i + 8 <= n; i += 8) {
+        memcpy(&w, src + i, 8);
+        w ^= k;
+        memcpy(dst + i, &w, 8);
+    }
+
+    mask_bytes(dst + i, src + i, n - i, key);
+}
+
+#if defined(MASK_X86)
+__attribute__((target("sse2"))) static void
+mask_sse2(uint8_t *dst, const uint8_t *src, size_t n, uint32_t key)
+{
+    __m128i k, a, b, c, d;
+    size_t i = 0;
+
+    k = _mm_set1_epi32((int)key);
+    for (; i + 64 <= n; i += 64) {
+        a = _mm_loadu_si128((const __m128i *)(src + i));
+        b = _mm_loadu_si128((const __m128i *)(src + i + 16));
+        c = _mm_loadu_si128((const __m128i *)(src + i + 32));
+        d = _mm_loadu_si128((const __m128i *)(src + i + 48));
+        _mm_storeu_si128((__m128i *)(dst + i), _mm_xor_si128(a, k));
+        _mm_storeu_si128((__m128i *)(dst + i + 16), _mm_xor_si128(b, k));
+        _mm_storeu_si128((__m128i *)(dst + i + 32), _mm_xor_si128(c, k));
+        _mm_storeu_si128((__m128i *)(dst + i + 48), _mm_xor_si128(d, k));
+    }
+    for (; i + 16 <= n; i += 16) {
+        a = _mm_loadu_si128((const __m128i *)(src + i));
+        _mm_storeu_si128((__m128i *)(dst + i), _mm_xor_si128(a, k));
+    }
+
+    mask_word(dst + i, src + i, n - i, key);
+}
+
+__attribute__((target("avx2"))) static void
+mask_avx2(uint8_t *dst, const uint8_t *src, size_t n, uint32_t key)
+{
+    __m256i k, a, b;
+    size_t i = 0;
+
+    k = _mm256_set1_epi32((int)key);
+    for (; i + 64 <= n; i += 64) {
+        a = _mm256_loadu_si256((const __m256i *)(src + i));
+        b = _mm256_loadu_si256((const __m256i *)(src + i + 32));
+        _mm256_storeu_si256((__m256i *)(dst + i), _mm256_xor_si256(a, k));
+        _mm256_storeu_si256((__m256i *)(dst + i + 32),
+                            _mm256_xor_si256(b, k));
+    }
+    for (; i + 32 <= n; i += 32) {
+        a = _mm256_loadu_si256((const __m256i *)(src + i));
+        _mm256_storeu_si256((__m256i *)(dst + i), _mm256_xor_si256(a, k));
+    }
+
+    mask_word(dst + i, src + i, n - i, key);
+}
+#elif defined(MASK_NEON)
+static void mask_neon(uint8_t *dst, const uint8_t *src, size_t n,
+                      uint32_t key)
+{
+    uint8x16_t k, a, b;
+    size_t i = 0;
+
+    k = vreinterpretq_u8_u32(vdupq_n_u32(key));
+    for (; i + 32 <= n; i += 32) {
+        a = vld1q_u8(src + i);
+        b = vld1q_u8(src + i + 16);
+        vst1q_u8(dst + i, veorq_u8(a, k));
+        vst1q_u8(dst + i + 16, veorq_u8(b, k));
+    }
+    for (; i + 16 <= n; i += 16) {
+        a = vld1q_u8(src + i);
+        vst1q_u8(dst + i, veorq_u8(a, k));
+    }
+
+    mask_word(dst + i, src + i, n - i, key);
+}
+#endif
+
+static mask_fn mask_kernel;
+
+/* Pick the widest kernel the running CPU supports */
+static mask_fn mask_select(void)
+{
+#if defined(MASK_X86)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        return mask_avx2;
+    if (__builtin_cpu_supports("sse2"))
+        return mask_sse2;
+#elif defined(MASK_NEON)
+    return mask_neon;
+#endif
+    return mask_word;
+}
+
+/*
+ * Mask (or unmask, the operation is its own inverse) n bytes from src into
+ * dst, dst may be equal to src. offset is the position of src[0] inside the
+ * frame payload, so a payload can be processed in several pieces.
+ */
+static void websocket_mask(void *dst, const void *src, size_t n,
+                           const uint8_t mask_key[4], uint64_t offset)
+{
+    uint8_t k[4];
+    uint32_t key;
+    size_t i;
+
+    if (n == 0)
+        return;
+
+    /* Rotate the key so that k[0] applies to src[0] */
+    for (i = 0; i < 4; i++)
+        k[i] = mask_key[(offset + i) & 3];
+    memcpy(&key, k, sizeof(key));
+
+    /* Benign race: every thread stores the same pointer */
+    if (!mask_kernel)
+        mask_kernel = mask_select();
+
+    mask_kernel(dst, src, n, key);
+}
+
+/*
+ * https://datatracker.ietf.org/doc/html/rfc6455#section-8.1
+ * When an endpoint is to interpret a byte stream as UTF-8 but finds that
+ * the byte stream is not, in fact, a valid UTF stream, that endpoint MUST
+ * _Fail the WebSocket Connection_.
+ *
+ * A TEXT message is checked piece by piece as it arrives. The state carried
+ * between pieces is the number of continuation bytes still expected and the
+ * range the next one must fall in (RFC 3629 section 4), 0 between characters.
+ */
+#define UTF8_NEED(s) ((s) & 0xff)
+#define UTF8_LO(s) (((s) >> 8) & 0xff)
+#define UTF8_HI(s) (((s) >> 16) & 0xff)
+#define UTF8_STATE(need, lo, hi) ((need) | (lo) << 8 | (hi) << 16)
+
+static int utf8_step(uint32_t *state, uint8_t c)
+{
+    uint32_t s = *state;
+
+    if (UTF8_NEED(s) > 0) {
+        if (c < UTF8_LO(s) || c > UTF8_HI(s))
+            return -1;
+        *state = UTF8_NEED(s) > 1 ? UTF8_STATE(UTF8_NEED(s) - 1, 0x80, 0xbf)
+                                  : 0;
+        return 0;
+    }
+
+    if (c < 0x80)
+        return 0;
+    if (c >= 0xc2 && c <= 0xdf)
+        *state = UTF8_STATE(1, 0x80, 0xbf);
+    else if (c == 0xe0)
+        *state = UTF8_STATE(2, 0xa0, 0xbf); /* overlong */
+    else if (c == 0xed)
+        *state = UTF8_STATE(2, 0x80, 0x9f); /* surrogates */
+    else if (c >= 0xe1 && c <= 0xef)
+        *state = UTF8_STATE(2, 0x80, 0xbf);
+    else if (c == 0xf0)
+        *state = UTF8_STATE(3, 0x90, 0xbf); /* overlong */
+    else if (c >= 0xf1 && c <= 0xf3)
+        *state = UTF8_STATE(3, 0x80, 0xbf);
+    else if (c == 0xf4)
+        *state = UTF8_STATE(3, 0x80, 0x8f); /* above U+10FFFF */
+    else
+        return -1;
+
+    return 0;
+}
+
+/*
+ * Block kernels check whole blocks of a buffer that starts between
+ * characters. They return how many bytes are good up to the start of the
+ * last character of the final block, whose end may lie past the blocks and
+ * is left to utf8_step, or UTF8_BAD.
+ */
+#define UTF8_BAD ((size_t)-1)
+
+typedef size_t (*utf8_fn)(const uint8_t *buf, size_t n);
+
+static size_t utf8_none(const uint8_t *buf, size_t n)
+{
+    (void)buf;
+    (void)n;
+    return 0;
+}
+
+/* Back up from the end of the checked blocks to the last character start */
+static size_t utf8_boundary(const uint8_t *buf, size_t n)
+{
+    size_t i;
+
+    for (i = n; i > 0 && i + 3 > n; i--) {
+        if ((buf[i - 1] & 0xc0) != 0x80)
+            return buf[i - 1] >= 0xc0 ? i - 1 : i;
+    }
+
+    /* Three continuation bytes end a four-byte character */
+    return n;
+}
+
+#if defined(MASK_X86)
+/*
+ * The lookup algorithm of Keiser and Lemire, "Validating UTF-8 In Less Than
+ * One Instruction Per Byte" (2021): three nibble lookups classify every
+ * pair of adjacent bytes and their AND is nonzero for each invalid pair,
+ * except for the third and fourth bytes of a character which are told
+ * apart from stray continuations by looking two and three bytes back.
+ */
+#define UTF8_TOO_SHORT (1 << 0)  /* 11______ 0_______, 11______ 11______ */
+#define UTF8_TOO_LONG (1 << 1)   /* 0_______ 10______ */
+#define UTF8_OVERLONG_3 (1 << 2) /* 11100000 100_____ */
+#define UTF8_TOO_LARGE (1 << 3)  /* 11110100 1001____ and above */
+#define UTF8_SURROGATE (1 << 4)  /* 11101101 101_____ */
+#define UTF8_OVERLONG_2 (1 << 5) /* 1100000_ 10______ */
+#define UTF8_TOO_LARGE_1000 (1 << 6) /* 11110101 1000____ and above */
+#define UTF8_OVERLONG_4 (1 << 6)     /* 11110000 1000____ */
+#define UTF8_TWO_CONTS (1 << 7)      /* 10______ 10______ */
+#define UTF8_CARRY (UTF8_TOO_SHORT | UTF8_TOO_LONG | UTF8_TWO_CONTS)
+
+/* Indexed by the high nibble of the first byte of the pair */
+static const uint8_t utf8_byte_1_high[16] = {
+    UTF8_TOO_LONG, UTF8_TOO_LONG, UTF8_TOO_LONG, UTF8_TOO_LONG,
+    UTF8_TOO_LONG, UTF8_TOO_LONG, UTF8_TOO_LONG, UTF8_TOO_LONG,
+    UTF8_TWO_CONTS, UTF8_TWO_CONTS, UTF8_TWO_CONTS, UTF8_TWO_CONTS,
+    UTF8_TOO_SHORT | UTF8_OVERLONG_2,
+    UTF8_TOO_SHORT,
+    UTF8_TOO_SHORT | UTF8_OVERLONG_3 | UTF8_SURROGATE,
+    UTF8_TOO_SHORT | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000 | UTF8_OVERLONG_4,
+};
+
+/* Indexed by the low nibble of the first byte */
+static const uint8_t utf8_byte_1_low[16] = {
+    UTF8_CARRY | UTF8_OVERLONG_3 | UTF8_OVERLONG_2 | UTF8_OVERLONG_4,
+    UTF8_CARRY | UTF8_OVERLONG_2,
+    UTF8_CARRY,
+    UTF8_CARRY,
+    UTF8_CARRY | UTF8_TOO_LARGE,
+    UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+    UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+    UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+    UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+    UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+    UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+    UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+    UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+    UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000 | UTF8_SURROGATE,
+    UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+    UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+};
+
+/* Indexed by the high nibble of the second byte */
+static const uint8_t utf8_byte_2_high[16] = {
+    UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT,
+    UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT,
+    UTF8_TOO_LONG | UTF8_OVERLONG_2 | UTF8_TWO_CONTS | UTF8_OVERLONG_3 |
+        UTF8_TOO_LARGE_1000 | UTF8_OVERLONG_4,
+    UTF8_TOO_LONG | UTF8_OVERLONG_2 | UTF8_TWO_CONTS | UTF8_OVERLONG_3 |
+        UTF8_TOO_LARGE,
+    UTF8_TOO_LONG | UTF8_OVERLONG_2 | UTF8_TWO_CONTS | UTF8_SURROGATE |
+        UTF8_TOO_LARGE,
+    UTF8_TOO_LONG | UTF8_OVERLONG_2 | UTF8_TWO_CONTS | UTF8_SURROGATE |
+        UTF8_TOO_LARGE,
+    UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT,
+};
+
+/*
+ * Subtracted with saturation from the last 16 bytes of a block, nonzero
+ * where a character starts that needs bytes of the next block
+ */
+static const uint8_t utf8_incomplete[16] = {
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xef, 0xdf, 0xbf,
+};
+
+__attribute__((target("ssse3"))) static size_t utf8_ssse3(const uint8_t *buf,
+                                                          size_t n)
+{
+    const __m128i b1h = _mm_loadu_si128((const __m128i *)utf8_byte_1_high);
+    const __m128i b1l = _mm_loadu_si128((const __m128i *)utf8_byte_1_low);
+    const __m128i b2h = _mm_loadu_si128((const __m128i *)utf8_byte_2_high);
+    const __m128i incomplete =
+        _mm_loadu_si128((const __m128i *)utf8_incomplete);
+    const __m128i nibble = _mm_set1_epi8(0x0f);
+    __m128i in, prev = _mm_setzero_si128(), prev1, prev2, prev3, sc, must23;
+    __m128i err = _mm_setzero_si128(), pending = _mm_setzero_si128();
+    size_t i;
+
+    for (i = 0; i + 16 <= n; i += 16) {
+        in = _mm_loadu_si128((const __m128i *)(buf + i));
+
+        /* ASCII only has to rule out a character cut short before it */
+        if (_mm_movemask_epi8(in) == 0) {
+            err = _mm_or_si128(err, pending);
+            pending = _mm_setzero_si128();
+            prev = in;
+            continue;
+        }
+
+        prev1 = _mm_alignr_epi8(in, prev, 15);
+        sc = _mm_and_si128(
+            _mm_and_si128(
+                _mm_shuffle_epi8(b1h, _mm_and_si128(_mm_srli_epi16(prev1, 4),
+                                                    nibble)),
+                _mm_shuffle_epi8(b1l, _mm_and_si128(prev1, nibble))),
+            _mm_shuffle_epi8(b2h,
+                             _mm_and_si128(_mm_srli_epi16(in, 4), nibble)));
+
+        prev2 = _mm_alignr_epi8(in, prev, 14);
+        prev3 = _mm_alignr_epi8(in, prev, 13);
+        must23 = _mm_or_si128(_mm_subs_epu8(prev2, _mm_set1_epi8(0x60)),
+                              _mm_subs_epu8(prev3, _mm_set1_epi8(0x70)));
+        must23 = _mm_and_si128(must23, _mm_set1_epi8((char)0x80));
+        err = _mm_or_si128(err, _mm_xor_si128(must23, sc));
+
+        pending = _mm_subs_epu8(in, incomplete);
+        prev = in;
+    }
+
+    /* A character cut by the end of the blocks is left to utf8_step */
+    if (_mm_movemask_epi8(_mm_cmpeq_epi8(err, _mm_setzero_si128())) != 0xffff)
+        return UTF8_BAD;
+
+    return utf8_boundary(buf, i);
+}
+
+__attribute__((target("avx2"))) static size_t utf8_avx2(const uint8_t *buf,
+                                                        size_t n)
+{
+    /* The lookups shuffle within each lane, both get the same table */
+    const __m256i b1h = _mm256_broadcastsi128_si256(
+        _mm_loadu_si128((const __m128i *)utf8_byte_1_high));
+    const __m256i b1l = _mm256_broadcastsi128_si256(
+        _mm_loadu_si128((const __m128i *)utf8_byte_1_low));
+    const __m256i b2h = _mm256_broadcastsi128_si256(
+        _mm_loadu_si128((const __m128i *)utf8_byte_2_high));
+    const __m256i incomplete = _mm256_inserti128_si256(
+        _mm256_set1_epi8(-1), _mm_loadu_si128((const __m128i *)utf8_incomplete),
+        1);
+    const __m256i nibble = _mm256_set1_epi8(0x0f);
+    __m256i in, prev = _mm256_setzero_si256(), shift, prev1, prev2, prev3;
+    __m256i sc, must23;
+    __m256i err = _mm256_setzero_si256(), pending = _mm256_setzero_si256();
+    size_t i;
+
+    for (i = 0; i + 32 <= n; i += 32) {
+        in = _mm256_loadu_si256((const __m256i *)(buf + i));
+
+        if (_mm256_movemask_epi8(in) == 0) {
+            err = _mm256_or_si256(err, pending);
+            pending = _mm256_setzero_si256();
+            prev = in;
+            continue;
+        }
+
+        /* alignr works within 128-bit lanes, feed each lane its predecessor */
+        shift = _mm256_permute2x128_si256(prev, in, 0x21);
+        prev1 = _mm256_alignr_epi8(in, shift, 15);
+        sc = _mm256_and_si256(
+            _mm256_and_si256(
+                _mm256_shuffle_epi8(
+                    b1h, _mm256_and_si256(_mm256_srli_epi16(prev1, 4), nibble)),
+                _mm256_shuffle_epi8(b1l, _mm256_and_si256(prev1, nibble))),
+            _mm256_shuffle_epi8(
+                b2h, _mm256_and_si256(_mm256_srli_epi16(in, 4), nibble)));
+
+        prev2 = _mm256_alignr_epi8(in, shift, 14);
+        prev3 = _mm256_alignr_epi8(in, shift, 13);
+        must23 = _mm256_or_si256(_mm256_subs_epu8(prev2, _mm256_set1_epi8(0x60)),
+                                 _mm256_subs_epu8(prev3, _mm256_set1_epi8(0x70)));
+        must23 = _mm256_and_si256(must23, _mm256_set1_epi8((char)0x80));
+        err = _mm256_or_si256(err, _mm256_xor_si256(must23, sc));
+
+        pending = _mm256_subs_epu8(in, incomplete);
+        prev = in;
+    }
+
+    if (!_mm256_testz_si256(err, err))
+        return UTF8_BAD;
+
+    return utf8_boundary(buf, i);
+}
+#endif
+
+static utf8_fn utf8_kernel;
+
+static utf8_fn utf8_select(void)
+{
+#if defined(MASK_X86)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        return utf8_avx2;
+    if (__builtin_cpu_supports("ssse3"))
+        return utf8_ssse3;
+#endif
+    return utf8_none;
+}
+
+/* Check the next n bytes of a UTF-8 stream, return -1 if they are invalid */
+static int websocket_utf8(uint32_t *state, const uint8_t *buf, size_t n)
+{
+    uint64_t w;
+    size_t i = 0, good;
+
+    /* Finish the character the previous piece ended in */
+    while (i < n && *state != 0) {
+        if (utf8_step(state, buf[i++]) == -1)
+            return -1;
+    }
+
+    /* Benign race: every thread stores the same pointer */
+    if (!utf8_kernel)
+        utf8_kernel = utf8_select();
+
+    good = utf8_kernel(buf + i, n - i);
+    if (good == UTF8_BAD)
+        return -1;
+
+    for (i += good; i < n; i++) {
+        /* Between characters ASCII is skipped a word at a time */
+        if (*state == 0) {
+            for (; i + 8 <= n; i += 8) {
+                memcpy(&w, buf + i, 8);
+                if (w & 0x8080808080808080ULL)
+                    break;
+            }
+            if (i == n)
+                break;
+        }
+        if (utf8_step(state, buf[i]) == -1)
+            return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * I/O helpers. In blocking mode everything goes through net_read/net_write.
+ * In non-blocking mode a would-block is reported as WEBSOCKET_WANT_READ or
+ * WEBSOCKET_WANT_WRITE, and framed bytes the socket does not take are kept
+ * in the output queue until websocket_flush.
+ */
+
+static int websocket_would_block(void)
+{
+    return errno == EAGAIN || errno == EWOULDBLOCK;
+}
+
+/*
+ * With kernel TLS the socket encrypts and decrypts by itself and the net
+ * layer's TLS is bypassed, these tell whether a direction is a plain socket
+ */
+#define websocket_raw_tx(ws) (!(ws)->tls || (ws)->ktls_tx)
+#define websocket_raw_rx(ws) (!(ws)->tls || (ws)->ktls_rx)
+
+#if defined(__linux__) && defined(TLS_RX)
+/*
+ * Read application data off a kernel TLS socket. Other records come back
+ * alone with their type in a control message: a session ticket is dropped,
+ * an alert ends the session
+ */
+static ssize_t websocket_ktls_recvv(websocket_t *ws, struct iovec *iov,
+                                    int cnt, int flags)
+{
+    char cbuf[CMSG_SPACE(sizeof(unsigned char))];
+    struct cmsghdr *cmsg;
+    struct msghdr msg;
+    ssize_t ret;
+
+    for (;;) {
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = cnt;
+        msg.msg_control = cbuf;
+        msg.msg_controllen = sizeof(cbuf);
+
+        ret = recvmsg(ws->fd, &msg, flags);
+        if (ret == -1 && errno == EINTR)
+            continue;
+        if (ret <= 0)
+            return ret;
+
+        cmsg = CMSG_FIRSTHDR(&msg);
+        if (!cmsg || cmsg->cmsg_level != SOL_TLS ||
+            cmsg->cmsg_type != TLS_GET_RECORD_TYPE ||
+            *CMSG_DATA(cmsg) == 23) /* application_data */
+            return ret;
+        if (*CMSG_DATA(cmsg) != 22) { /* handshake */
+            errno = ECONNRESET;
+            return -1;
+        }
+    }
+}
+#else
+static ssize_t websocket_ktls_recvv(websocket_t *ws, struct iovec *iov,
+                                    int cnt, int flags)
+{
+    struct msghdr msg;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = cnt;
+
+    return recvmsg(ws->fd, &msg, flags);
+}
+#endif
+
+static ssize_t websocket_ktls_recv(websocket_t *ws, void *buf, size_t n,
+                                   int flags)
+{
+    struct iovec iov;
+
+    iov.iov_base = buf;
+    iov.iov_len = n;
+
+    return websocket_ktls_recvv(ws, &iov, 1, flags);
+}
+
+static int websocket_sock_read(websocket_t *ws, void *buf, size_t n)
+{
+    if (!ws->ktls_rx)
+        return net_read(&ws->net, buf, n);
+    return (int)websocket_ktls_recv(ws, buf, n, 0);
+}
+
+static int websocket_sock_readn(websocket_t *ws, void *buf, size_t n)
+{
+    size_t off = 0;
+    ssize_t ret;
+
+    if (!ws->ktls_rx)
+        return net_readn(&ws->net, buf, n);
+
+    while (off < n) {
+        ret = websocket_ktls_recv(ws, (uint8_t *)buf + off, n - off, 0);
+        if (ret <= 0)
+            return -1;
+        off += (size_t)ret;
+    }
+
+    return (int)n;
+}
+
+/* Scatter read on a plain or kernel TLS socket, see websocket_raw_rx */
+static ssize_t websocket_sock_readv(websocket_t *ws, struct iovec *iov,
+                                    int cnt)
+{
+    ssize_t ret;
+
+    if (ws->ktls_rx)
+        return websocket_ktls_recvv(ws, iov, cnt, 0);
+
+    do {
+        ret = readv(ws->fd, iov, cnt);
+    } while (ret == -1 && errno == EINTR);
+
+    return ret;
+}
+
+static int websocket_sock_write(websocket_t *ws, const void *buf, size_t n)
+{
+    size_t off = 0;
+    ssize_t ret;
+
+    if (!ws->ktls_tx)
+        return net_write(&ws->net, buf, n);
+
+    while (off < n) {
+        ret = send(ws->fd, (const uint8_t *)buf + off, n - off, MSG_NOSIGNAL);
+        if (ret == -1 && errno == EINTR)
+            continue;
+        if (ret == -1)
+            return -1;
+        off += (size_t)ret;
+    }
+
+    return (int)n;
+}
+
+static int websocket_io_read(websocket_t *ws, void *buf, size_t n)
+{
+    int ret;
+
+    /* The owner reads the socket and hands the bytes over */
+    if (ws->fed)
+        return WEBSOCKET_WANT_READ;
+
+    /* Do not wait for a reply that is still sitting in a corked queue */
+    if (!ws->nonblock && websocket_queued(ws) > 0 && websocket_flush(ws) == -1)
+        return -1;
+
+    errno = 0;
+    ret = websocket_sock_read(ws, buf, n);
+    ws->stats.reads++;
+    if (ret > 0) {
+        ws->stats.bytes_in += ret;
+        return ret;
+    }
+
+    if (ws->nonblock && ret == -1 && websocket_would_block())
+        return WEBSOCKET_WANT_READ;
+
+    websocket_log("net_read error\n");
+    return -1;
+}
+
+/*
+ * Non-blocking write, return the number of bytes taken. Plain TCP uses send
+ * so partial writes are accounted exactly. Over TLS net_write either takes
+ * everything or nothing and is retried later with the same bytes
+ */
+static int websocket_io_write(websocket_t *ws, const void *buf, size_t n)
+{
+    ssize_t ret;
+
+    errno = 0;
+    if (!websocket_raw_tx(ws))
+        ret = net_write(&ws->net, buf, n);
+    else
+        ret = send(ws->fd, buf, n, MSG_NOSIGNAL);
+    ws->stats.writes++;
+    if (ret >= 0) {
+        ws->stats.bytes_out += ret;
+        return (int)ret;
+    }
+
+    if (errno == EINTR)
+        return 0;
+    if (websocket_would_block())
+        return WEBSOCKET_WANT_WRITE;
+
+    websocket_log("net_write error\n");
+    return -1;
+}
+
+static uint64_t websocket_now_usec(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000;
+}
+
+size_t websocket_queued(const websocket_t *ws)
+{
+    return ws->olen - ws->opos + ws->oref_bytes;
+}
+
+/* Report the output queue crossing a watermark, once per crossing */
+static void websocket_watermark(websocket_t *ws)
+{
+    size_t queued = websocket_queued(ws);
+
+    if (!ws->on_watermark)
+        return;
+
+    if (!ws->above_wm && queued >= ws->high_wm) {
+        ws->above_wm = 1;
+        ws->on_watermark(ws, 1, ws->watermark_arg);
+    } else if (ws->above_wm && queued <= ws->low_wm) {
+        ws->above_wm = 0;
+        ws->on_watermark(ws, 0, ws->watermark_arg);
+    }
+}
+
+static int websocket_obuf_append(websocket_t *ws, const void *buf, size_t n)
+{
+    struct websocket_oref *ref;
+    unsigned char *obuf;
+    size_t cap;
+
+    /* Reclaim the space already written */
+    if (ws->opos > 0 && ws->olen + n > ws->ocap) {
+        memmove(ws->obuf, ws->obuf + ws->opos, ws->olen - ws->opos);
+        for (ref = ws->oref_head; ref; ref = ref->next)
+            ref->at -= ws->opos;
+        ws->olen -= ws->opos;
+        ws->opos = 0;
+    }
+
+    if (ws->olen + n > ws->ocap) {
+        cap = ws->ocap ? ws->ocap : 4096;
+        while (cap < ws->olen + n)
+            cap *= 2;
+        obuf = websocket_realloc(ws, ws->obuf, ws->ocap, cap);
+        if (!obuf) {
+            websocket_log("realloc error\n");
+            return -1;
+        }
+        ws->obuf = obuf;
+        ws->ocap = cap;
+    }
+
+    memcpy(ws->obuf + ws->olen, buf, n);
+    ws->olen += n;
+
+    websocket_watermark(ws);
+
+    return 0;
+}
+
+/* Write queued bytes, a blocking socket takes all of them */
+static int websocket_flush_write(websocket_t *ws, const void *buf, size_t n)
+{
+    if (ws->nonblock)
+        return websocket_io_write(ws, buf, n);
+
+    ws->stats.writes++;
+    if (websocket_sock_write(ws, buf, n) == -1) {
+        websocket_log("net_write error\n");
+        return -1;
+    }
+    ws->stats.bytes_out += n;
+
+    return (int)n;
+}
+
+/* Drop the first prepared frame of the queue, it is written */
+static void websocket_oref_pop(websocket_t *ws)
+{
+    struct websocket_oref *ref = ws->oref_head;
+
+    ws->oref_bytes -= ref->len - ref->off;
+    ws->oref_head = ref->next;
+    if (!ws->oref_head)
+        ws->oref_tail = NULL;
+    websocket_prepared_unref(ref->p);
+    free(ref);
+}
+
+/* The queue is empty, start over at the front */
+static void websocket_output_drained(websocket_t *ws)
+{
+    ws->opos = ws->olen = 0;
+    websocket_watermark(ws);
+
+    if (websocket_pooled(ws) && ws->obuf) {
+        websocket_free(ws, ws->obuf, ws->ocap);
+        ws->obuf = NULL;
+        ws->ocap = 0;
+    }
+}
+
+int websocket_flush(websocket_t *ws)
+{
+    struct websocket_oref *ref;
+    size_t limit;
+    int ret;
+
+    while (websocket_queued(ws) > 0) {
+        /* Bytes queued ahead of the next prepared frame go first */
+        ref = ws->oref_head;
+        limit = ref ? ref->at : ws->olen;
+        if (ws->opos < limit) {
+            ret = websocket_flush_write(ws, ws->obuf + ws->opos,
+                                        limit - ws->opos);
+            if (ret < 0) {
+                websocket_watermark(ws);
+                return ret;
+            }
+            ws->opos += ret;
+            continue;
+        }
+
+        ret = websocket_flush_write(ws, ref->frame + ref->off,
+                                    ref->len - ref->off);
+        if (ret < 0) {
+            websocket_watermark(ws);
+            return ret;
+        }
+        ref->off += ret;
+        ws->oref_bytes -= ret;
+        if (ref->off == ref->len)
+            websocket_oref_pop(ws);
+    }
+
+    websocket_output_drained(ws);
+
+    return 0;
+}
+
+int websocket_output_spans(const websocket_t *ws, struct iovec *iov, int max)
+{
+    struct websocket_oref *ref = ws->oref_head;
+    size_t pos = ws->opos, limit;
+    int n = 0;
+
+    while (n < max) {
+        limit = ref ? ref->at : ws->olen;
+        if (pos < limit) {
+            iov[n].iov_base = ws->obuf + pos;
+            iov[n++].iov_len = limit - pos;
+            pos = limit;
+            continue;
+        }
+        if (!ref)
+            break;
+        iov[n].iov_base = (void *)(ref->frame + ref->off);
+        iov[n++].iov_len = ref->len - ref->off;
+        ref = ref->next;
+    }
+
+    return n;
+}
+
+void websocket_output_done(websocket_t *ws, size_t n)
+{
+    struct websocket_oref *ref;
+    size_t limit, k;
+
+    ws->stats.writes++;
+    ws->stats.bytes_out += n;
+
+    /* The same walk as websocket_flush, only counting */
+    while (n > 0 && websocket_queued(ws) > 0) {
+        ref = ws->oref_head;
+        limit = ref ? ref->at : ws->olen;
+        if (ws->opos < limit) {
+            k = limit - ws->opos < n ? limit - ws->opos : n;
+            ws->opos += k;
+            n -= k;
+            continue;
+        }
+
+        k = ref->len - ref->off < n ? ref->len - ref->off : n;
+        ref->off += k;
+        ws->oref_bytes -= k;
+        n -= k;
+        if (ref->off == ref->len)
+            websocket_oref_pop(ws);
+    }
+
+    if (websocket_queued(ws) == 0)
+        websocket_output_drained(ws);
+    else
+        websocket_watermark(ws);
+}
+
+int websocket_set_cork(websocket_t *ws, int on, size_t bytes,
+                       unsigned int usec)
+{
+    int ret;
+
+    ws->cork = on;
+    ws->cork_bytes = bytes ? bytes : WEBSOCKET_WBUF_SIZE;
+    ws->cork_usec = usec;
+
+    if (on)
+        return 0;
+
+    ret = websocket_flush(ws);
+    return ret == WEBSOCKET_WANT_WRITE ? 0 : ret;
+}
+
+void websocket_set_watermarks(websocket_t *ws, size_t high, size_t low,
+                              websocket_watermark_cb cb, void *arg)
+{
+    ws->high_wm = high;
+    ws->low_wm = low < high ? low : high;
+    ws->on_watermark = high ? cb : NULL;
+    ws->watermark_arg = arg;
+    ws->above_wm = 0;
+}
+
+/*
+ * Corked output: small frames pile up in the queue and leave in one write
+ * once the size or age threshold is reached. A frame of the threshold size
+ * or more is not worth copying, the queue is flushed ahead of it and it
+ * takes the direct path
+ */
+static int websocket_cork_output(websocket_t *ws, const void *buf, size_t n)
+{
+    int ret;
+
+    if (n >= ws->cork_bytes) {
+        ret = websocket_flush(ws);
+        return ret == -1 ? -1 : 1;
+    }
+
+    if (ws->cork_usec && websocket_queued(ws) == 0)
+        ws->cork_start = websocket_now_usec();
+
+    if (websocket_obuf_append(ws, buf, n) == -1)
+        return -1;
+
+    if (websocket_queued(ws) < ws->cork_bytes &&
+        (!ws->cork_usec ||
+         websocket_now_usec() - ws->cork_start < ws->cork_usec))
+        return 0;
+
+    ret = websocket_flush(ws);
+    return ret == -1 ? -1 : 0;
+}
+
+/* Write framed bytes, queueing what a non-blocking socket does not take */
+static int websocket_output(websocket_t *ws, const void *buf, size_t n)
+{
+    int ret;
+
+    /* A loop that defers flushing coalesces per batch already */
+    if (ws->cork && !ws->on_output) {
+        ret = websocket_cork_output(ws, buf, n);
+        if (ret != 1)
+            return ret;
+    }
+
+    if (!ws->nonblock) {
+        if (websocket_queued(ws) > 0 && websocket_flush(ws) == -1)
+            return -1;
+        ret = websocket_sock_write(ws, buf, n);
+        ws->stats.writes++;
+        if (ret == -1) {
+            websocket_log("net_write error\n");
+            return -1;
+        }
+        ws->stats.bytes_out += n;
+        return 0;
+    }
+
+    /* Deferred flush, the owner writes the queue once per batch */
+    if (ws->on_output) {
+        ret = websocket_obuf_append(ws, buf, n);
+        if (ret == 0)
+            ws->on_output(ws);
+        return ret;
+    }
+
+    /* Keep the byte order, only try the socket when nothing is queued */
+    if (websocket_queued(ws) == 0) {
+        ret = websocket_io_write(ws, buf, n);
+        if (ret == -1)
+            return -1;
+        if (ret == WEBSOCKET_WANT_WRITE)
+            ret = 0;
+        buf = (const uint8_t *)buf + ret;
+        n -= ret;
+        if (n == 0)
+            return 0;
+    }
+
+    return websocket_obuf_append(ws, buf, n);
+}
+
+/* Grow the receive buffer to hold at least n bytes */
+static int websocket_rbuf_reserve(websocket_t *ws, size_t n)
+{
+    unsigned char *rbuf;
+    size_t size;
+
+    if (n <= ws->rsize)
+        return 0;
+
+    size = ws->rsize ? ws->rsize : WEBSOCKET_RBUF_SIZE;
+    while (size < n)
+        size *= 2;
+
+    rbuf = websocket_realloc(ws, ws->rbuf, ws->rsize, size);
+    if (!rbuf) {
+        websocket_log("realloc error\n");
+        return -1;
+    }
+    ws->rbuf = rbuf;
+    ws->rsize = size;
+
+    return 0;
+}
+
+/*
+ * Make sure at least n bytes are buffered, reading as much as the buffer can
+ * take with each net_read. Return 0, WEBSOCKET_WANT_READ or -1
+ */
+static int websocket_fill(websocket_t *ws, size_t n)
+{
+    size_t avail = ws->rlen - ws->rpos;
+    int ret;
+
+    if (avail >= n)
+        return 0;
+
+    if (websocket_rbuf_reserve(ws, n) == -1)
+        return -1;
+
+    /* Move the unread bytes to the front when the tail is too short */
+    if (ws->rpos + n > ws->rsize) {
+        memmove(ws->rbuf, ws->rbuf + ws->rpos, avail);
+        ws->rpos = 0;
+        ws->rlen = avail;
+    }
+
+    while (ws->rlen - ws->rpos < n) {
+        ret = websocket_io_read(ws, ws->rbuf + ws->rlen, ws->rsize - ws->rlen);
+        if (ret < 0) {
+            /* Nothing buffered, an idle connection keeps no receive buffer */
+            if (ret == WEBSOCKET_WANT_READ && websocket_pooled(ws) &&
+                ws->rpos == ws->rlen && ws->view == 0) {
+                websocket_free(ws, ws->rbuf, ws->rsize);
+                ws->rbuf = NULL;
+                ws->rsize = ws->rpos = ws->rlen = 0;
+            }
+            return ret;
+        }
+        ws->rlen += ret;
+        if (ws->rlen - ws->rpos < n)
+            ws->stats.partial_reads++;
+    }
+
+    return 0;
+}
+
+/*
+ * Read n bytes straight into buf with readv, the buffer's free space as the
+ * second vector so the bytes after the payload, usually the next header,
+ * arrive in the same call instead of costing another read. The buffer must
+ * be empty
+ */
+static int websocket_readv_direct(websocket_t *ws, uint8_t *buf, size_t n)
+{
+    struct iovec iov[2];
+    size_t off = 0;
+    ssize_t ret;
+
+    if (websocket_rbuf_reserve(ws, WEBSOCKET_RBUF_SIZE) == -1)
+        return -1;
+
+    while (off < n) {
+        iov[0].iov_base = buf + off;
+        iov[0].iov_len = n - off;
+        iov[1].iov_base = ws->rbuf + ws->rlen;
+        iov[1].iov_len = ws->rsize - ws->rlen;
+        ret = websocket_sock_readv(ws, iov, 2);
+        ws->stats.reads++;
+        if (ret <= 0) {
+            websocket_log("readv error\n");
+            return -1;
+        }
+        ws->stats.bytes_in += (uint64_t)ret;
+        if ((size_t)ret < n - off) {
+            off += (size_t)ret;
+            ws->stats.partial_reads++;
+            continue;
+        }
+        ws->rlen += (size_t)ret - (n - off);
+        off = n;
+    }
+
+    return 0;
+}
+
+/*
+ * Read exactly n bytes, buffered bytes first. In non-blocking mode the bytes
+ * are known to be resident, in blocking mode the rest is waited for. buf may
+ * be NULL when n is 0
+ */
+static int websocket_readn(websocket_t *ws, void *buf, size_t n)
+{
+    size_t avail = ws->rlen - ws->rpos;
+    int ret;
+
+    if (n == 0)
+        return 0;
+
+    if (avail >= n) {
+        memcpy(buf, ws->rbuf + ws->rpos, n);
+        ws->rpos += n;
+        return (int)n;
+    }
+
+    if (avail > 0)
+        memcpy(buf, ws->rbuf + ws->rpos, avail);
+    ws->rpos = ws->rlen = 0;
+
+    /* Large reads bypass the buffer, small ones refill it */
+    if (n - avail >= WEBSOCKET_RBUF_SIZE / 2 && websocket_raw_rx(ws)) {
+        if (websocket_readv_direct(ws, (uint8_t *)buf + avail, n - avail) == -1)
+            return -1;
+        return (int)n;
+    }
+    if (n - avail >= WEBSOCKET_RBUF_SIZE / 2) {
+        ret = websocket_sock_readn(ws, (uint8_t *)buf + avail, n - avail);
+        ws->stats.reads++;
+        if (ret == -1) {
+            websocket_log("net_readn error\n");
+            return -1;
+        }
+        ws->stats.bytes_in += n - avail;
+        return (int)n;
+    }
+
+    ret = websocket_fill(ws, n - avail);
+    if (ret < 0)
+        return ret;
+
+    memcpy((uint8_t *)buf + avail, ws->rbuf, n - avail);
+    ws->rpos = n - avail;
+
+    return (int)n;
+}
+
+/* Fill buf from the system CSPRNG */
+static int websocket_getrandom(void *buf, size_t n)
+{
+#if defined(__linux__)
+    unsigned char *ptr = buf;
+    ssize_t ret;
+
+    while (n > 0) {
+        ret = getrandom(ptr, n, 0);
+        if (ret == -1) {
+            if (errno == EINTR)
+                continue;
+            websocket_log("getrandom error\n");
+            return -1;
+        }
+        ptr += ret;
+        n -= (size_t)ret;
+    }
+    return 0;
+#elif defined(__APPLE__) || defined(__FreeBSD__) || defined(__OpenBSD__) || \
+    defined(__NetBSD__)
+    arc4random_buf(buf, n);
+    return 0;
+#else
+    unsigned char *ptr = buf;
+    ssize_t ret;
+    int fd;
+
+    fd = open("/dev/urandom", O_RDONLY);
+    if (fd == -1) {
+        websocket_log("open /dev/urandom error\n");
+        return -1;
+    }
+    while (n > 0) {
+        ret = read(fd, ptr, n);
+        if (ret <= 0) {
+            if (ret == -1 && errno == EINTR)
+                continue;
+            close(fd);
+            websocket_log("read /dev/urandom error\n");
+            return -1;
+        }
+        ptr += ret;
+        n -= (size_t)ret;
+    }
+    close(fd);
+    return 0;
+#endif
+}
+
+/* splitmix64, reproducible and fast, not a CSPRNG */
+static uint64_t websocket_splitmix64(uint64_t *state)
+{
+    uint64_t z = (*state += 0x9e3779b97f4a7c15ULL);
+
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+/*
+ * n random bytes from the connection's batch. One getrandom refills
+ * sizeof(ws->rnd) bytes, that is 64 masking keys per system call
+ */
+static int websocket_random(websocket_t *ws, uint8_t *buf, size_t n)
+{
+    uint8_t *ptr;
+    uint64_t v;
+    size_t i, take;
+
+    while (n > 0) {
+        if (ws->rnd_left == 0) {
+            if (ws->opts.mask_seed) {
+                if (ws->rnd_state == 0)
+                    ws->rnd_state = ws->opts.mask_seed;
+                for (i = 0; i < sizeof(ws->rnd); i += 8) {
+                    v = websocket_splitmix64(&ws->rnd_state);
+                    memcpy(ws->rnd + i, &v, 8);
+                }
+            } else if (websocket_getrandom(ws->rnd, sizeof(ws->rnd)) == -1) {
+                return -1;
+            }
+            ws->rnd_left = sizeof(ws->rnd);
+        }
+        take = ws->rnd_left < n ? ws->rnd_left : n;
+        ptr = ws->rnd + sizeof(ws->rnd) - ws->rnd_left;
+        memcpy(buf, ptr, take);
+        /* Handed out bytes are not kept around */
+        memset(ptr, 0, take);
+        ws->rnd_left -= take;
+        buf += take;
+        n -= take;
+    }
+
+    return 0;
+}
+
+/*
+ * The request MUST include a header field with the name
+ * |Sec-WebSocket-Key|.  The value of this header field MUST be a
+ * nonce consisting of a randomly selected 16-byte value that has
+ * been base64-encoded (see Section 4 of [RFC4648]).  The nonce
+ * MUST be selected randomly for each connection.
+ */
+static int generate_websocket_key(websocket_t *ws, unsigned char *buf,
+                                  size_t size)
+{
+    unsigned char tmp[16];
+    size_t olen;
+
+    if (websocket_random(ws, tmp, sizeof(tmp)) == -1)
+        return -1;
+
+    if (mbedtls_base64_encode(buf, size, &olen, tmp, sizeof(tmp)) != 0) {
+        websocket_log("mbedtls_base64_encode error\n");
+        return -1;
+    }
+
+    return olen;
+}
+
+/* https://datatracker.ietf.org/doc/html/rfc6455#section-1.3 */
+static int generate_websocket_accept(const unsigned char *ws_key,
+                                     unsigned char ac_key[128])
+{
+    char buf[256] = {0};
+    unsigned char output[20];
+    int ret;
+    mbedtls_sha1_context sha1;
+    size_t olen;
+
+    ret = snprintf(buf, sizeof(buf), "%s%s", ws_key, WEBSOCKET_GUID);
+    if (ret <= 0 || (size_t)ret >= sizeof(buf)) {
+        websocket_log("websocke-key or GUID length limit\n");
+        return -1;
+    }
+
+    mbedtls_sha1_init(&sha1);
+    mbedtls_sha1_starts(&sha1);
+    mbedtls_sha1_update(&sha1, (unsigned char *)buf, (size_t)ret);
+    mbedtls_sha1_finish(&sha1, output);
+    mbedtls_sha1_free(&sha1);
+
+    if (mbedtls_base64_encode(ac_key, 128, &olen, output, 20) != 0) {
+        websocket_log("mbedtls_base64_encode error\n");
+        return -1;
+    }
+
+    return (int)olen;
+}
+
+/*
+ * permessage-deflate, https://datatracker.ietf.org/doc/html/rfc7692
+ * Both zlib streams are set up once when the extension is negotiated and
+ * reused for every message, with context takeover the LZ77 window carries
+ * over from one message to the next.
+ */
+struct websocket_deflate {
+    z_stream tx;        /* messages we send */
+    z_stream rx;        /* messages we receive */
+    int tx_no_takeover; /* our side's *_no_context_takeover */
+    int tx_bits;        /* LZ77 window of the messages we send */
+    int rx_no_takeover; /* the peer's *_no_context_takeover */
+    unsigned char *zbuf; /* compressed form of the message being sent */
+    size_t zcap;
+};
+
+static void websocket_deflate_free(websocket_t *ws)
+{
+    struct websocket_deflate *z = ws->zctx;
+
+    if (!z)
+        return;
+
+    deflateEnd(&z->tx);
+    inflateEnd(&z->rx);
+    websocket_free(ws, z->zbuf, z->zcap);
+    free(z);
+    ws->zctx = NULL;
+}
+
+/* Build the Sec-WebSocket-Extensions offer */
+static int websocket_deflate_offer(const struct websocket_options *opts,
+                                   char *buf, size_t size)
+{
+    int ret;
+
+    ret = snprintf(buf, size, "Sec-WebSocket-Extensions: permessage-deflate");
+    if (opts->client_max_window_bits)
+        ret += snprintf(buf + ret, size - ret, "; client_max_window_bits=%d",
+                        opts->client_max_window_bits);
+    else
+        ret += snprintf(buf + ret, size - ret, "; client_max_window_bits");
+    if (opts->server_max_window_bits)
+        ret += snprintf(buf + ret, size - ret, "; server_max_window_bits=%d",
+                        opts->server_max_window_bits);
+    if (opts->client_no_context_takeover)
+        ret += snprintf(buf + ret, size - ret, "; client_no_context_takeover");
+    if (opts->server_no_context_takeover)
+        ret += snprintf(buf + ret, size - ret, "; server_no_context_takeover");
+    ret += snprintf(buf + ret, size - ret, "\r\n");
+
+    if ((size_t)ret >= size) {
+        websocket_log("extension offer too long\n");
+        return -1;
+    }
+
+    return ret;
+}
+
+static char *websocket_trim(char *str)
+{
+    char *end;
+
+    while (*str == ' ' || *str == '\t')
+        str++;
+    end = str + strlen(str);
+    while (end > str && (end[-1] == ' ' || end[-1] == '\t'))
+        *--end = '\0';
+
+    return str;
+}
+
+/* Set up the zlib streams of a negotiated permessage-deflate */
+static int websocket_deflate_start(websocket_t *ws,
+                                   struct websocket_deflate *z, int tx_bits,
+                                   int rx_bits)
+{
+    int level;
+
+    level = ws->opts.deflate_level ? ws->opts.deflate_level
+                                   : Z_DEFAULT_COMPRESSION;
+    if (deflateInit2(&z->tx, level, Z_DEFLATED, -tx_bits, 8,
+                     Z_DEFAULT_STRATEGY) != Z_OK) {
+        websocket_log("deflateInit2 error\n");
+        return -1;
+    }
+
+    if (inflateInit2(&z->rx, -rx_bits) != Z_OK) {
+        websocket_log("inflateInit2 error\n");
+        deflateEnd(&z->tx);
+        return -1;
+    }
+
+    z->tx_bits = tx_bits;
+    ws->zctx = z;
+
+    return 0;
+}
+
+/*
+ * A window bits value is a decimal integer from 8 to 15 without leading
+ * zeros, possibly a quoted string (RFC 7692 section 7.1.2). NULL when the
+ * parameter has no value
+ */
+static int websocket_window_bits(char *value)
+{
+    size_t n;
+
+    if (!value)
+        return -1;
+    value = websocket_trim(value);
+    n = strlen(value);
+    if (n >= 2 && value[0] == '"' && value[n - 1] == '"') {
+        value[n - 1] = '\0';
+        value++;
+        n -= 2;
+    }
+
+    if (n == 1 && value[0] >= '8' && value[0] <= '9')
+        return value[0] - '0';
+    if (n == 2 && value[0] == '1' && value[1] >= '0' && value[1] <= '5')
+        return 10 + value[1] - '0';
+
+    return -1;
+}
+
+/*
+ * Accept the server's permessage-deflate response (RFC 7692 section 7.1) and
+ * set up the zlib streams. Every parameter appears at most once and the
+ * server may only lower what was offered, anything else fails the
+ * connection (section 5.1)
+ */
+static int websocket_deflate_accept(websocket_t *ws, const char *value)
+{
+    const struct websocket_options *opts = &ws->opts;
+    struct websocket_deflate *z;
+    char buf[256], *tok, *save = NULL, *eq;
+    int tx_bits, rx_bits = 15, seen = 0, bit;
+
+    if (strlen(value) >= sizeof(buf)) {
+        websocket_log("Sec-WebSocket-Extensions too long\n");
+        return -1;
+    }
+    strcpy(buf, value);
+
+    /* Only permessage-deflate was offered */
+    tok = strtok_r(buf, ";", &save);
+    if (!tok || strcmp(websocket_trim(tok), "permessage-deflate") != 0) {
+        websocket_log("unexpected extension: %s\n", value);
+        return -1;
+    }
+
+    z = calloc(1, sizeof(struct websocket_deflate));
+    if (!z) {
+        websocket_log("calloc error\n");
+        return -1;
+    }
+
+    tx_bits = opts->client_max_window_bits ? opts->client_max_window_bits : 15;
+    z->tx_no_takeover = opts->client_no_context_takeover;
+    z->rx_no_takeover = opts->server_no_context_takeover;
+
+    while ((tok = strtok_r(NULL, ";", &save)) != NULL) {
+        eq = strchr(tok, '=');
+        if (eq)
+            *eq++ = '\0';
+        tok = websocket_trim(tok);
+
+        if (strcmp(tok, "client_no_context_takeover") == 0) {
+            bit = 1;
+        } else if (strcmp(tok, "server_no_context_takeover") == 0) {
+            bit = 2;
+        } else if (strcmp(tok, "client_max_window_bits") == 0) {
+            bit = 4;
+        } else if (strcmp(tok, "server_max_window_bits") == 0) {
+            bit = 8;
+        } else {
+            websocket_log("unknown permessage-deflate parameter: %s\n", tok);
+            goto err;
+        }
+        if (seen & bit) {
+            websocket_log("duplicate permessage-deflate parameter: %s\n",
+                          tok);
+            goto err;
+        }
+        seen |= bit;
+
+        switch (bit) {
+        case 1:
+        case 2:
+            if (eq) {
+                websocket_log("%s takes no value\n", tok);
+                goto err;
+            }
+            /*
+             * The server MAY ask us for client_no_context_takeover even if it
+             * was not offered (section 7.1.1.2), it is always honoured
+             */
+            if (bit == 1)
+                z->tx_no_takeover = 1;
+            else
+                z->rx_no_takeover = 1;
+            break;
+        case 4:
+            /* Always offered, the server may lower the offered value */
+            tx_bits = websocket_window_bits(eq);
+            if (tx_bits == -1 || (opts->client_max_window_bits &&
+                                  tx_bits > opts->client_max_window_bits)) {
+                websocket_log("invalid client_max_window_bits\n");
+                goto err;
+            }
+            break;
+        case 8:
+            /*
+             * The server MAY include it even if it was not offered (section
+             * 7.1.2.1), but never above an offered value
+             */
+            rx_bits = websocket_window_bits(eq);
+            if (rx_bits == -1 || (opts->server_max_window_bits &&
+                                  rx_bits > opts->server_max_window_bits)) {
+                websocket_log("invalid server_max_window_bits\n");
+                goto err;
+            }
+            break;
+        }
+    }
+
+    /* An offered server_max_window_bits must be accepted by the response */
+    if (opts->server_max_window_bits && !(seen & 8)) {
+        websocket_log("server_max_window_bits was not accepted\n");
+        goto err;
+    }
+
+    /* zlib can not produce raw deflate data with a 256 byte window */
+    if (tx_bits < 9) {
+        websocket_log("client_max_window_bits=%d is not supported\n",
+                      tx_bits);
+        goto err;
+    }
+
+    if (websocket_deflate_start(ws, z, tx_bits, rx_bits) == -1)
+        goto err;
+
+    return 0;
+
+err:
+    free(z);
+    return -1;
+}
+
+/*
+ * Server side of RFC 7692: take the first permessage-deflate offer in value
+ * whose parameters are valid and that zlib can honour, and write the
+ * response header to ext. An offer that can not be accepted is declined,
+ * the next one is tried. Return 1 when one was accepted, 0 when none was,
+ * -1 on failure
+ */
+static int websocket_deflate_select(websocket_t *ws, const char *value,
+                                    size_t n, char *ext, size_t size)
+{
+    const struct websocket_options *opts = &ws->opts;
+    struct websocket_deflate *z;
+    char buf[256], *offer, *tok, *save = NULL, *psave, *eq;
+    int tx_bits, bits, seen, bit, ok, tx_reset, rx_reset, ret;
+
+    if (ws->zctx || n >= sizeof(buf))
+        return 0;
+    memcpy(buf, value, n);
+    buf[n] = '\0';
+
+    for (offer = strtok_r(buf, ",", &save); offer;
+         offer = strtok_r(NULL, ",", &save)) {
+        tok = strtok_r(offer, ";", &psave);
+        if (!tok || strcmp(websocket_trim(tok), "permessage-deflate") != 0)
+            continue;
+
+        tx_bits = opts->server_max_window_bits ? opts->server_max_window_bits
+                                               : 15;
+        tx_reset = opts->server_no_context_takeover;
+        rx_reset = 0;
+        seen = 0;
+        ok = 1;
+        while (ok && (tok = strtok_r(NULL, ";", &psave)) != NULL) {
+            eq = strchr(tok, '=');
+            if (eq)
+                *eq++ = '\0';
+            tok = websocket_trim(tok);
+            bit = 0;
+            if (strcmp(tok, "client_no_context_takeover") == 0 && !eq) {
+                bit = 1;
+                rx_reset = 1;
+            } else if (strcmp(tok, "server_no_context_takeover") == 0 &&
+                       !eq) {
+                bit = 2;
+                tx_reset = 1;
+            } else if (strcmp(tok, "client_max_window_bits") == 0) {
+                /* Our inflater always has the full window, any size fits */
+                bit = 4;
+                if (eq && websocket_window_bits(eq) == -1)
+                    bit = 0;
+            } else if (strcmp(tok, "server_max_window_bits") == 0) {
+                bit = 8;
+                bits = websocket_window_bits(eq);
+                if (bits == -1)
+                    bit = 0;
+                else if (bits < tx_bits)
+                    tx_bits = bits;
+            }
+            if (!bit || (seen & bit))
+                ok = 0;
+            seen |= bit;
+        }
+        /* zlib can not produce raw deflate data with a 256 byte window */
+        if (!ok || tx_bits < 9)
+            continue;
+
+        ret = snprintf(ext, size, "Sec-WebSocket-Extensions: "
+                                  "permessage-deflate%s",
+                       tx_reset ? "; server_no_context_takeover" : "");
+        if (tx_bits < 15 && ret > 0 && (size_t)ret < size)
+            ret += snprintf(ext + ret, size - (size_t)ret,
+                            "; server_max_window_bits=%d", tx_bits);
+        if (ret > 0 && (size_t)ret < size)
+            ret += snprintf(ext + ret, size - (size_t)ret, "\r\n");
+        if (ret <= 0 || (size_t)ret >= size) {
+            websocket_log("extension response too long\n");
+            return -1;
+        }
+
+        z = calloc(1, sizeof(struct websocket_deflate));
+        if (!z) {
+            websocket_log("calloc error\n");
+            return -1;
+        }
+        z->tx_no_takeover = tx_reset;
+        z->rx_no_takeover = rx_reset;
+        if (websocket_deflate_start(ws, z, tx_bits, 15) == -1) {
+            free(z);
+            return -1;
+        }
+        return 1;
+    }
+
+    return 0;
+}
+
+static int websocket_handshake_request(websocket_t *ws, const char *host,
+                                       const char *path)
+{
+    char buf[4096] = {0}, ext[256] = {0}, proto[256] = {0};
+    int ret;
+
+    if (ws->opts.deflate && websocket_deflate_offer(&ws->opts, ext,
+                                                    sizeof(ext)) == -1)
+        return -1;
+
+    if (ws->opts.protocols) {
+        ret = snprintf(proto, sizeof(proto), "Sec-WebSocket-Protocol: %s\r\n",
+                       ws->opts.protocols);
+        if (ret <= 0 || (size_t)ret >= sizeof(proto)) {
+            websocket_log("subprotocol list too long\n");
+            return -1;
+        }
+    }
+
+    /* Generate sec-websocket-key */
+    ret = generate_websocket_key(ws, ws->ws_key, sizeof(ws->ws_key));
+    if (ret == -1) {
+        websocket_log("generate_websocket_key error\n");
+        return -1;
+    }
+
+    /*
+     * the WebSocket client's handshake is an HTTP Upgrade request:
+     * GET /chat HTTP/1.1
+     * Host: server.example.com
+     * Upgrade: websocket
+     * Connection: Upgrade
+     * Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==
+     * Origin: http://example.com
+     * Sec-WebSocket-Protocol: chat, superchat
+     * Sec-WebSocket-Version: 13
+     */
+
+    /* Build request message */
+    ret = snprintf(buf, sizeof(buf),
+                   "GET %s HTTP/1.1\r\nHost: %s\r\nUpgrade: websocket\r\n"
+                   "Connection: Upgrade\r\nSec-WebSocket-Key: %s\r\n"
+                   "Sec-WebSocket-Version: %s\r\n%s%s\r\n",
+                   path, host, ws->ws_key, WEBSOCKET_VERSION, proto, ext);
+    if (ret <= 0 || (size_t)ret >= sizeof(buf)) {
+        websocket_log("snprintf error\n");
+        return -1;
+    }
+
+    /* Send websocket handshake request */
+    ret = websocket_output(ws, buf, ret);
+    if (ret == -1) {
+        websocket_log("websocket_output error\n");
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Offset just past the "\r\n\r\n" that ends the response head, or 0. Only
+ * the bytes that arrived since the last call are searched
+ */
+static size_t websocket_head_end(websocket_t *ws, size_t n)
+{
+    const unsigned char *buf = ws->rbuf + ws->rpos;
+    size_t i;
+
+    for (i = ws->head_scan > 3 ? ws->head_scan : 3; i < n; i++) {
+        if (buf[i] == '\n' && buf[i - 1] == '\r' && buf[i - 2] == '\n' &&
+            buf[i - 3] == '\r')
+            return i + 1;
+    }
+    ws->head_scan = n;
+
+    return 0;
+}
+
+/* A header line of the response head, name and value are not terminated */
+struct http_header {
+    const char *name, *value;
+    size_t name_len, value_len;
+};
+
+/* The line at pos, up to its CRLF. The head always ends with one */
+static const char *websocket_eol(const char *pos, const char *end)
+{
+    while (pos + 1 < end && !(pos[0] == '\r' && pos[1] == '\n'))
+        pos++;
+    return pos;
+}
+
+/*
+ * Status-Line = HTTP-Version SP Status-Code SP Reason-Phrase CRLF
+ * Return the status code and move pos to the first header line, -1 when
+ * the line is malformed
+ */
+static int websocket_parse_status(const char **pos, const char *end)
+{
+    const char *line = *pos, *eol = websocket_eol(line, end);
+    int i, status = 0;
+
+    if (eol - line < 12 || memcmp(line, "HTTP/1.", 7) != 0 ||
+        line[7] < '0' || line[7] > '9' || line[8] != ' ' ||
+        (eol - line > 12 && line[12] != ' '))
+        return -1;
+
+    for (i = 9; i < 12; i++) {
+        if (line[i] < '0' || line[i] > '9')
+            return -1;
+        status = status * 10 + (line[i] - '0');
+    }
+
+    *pos = eol + 2;
+
+    return status;
+}
+
+/*
+ * message-header = field-name ":" [ field-value ]
+ * Parse the line at pos and move pos past it. Return 1 for a header, 0 for
+ * the empty line that ends the head, -1 for a malformed line. Whitespace
+ * before the colon and obsolete line folding are rejected
+ */
+static int websocket_parse_header(const char **pos, const char *end,
+                                  struct http_header *h)
+{
+    const char *line = *pos, *eol = websocket_eol(line, end), *colon;
+
+    *pos = eol + 2;
+    if (eol == line)
+        return 0;
+
+    colon = memchr(line, ':', (size_t)(eol - line));
+    if (!colon || colon == line || line[0] == ' ' || line[0] == '\t' ||
+        colon[-1] == ' ' || colon[-1] == '\t')
+        return -1;
+
+    h->name = line;
+    h->name_len = (size_t)(colon - line);
+
+    /* Leading and trailing optional whitespace is not part of the value */
+    h->value = colon + 1;
+    while (h->value < eol && (*h->value == ' ' || *h->value == '\t'))
+        h->value++;
+    while (eol > h->value && (eol[-1] == ' ' || eol[-1] == '\t'))
+        eol--;
+    h->value_len = (size_t)(eol - h->value);
+
+    return 1;
+}
+
+/* Header field names are case-insensitive */
+static int websocket_header_is(const struct http_header *h, const char *name)
+{
+    return strlen(name) == h->name_len &&
+           strncasecmp(h->name, name, h->name_len) == 0;
+}
+
+/* Whether the comma separated list holds token, compared case-insensitively */
+static int websocket_has_token(const char *list, size_t n, const char *token,
+                               size_t len)
+{
+    const char *end = list + n, *tok, *tend;
+
+    while (list < end) {
+        while (list < end && (*list == ' ' || *list == '\t' || *list == ','))
+            list++;
+        tok = list;
+        while (list < end && *list != ',')
+            list++;
+        tend = list;
+        while (tend > tok && (tend[-1] == ' ' || tend[-1] == '\t'))
+            tend--;
+        if ((size_t)(tend - tok) == len && len > 0 &&
+            strncasecmp(tok, token, len) == 0)
+            return 1;
+    }
+
+    return 0;
+}
+
+/*
+ * The server picks at most one of the offered subprotocols, anything else
+ * means _Fail the WebSocket Connection_
+ */
+static int websocket_accept_protocol(websocket_t *ws, const char *value,
+                                     size_t n)
+{
+    const char *offer = ws->opts.protocols;
+
+    if (!offer || ws->protocol[0] || n >= sizeof(ws->protocol) ||
+        !websocket_has_token(offer, strlen(offer), value, n) ||
+        memchr(value, ',', n)) {
+        websocket_log("unexpected Sec-WebSocket-Protocol: %.*s\n", (int)n,
+                value);
+        return -1;
+    }
+
+    memcpy(ws->protocol, value, n);
+    ws->protocol[n] = '\0';
+
+    return 0;
+}
+
+/*
+ * Buffer a whole HTTP head and consume it. It is parsed in place from *pos
+ * to *end, the bytes behind it stay buffered as frames. Return 0,
+ * WEBSOCKET_WANT_READ or -1
+ */
+static int websocket_recv_head(websocket_t *ws, const char **pos,
+                               const char **end)
+{
+    size_t n, head;
+    int ret;
+
+    for (;;) {
+        n = ws->rlen - ws->rpos;
+        head = n ? websocket_head_end(ws, n) : 0;
+        if (head)
+            break;
+        if (n >= WEBSOCKET_HEAD_MAX) {
+            websocket_log("handshake head too long\n");
+            return -1;
+        }
+        ret = websocket_fill(ws, n + 1);
+        if (ret < 0)
+            return ret;
+    }
+
+    *pos = (const char *)ws->rbuf + ws->rpos;
+    *end = *pos + head;
+    ws->rpos += head;
+    ws->head_scan = 0;
+
+    return 0;
+}
+
+static int websocket_handshake_response(websocket_t *ws)
+{
+    unsigned char ac_key[128] = {0};
+    char ext[256];
+    const char *line, *pos, *end;
+    struct http_header h;
+    size_t ext_len = 0;
+    int ret, key_len, status, upgrade = 0, connection = 0, accepted = 0;
+
+    /* Receive the status returned by the websocket server and parse it */
+    ret = websocket_recv_head(ws, &pos, &end);
+    if (ret < 0)
+        return ret;
+
+    line = pos;
+    status = websocket_parse_status(&pos, end);
+    if (status != 101) {
+        websocket_log("request failed, invalid status: %.*s\n",
+                (int)(websocket_eol(line, end) - line), line);
+        return -1;
+    }
+
+    key_len = generate_websocket_accept(ws->ws_key, ac_key);
+    if (key_len == -1) {
+        websocket_log("generate_websocket_accept error\n");
+        return -1;
+    }
+
+    while ((ret = websocket_parse_header(&pos, end, &h)) == 1) {
+        if (websocket_header_is(&h, "Upgrade")) {
+            upgrade = websocket_has_token(h.value, h.value_len, "websocket",
+                                          9);
+        } else if (websocket_header_is(&h, "Connection")) {
+            connection = websocket_has_token(h.value, h.value_len,
+                                             "Upgrade", 7);
+        } else if (websocket_header_is(&h, "Sec-WebSocket-Accept")) {
+            /* Verify WebSocket-Accept */
+            if (accepted || h.value_len != (size_t)key_len ||
+                memcmp(h.value, ac_key, h.value_len) != 0) {
+                websocket_log("Sec-WebSocket-Accept verification failed: "
+                              "%.*s\n", (int)h.value_len, h.value);
+                return -1;
+            }
+            accepted = 1;
+        } else if (websocket_header_is(&h, "Sec-WebSocket-Extensions")) {
+            /* Repeated fields are one comma separated list */
+            if (ext_len + h.value_len + 3 > sizeof(ext)) {
+                websocket_log("Sec-WebSocket-Extensions too long\n");
+                return -1;
+            }
+            if (ext_len > 0) {
+                memcpy(ext + ext_len, ", ", 2);
+                ext_len += 2;
+            }
+            memcpy(ext + ext_len, h.value, h.value_len);
+            ext_len += h.value_len;
+        } else if (websocket_header_is(&h, "Sec-WebSocket-Protocol")) {
+            if (websocket_accept_protocol(ws, h.value, h.value_len) == -1)
+                return -1;
+        }
+    }
+    if (ret == -1) {
+        websocket_log("malformed handshake response header\n");
+        return -1;
+    }
+
+    if (!upgrade || !connection) {
+        websocket_log("the handshake response does not upgrade to "
+                      "websocket\n");
+        return -1;
+    }
+
+    if (!accepted) {
+        websocket_log("the handshake failed and the required "
+                      "Sec-WebSocket-Accept was not found\n");
+        return -1;
+    }
+
+    /* The server MUST NOT answer with an extension that was not offered */
+    if (ext_len > 0) {
+        ext[ext_len] = '\0';
+        if (!ws->opts.deflate) {
+            websocket_log("unexpected extension: %s\n", ext);
+            return -1;
+        }
+        if (websocket_deflate_accept(ws, ext) == -1) {
+            websocket_log("websocket_deflate_accept error\n");
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/* Answer a request that can not be upgraded and give up on it */
+static int websocket_reject(websocket_t *ws, const char *status,
+                            const char *extra)
+{
+    char buf[256];
+    int ret;
+
+    websocket_log("handshake request rejected: %s\n", status);
+
+    ret = snprintf(buf, sizeof(buf),
+                   "HTTP/1.1 %s\r\nConnection: close\r\n%sContent-Length: 0"
+                   "\r\n\r\n",
+                   status, extra ? extra : "");
+    if (ret > 0 && (size_t)ret < sizeof(buf) &&
+        websocket_output(ws, buf, (size_t)ret) == 0)
+        websocket_flush(ws);
+
+    return -1;
+}
+
+/*
+ * Pick the first subprotocol of the client's offer that we support, the
+ * offer is in order of preference
+ */
+static void websocket_select_protocol(websocket_t *ws, const char *value,
+                                      size_t n)
+{
+    const char *ours = ws->opts.protocols, *end = value + n, *tok, *tend;
+
+    if (!ours || ws->protocol[0])
+        return;
+
+    while (value < end) {
+        while (value < end && (*value == ' ' || *value == '\t' ||
+                               *value == ','))
+            value++;
+        tok = value;
+        while (value < end && *value != ',')
+            value++;
+        tend = value;
+        while (tend > tok && (tend[-1] == ' ' || tend[-1] == '\t'))
+            tend--;
+        if (tend > tok && (size_t)(tend - tok) < sizeof(ws->protocol) &&
+            websocket_has_token(ours, strlen(ours), tok,
+                                (size_t)(tend - tok))) {
+            memcpy(ws->protocol, tok, (size_t)(tend - tok));
+            ws->protocol[tend - tok] = '\0';
+            return;
+        }
+    }
+}
+
+/*
+ * Server side of the opening handshake: read the client's upgrade request,
+ * check it and queue the 101 response. With the deflate option an offered
+ * permessage-deflate is accepted, no other extension is. Return 0,
+ * WEBSOCKET_WANT_READ or -1
+ */
+static int websocket_accept_request(websocket_t *ws)
+{
+    unsigned char key[32] = {0}, ac_key[128] = {0};
+    char buf[512], proto[128] = {0}, ext[128] = {0};
+    const char *line, *eol, *pos, *end, *uri, *sp;
+    struct http_header h;
+    int ret, key_len = 0, host = 0, upgrade = 0, connection = 0, version = 0;
+
+    ret = websocket_recv_head(ws, &pos, &end);
+    if (ret < 0)
+        return ret;
+
+    /*
+     * Request-Line = Method SP Request-URI SP HTTP-Version CRLF
+     * The method of the request MUST be GET, and the HTTP version MUST be
+     * at least 1.1.
+     */
+    line = pos;
+    eol = websocket_eol(line, end);
+    if (eol - line < 14 || memcmp(line, "GET ", 4) != 0)
+        return websocket_reject(ws, "400 Bad Request", NULL);
+    uri = line + 4;
+    sp = memchr(uri, ' ', (size_t)(eol - uri));
+    if (!sp || sp == uri || eol - sp != 9 || memcmp(sp + 1, "HTTP/1.", 7) != 0 ||
+        sp[8] < '1' || sp[8] > '9')
+        return websocket_reject(ws, "400 Bad Request", NULL);
+
+    ws->path = malloc((size_t)(sp - uri) + 1);
+    if (!ws->path) {
+        websocket_log("malloc error\n");
+        return -1;
+    }
+    memcpy(ws->path, uri, (size_t)(sp - uri));
+    ws->path[sp - uri] = '\0';
+    pos = eol + 2;
+
+    while ((ret = websocket_parse_header(&pos, end, &h)) == 1) {
+        if (websocket_header_is(&h, "Host")) {
+            host = 1;
+        } else if (websocket_header_is(&h, "Upgrade")) {
+            upgrade = websocket_has_token(h.value, h.value_len, "websocket",
+                                          9);
+        } else if (websocket_header_is(&h, "Connection")) {
+            connection = websocket_has_token(h.value, h.value_len,
+                                             "Upgrade", 7);
+        } else if (websocket_header_is(&h, "Sec-WebSocket-Key")) {
+            /* A base64-encoded 16-byte value is 24 characters long */
+            if (key_len || h.value_len != 24)
+                return websocket_reject(ws, "400 Bad Request", NULL);
+            memcpy(key, h.value, h.value_len);
+            key_len = (int)h.value_len;
+        } else if (websocket_header_is(&h, "Sec-WebSocket-Version")) {
+            version = h.value_len == 2 && memcmp(h.value, "13", 2) == 0;
+        } else if (websocket_header_is(&h, "Sec-WebSocket-Protocol")) {
+            websocket_select_protocol(ws, h.value, h.value_len);
+        } else if (websocket_header_is(&h, "Sec-WebSocket-Extensions") &&
+                   ws->opts.deflate) {
+            if (websocket_deflate_select(ws, h.value, h.value_len, ext,
+                                         sizeof(ext)) == -1)
+                return -1;
+        }
+    }
+
+    if (ret == -1 || !host || !upgrade || !connection || !key_len)
+        return websocket_reject(ws, "400 Bad Request", NULL);
+
+    /* The version the server understands goes back with the refusal */
+    if (!version)
+        return websocket_reject(ws, "426 Upgrade Required",
+                                "Sec-WebSocket-Version: " WEBSOCKET_VERSION
+                                "\r\n");
+
+    ret = generate_websocket_accept(key, ac_key);
+    if (ret == -1) {
+        websocket_log("generate_websocket_accept error\n");
+        return -1;
+    }
+
+    if (ws->protocol[0])
+        snprintf(proto, sizeof(proto), "Sec-WebSocket-Protocol: %s\r\n",
+                 ws->protocol);
+
+    ret = snprintf(buf, sizeof(buf),
+                   "HTTP/1.1 101 Switching Protocols\r\nUpgrade: websocket\r\n"
+                   "Connection: Upgrade\r\nSec-WebSocket-Accept: %s\r\n%s%s"
+                   "\r\n",
+                   ac_key, proto, ext);
+    if (ret <= 0 || (size_t)ret >= sizeof(buf)) {
+        websocket_log("snprintf error\n");
+        return -1;
+    }
+
+    ret = websocket_output(ws, buf, (size_t)ret);
+    if (ret == -1) {
+        websocket_log("websocket_output error\n");
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Multi-producer single-consumer queue (Dmitry Vyukov's intrusive MPSC).
+ * A producer publishes with one atomic exchange on post_head and then links
+ * the previous node to its own, the writer walks post_tail without any
+ * atomic read-modify-write. post_stub keeps the list non-empty
+ */
+static void websocket_post_push(websocket_t *ws, struct websocket_post *node)
+{
+    struct websocket_post *prev;
+
+    __atomic_store_n(&node->next, NULL, __ATOMIC_RELAXED);
+    prev = __atomic_exchange_n(&ws->post_head, node, __ATOMIC_ACQ_REL);
+    __atomic_store_n(&prev->next, node, __ATOMIC_RELEASE);
+}
+
+/*
+ * Writer only. A producer between its exchange and its link leaves the chain
+ * briefly broken, that window is two instructions so it is waited out
+ */
+static struct websocket_post *websocket_post_pop(websocket_t *ws)
+{
+    struct websocket_post *tail = ws->post_tail, *next;
+
+    next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+    if (tail == &ws->post_stub) {
+        if (!next) {
+            if (__atomic_load_n(&ws->post_head, __ATOMIC_ACQUIRE) == tail)
+                return NULL;
+            while (!(next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE)))
+                sched_yield();
+        }
+        ws->post_tail = next;
+        tail = next;
+        next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+    }
+
+    if (!next) {
+        /* tail is the last node, park the stub behind it before taking it */
+        if (__atomic_load_n(&ws->post_head, __ATOMIC_ACQUIRE) == tail)
+            websocket_post_push(ws, &ws->post_stub);
+        while (!(next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE)))
+            sched_yield();
+    }
+
+    ws->post_tail = next;
+
+    return tail;
+}
+
+#if defined(__linux__) && defined(MSG_ZEROCOPY) && defined(SO_ZEROCOPY)
+/*
+ * MSG_ZEROCOPY completions arrive on the error queue as id ranges. TCP
+ * completes them in order, so they are a counter, and each pending send
+ * holds its memory until the counter passes its id
+ */
+static void websocket_zerocopy_reap(websocket_t *ws)
+{
+    char cbuf[CMSG_SPACE(sizeof(struct sock_extended_err)) + 64];
+    struct sock_extended_err *serr;
+    struct websocket_zc *node;
+    struct cmsghdr *cmsg;
+    struct msghdr msg;
+
+    while (ws->zc_next != ws->zc_done) {
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_control = cbuf;
+        msg.msg_controllen = sizeof(cbuf);
+        if (recvmsg(ws->fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) == -1)
+            break;
+
+        for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+            if (!(cmsg->cmsg_level == SOL_IP && cmsg->cmsg_type == IP_RECVERR) &&
+                !(cmsg->cmsg_level == SOL_IPV6 &&
+                  cmsg->cmsg_type == IPV6_RECVERR))
+                continue;
+            serr = (struct sock_extended_err *)CMSG_DATA(cmsg);
+            if (serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+                continue;
+            if ((int32_t)(serr->ee_data + 1 - ws->zc_done) > 0)
+                ws->zc_done = serr->ee_data + 1;
+            /* The pages were copied after all, stop paying for the game */
+            if (serr->ee_code & SO_EE_CODE_ZEROCOPY_COPIED)
+                ws->zc_state = -1;
+        }
+    }
+
+    while ((node = ws->zc_head) &&
+           (int32_t)(node->id - ws->zc_done) < 0) {
+        ws->zc_head = node->next;
+        websocket_free(ws, node, sizeof(struct websocket_zc) + node->size);
+    }
+    if (!ws->zc_head)
+        ws->zc_tail = NULL;
+}
+
+/*
+ * Wait up to WEBSOCKET_ZEROCOPY_DRAIN_MS for the kernel to finish with every
+ * zerocopy send, the error queue raises POLLERR. Memory it may still read is
+ * then left allocated rather than handed back for reuse: better a leak on a
+ * stuck connection than corrupted bytes on the wire
+ */
+static void websocket_zerocopy_drain(websocket_t *ws)
+{
+    uint64_t deadline;
+    struct pollfd pfd;
+    int64_t left;
+
+    websocket_zerocopy_reap(ws);
+    deadline = websocket_now_usec() + WEBSOCKET_ZEROCOPY_DRAIN_MS * 1000;
+    while (ws->zc_next != ws->zc_done) {
+        left = (int64_t)(deadline - websocket_now_usec());
+        if (left <= 0)
+            break;
+        pfd.fd = ws->fd;
+        pfd.events = 0;
+        pfd.revents = 0;
+        if (poll(&pfd, 1, (int)((left + 999) / 1000)) == -1 && errno != EINTR)
+            break;
+        websocket_zerocopy_reap(ws);
+    }
+
+    if (ws->zc_head) {
+        websocket_log("zerocopy sends still in flight, their memory leaks\n");
+        ws->zc_head = ws->zc_tail = NULL;
+    }
+}
+#else
+static void websocket_zerocopy_reap(websocket_t *ws)
+{
+    (void)ws;
+}
+
+static void websocket_zerocopy_drain(websocket_t *ws)
+{
+    (void)ws;
+}
+#endif
+
+/* Release everything the connection holds without sending anything */
+static void websocket_destroy(websocket_t *ws)
+{
+    struct websocket_post *node;
+
+    /* The completions only arrive while the socket is open */
+    websocket_zerocopy_drain(ws);
+    net_close(&ws->net);
+    websocket_free(ws, ws->wbuf, WEBSOCKET_WBUF_SIZE);
+    websocket_free(ws, ws->rbuf, ws->rsize);
+    websocket_free(ws, ws->msg, ws->msg_cap);
+    websocket_free(ws, ws->obuf, ws->ocap);
+    free(ws->path);
+    while (ws->oref_head)
+        websocket_oref_pop(ws);
+    websocket_deflate_free(ws);
+    if (ws->post_tail) {
+        while ((node = websocket_post_pop(ws)))
+            websocket_free(ws, node, sizeof(struct websocket_post) + node->len);
+    }
+    ws->wbuf = NULL;
+    ws->rbuf = NULL;
+    ws->msg = NULL;
+    ws->obuf = NULL;
+    ws->path = NULL;
+}
+
+/* TCP connection and TLS handshake, both are done by the net layer */
+static void websocket_init(websocket_t *ws,
+                           const struct websocket_options *opts)
+{
+    memset(ws, 0, sizeof(websocket_t));
+    if (opts)
+        ws->opts = *opts;
+    ws->post_head = ws->post_tail = &ws->post_stub;
+    ws->handshake_start = websocket_now_usec();
+}
+
+/* The connection is open, from the connect (or accept) to here */
+static void websocket_handshake_done(websocket_t *ws)
+{
+    ws->stats.handshake_usec = websocket_now_usec() - ws->handshake_start;
+    if (ws->on_trace)
+        ws->on_trace(ws, WEBSOCKET_TRACE_HANDSHAKE, 0,
+                     ws->stats.handshake_usec, ws->trace_arg);
+}
+
+struct dns_entry {
+    char host[256];
+    char addr[INET6_ADDRSTRLEN];
+    time_t expires;
+};
+
+static struct dns_entry dns_cache[DNS_CACHE_SIZE];
+static pthread_mutex_t dns_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Resolve host to a numeric address through the process-wide cache. A miss
+ * does the lookup and replaces the entry that expires first. Return -1 when
+ * host can not be resolved, net_connect then gets the name as before
+ */
+static int websocket_resolve(const char *host, char *addr, size_t size,
+                             int ttl)
+{
+    struct addrinfo hints, *res;
+    struct dns_entry *e, *slot = dns_cache;
+    time_t now = time(NULL);
+    int i, ret = -1;
+
+    if (strlen(host) >= sizeof(dns_cache[0].host))
+        return -1;
+
+    pthread_mutex_lock(&dns_lock);
+    for (i = 0; i < DNS_CACHE_SIZE; i++) {
+        e = &dns_cache[i];
+        if (strcmp(e->host, host) == 0 && e->expires > now) {
+            snprintf(addr, size, "%s", e->addr);
+            ret = 0;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&dns_lock);
+
+    if (ret == 0)
+        return 0;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(host, NULL, &hints, &res) != 0)
+        return -1;
+    ret = getnameinfo(res->ai_addr, res->ai_addrlen, addr, size, NULL, 0,
+                      NI_NUMERICHOST);
+    freeaddrinfo(res);
+    if (ret != 0)
+        return -1;
+
+    pthread_mutex_lock(&dns_lock);
+    for (i = 0; i < DNS_CACHE_SIZE; i++) {
+        e = &dns_cache[i];
+        if (strcmp(e->host, host) == 0) {
+            slot = e;
+            break;
+        }
+        if (e->expires < slot->expires)
+            slot = e;
+    }
+    snprintf(slot->host, sizeof(slot->host), "%s", host);
+    snprintf(slot->addr, sizeof(slot->addr), "%s", addr);
+    slot->expires = now + ttl;
+    pthread_mutex_unlock(&dns_lock);
+
+    return 0;
+}
+
+/* Drop the cached address of host, it did not accept the connection */
+static void websocket_resolve_forget(const char *host)
+{
+    int i;
+
+    pthread_mutex_lock(&dns_lock);
+    for (i = 0; i < DNS_CACHE_SIZE; i++) {
+        if (strcmp(dns_cache[i].host, host) == 0)
+            memset(&dns_cache[i], 0, sizeof(struct dns_entry));
+    }
+    pthread_mutex_unlock(&dns_lock);
+}
+
+struct session_entry {
+    char host[256];
+    uint16_t port;
+    size_t len;          /* 0 for a free entry */
+    uint64_t saved;      /* the oldest entry is replaced first */
+    unsigned char data[SESSION_MAX];
+};
+
+static struct session_entry session_cache[SESSION_CACHE_SIZE];
+static pthread_mutex_t session_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Hand the cached session of host:port to the TLS layer of ws, if any */
+static void websocket_session_resume(websocket_t *ws, const char *host,
+                                     uint16_t port)
+{
+    unsigned char data[SESSION_MAX];
+    struct session_entry *e;
+    size_t len = 0;
+    int i;
+
+    pthread_mutex_lock(&session_lock);
+    for (i = 0; i < SESSION_CACHE_SIZE; i++) {
+        e = &session_cache[i];
+        if (e->len > 0 && e->port == port && strcmp(e->host, host) == 0) {
+            memcpy(data, e->data, e->len);
+            len = e->len;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&session_lock);
+
+    if (len == 0)
+        return;
+
+    /* A session the TLS layer refuses is not offered again */
+    if (ws->opts.tls_session_load(ws, data, len, ws->opts.tls_session_arg) ==
+        -1) {
+        pthread_mutex_lock(&session_lock);
+        for (i = 0; i < SESSION_CACHE_SIZE; i++) {
+            e = &session_cache[i];
+            if (e->port == port && strcmp(e->host, host) == 0)
+                memset(e, 0, sizeof(struct session_entry));
+        }
+        pthread_mutex_unlock(&session_lock);
+    }
+    memset(data, 0, len);
+}
+
+/* Cache the session of the handshake ws just did for the next connect */
+static void websocket_session_store(websocket_t *ws, const char *host,
+                                    uint16_t port)
+{
+    unsigned char data[SESSION_MAX];
+    struct session_entry *e, *slot = session_cache;
+    int i, len;
+
+    if (strlen(host) >= sizeof(session_cache[0].host))
+        return;
+
+    len = ws->opts.tls_session_save(ws, data, sizeof(data),
+                                    ws->opts.tls_session_arg);
+    if (len <= 0 || (size_t)len > sizeof(data))
+        return;
+
+    pthread_mutex_lock(&session_lock);
+    for (i = 0; i < SESSION_CACHE_SIZE; i++) {
+        e = &session_cache[i];
+        if (e->port == port && strcmp(e->host, host) == 0) {
+            slot = e;
+            break;
+        }
+        if (e->saved < slot->saved)
+            slot = e;
+    }
+    snprintf(slot->host, sizeof(slot->host), "%s", host);
+    slot->port = port;
+    memcpy(slot->data, data, (size_t)len);
+    slot->len = (size_t)len;
+    slot->saved = websocket_now_usec();
+    pthread_mutex_unlock(&session_lock);
+
+    memset(data, 0, (size_t)len);
+}
+
+#if defined(__linux__) && defined(TCP_FASTOPEN_CONNECT)
+/*
+ * Connect with TCP_FASTOPEN_CONNECT: connect returns at once and the SYN
+ * leaves with the first write, the upgrade request. Plain TCP, the net layer
+ * only needs the descriptor
+ */
+static int websocket_fastopen(websocket_t *ws, const char *host,
+                              uint16_t port)
+{
+    struct addrinfo hints, *res, *ai;
+    char addr[INET6_ADDRSTRLEN], service[8];
+    int fd = -1, on = 1;
+
+    if (ws->opts.dns_cache_ttl > 0 &&
+        websocket_resolve(host, addr, sizeof(addr),
+                          ws->opts.dns_cache_ttl) == 0)
+        host = addr;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    snprintf(service, sizeof(service), "%u", port);
+    if (getaddrinfo(host, service, &hints, &res) != 0) {
+        websocket_log("getaddrinfo error\n");
+        return -1;
+    }
+
+    for (ai = res; ai; ai = ai->ai_next) {
+        fd = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC,
+                    ai->ai_protocol);
+        if (fd == -1)
+            continue;
+        if (setsockopt(fd, IPPROTO_TCP, TCP_FASTOPEN_CONNECT, &on,
+                       sizeof(on)) == -1)
+            websocket_log("TCP_FASTOPEN_CONNECT error\n");
+        if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0)
+            break;
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(res);
+
+    if (fd == -1) {
+        websocket_log("connect error\n");
+        return -1;
+    }
+    ws->net.fd = fd;
+
+    return 0;
+}
+#else
+static int websocket_fastopen(websocket_t *ws, const char *host,
+                              uint16_t port)
+{
+    (void)ws;
+    (void)host;
+    (void)port;
+    websocket_log("TCP Fast Open needs Linux\n");
+    return -1;
+}
+#endif
+
+#if defined(__linux__) && defined(TLS_RX)
+static int websocket_ktls_set(int fd, int dir,
+                              const struct websocket_ktls_keys *keys,
+                              const struct websocket_ktls_dir *k)
+{
+    union {
+        struct tls12_crypto_info_aes_gcm_128 gcm128;
+        struct tls12_crypto_info_aes_gcm_256 gcm256;
+    } info;
+    socklen_t len;
+    int ret;
+
+    memset(&info, 0, sizeof(info));
+    if (keys->key_len == 16) {
+        info.gcm128.info.version = (uint16_t)keys->version;
+        info.gcm128.info.cipher_type = TLS_CIPHER_AES_GCM_128;
+        memcpy(info.gcm128.key, k->key, 16);
+        memcpy(info.gcm128.iv, k->iv, 8);
+        memcpy(info.gcm128.salt, k->salt, 4);
+        memcpy(info.gcm128.rec_seq, k->rec_seq, 8);
+        len = sizeof(info.gcm128);
+    } else if (keys->key_len == 32) {
+        info.gcm256.info.version = (uint16_t)keys->version;
+        info.gcm256.info.cipher_type = TLS_CIPHER_AES_GCM_256;
+        memcpy(info.gcm256.key, k->key, 32);
+        memcpy(info.gcm256.iv, k->iv, 8);
+        memcpy(info.gcm256.salt, k->salt, 4);
+        memcpy(info.gcm256.rec_seq, k->rec_seq, 8);
+        len = sizeof(info.gcm256);
+    } else {
+        return -1;
+    }
+
+    ret = setsockopt(fd, SOL_TLS, dir, &info, len);
+    memset(&info, 0, sizeof(info));
+
+    return ret;
+}
+
+/*
+ * Hand the session to the kernel right after the TLS handshake, before any
+ * application data. Anything that fails leaves the direction in userspace
+ * TLS, the connection works either way
+ */
+static void websocket_ktls_install(websocket_t *ws)
+{
+    struct websocket_ktls_keys keys;
+
+    memset(&keys, 0, sizeof(keys));
+    if (ws->opts.ktls(ws, &keys, ws->opts.ktls_arg) == -1) {
+        websocket_log("ktls: no session keys, staying in userspace\n");
+        return;
+    }
+
+    if (setsockopt(ws->fd, SOL_TCP, TCP_ULP, "tls", sizeof("tls")) == -1) {
+        websocket_log("ktls: the kernel has no TLS support\n");
+        goto out;
+    }
+
+    if (websocket_ktls_set(ws->fd, TLS_TX, &keys, &keys.tx) == -1) {
+        websocket_log("ktls: TLS_TX is not supported for this session\n");
+        goto out;
+    }
+    ws->ktls_tx = 1;
+
+    if (!keys.rx_valid ||
+        websocket_ktls_set(ws->fd, TLS_RX, &keys, &keys.rx) == -1) {
+        websocket_log("ktls: TLS_RX is not supported for this session\n");
+        goto out;
+    }
+    ws->ktls_rx = 1;
+
+out:
+    memset(&keys, 0, sizeof(keys));
+}
+#else
+static void websocket_ktls_install(websocket_t *ws)
+{
+    (void)ws;
+    websocket_log("ktls: kernel TLS is not available on this platform\n");
+}
+#endif
+
+/*
+ * Low latency placement, Linux only. Pinning comes before any buffer is
+ * allocated, so with first-touch NUMA policy they land on the local node.
+ * These are hints, a kernel that refuses one leaves the connection usable
+ */
+static void websocket_tune(websocket_t *ws)
+{
+#if defined(__linux__)
+    cpu_set_t set;
+    int val;
+
+    if (ws->opts.pin_cpu) {
+        CPU_ZERO(&set);
+        CPU_SET(ws->opts.cpu, &set);
+        if (sched_setaffinity(0, sizeof(set), &set) == -1)
+            websocket_log("sched_setaffinity error\n");
+#if defined(SO_INCOMING_CPU)
+        val = ws->opts.cpu;
+        if (setsockopt(ws->fd, SOL_SOCKET, SO_INCOMING_CPU, &val,
+                       sizeof(val)) == -1)
+            websocket_log("SO_INCOMING_CPU error\n");
+#endif
+    }
+
+    if (ws->opts.busy_poll > 0) {
+#if defined(SO_BUSY_POLL)
+        val = ws->opts.busy_poll;
+        if (setsockopt(ws->fd, SOL_SOCKET, SO_BUSY_POLL, &val,
+                       sizeof(val)) == -1)
+            websocket_log("SO_BUSY_POLL error\n");
+#endif
+#if defined(SO_PREFER_BUSY_POLL)
+        val = 1;
+        setsockopt(ws->fd, SOL_SOCKET, SO_PREFER_BUSY_POLL, &val, sizeof(val));
+#endif
+    }
+#else
+    if (ws->opts.pin_cpu || ws->opts.busy_poll > 0)
+        websocket_log("cpu pinning and busy polling need Linux\n");
+#endif
+}
+
+static int websocket_open(websocket_t *ws, const char *host, uint16_t port,
+                          int tls, const struct proxy *proxy,
+                          const struct websocket_options *opts)
+{
+    char addr[INET6_ADDRSTRLEN];
+    int ret, resume;
+
+    websocket_init(ws, opts);
+
+    /* The upgrade request rides in the SYN, net_connect is the fallback */
+    if (ws->opts.fastopen && !tls && !proxy && !ws->opts.nonblock &&
+        websocket_fastopen(ws, host, port) == 0)
+        goto connected;
+
+    /* A proxy resolves the name itself, TLS needs it for the certificate */
+    if (ws->opts.dns_cache_ttl > 0 && !tls && !proxy &&
+        websocket_resolve(host, addr, sizeof(addr),
+                          ws->opts.dns_cache_ttl) == 0) {
+        ret = net_connect(&ws->net, addr, port, proxy);
+        if (ret == 0)
+            goto connected;
+        /* The address may be stale after a failover, look the name up */
+        net_close(&ws->net);
+        websocket_resolve_forget(host);
+    }
+
+    /* Connect to server */
+    ret = net_connect(&ws->net, host, port, proxy);
+    if (ret == -1) {
+        net_close(&ws->net);
+        websocket_log("net_connect error\n");
+        return -1;
+    }
+
+    if (tls) {
+        resume = ws->opts.tls_session_save && ws->opts.tls_session_load;
+        if (resume)
+            websocket_session_resume(ws, host, port);
+        ret = net_tls_handshake(&ws->net);
+        if (ret == -1) {
+            net_close(&ws->net);
+            websocket_log("net_tls_handshake error\n");
+            return -1;
+        }
+        if (resume)
+            websocket_session_store(ws, host, port);
+    }
+
+connected:
+    ws->fd = ws->net.fd;
+    ws->tls = tls;
+
+    websocket_tune(ws);
+
+    if (tls && ws->opts.ktls)
+        websocket_ktls_install(ws);
+
+    return 0;
+}
+
+int websocket_connect_opts(websocket_t *ws, const char *host, uint16_t port,
+                           const char *path, int tls,
+                           const struct proxy *proxy,
+                           const struct websocket_options *opts)
+{
+    int ret;
+
+    ret = websocket_open(ws, host, port, tls, proxy, opts);
+    if (ret == -1)
+        return -1;
+
+    if (ws->opts.nonblock)
+        ret = websocket_set_nonblock(ws, 1);
+    if (ret == 0)
+        ret = websocket_handshake_request(ws, host, path);
+    if (ret == 0 && !ws->opts.nonblock)
+        ret = websocket_handshake_response(ws);
+    if (ret == -1) {
+        websocket_destroy(ws);
+        websocket_log("websocket_handshake error\n");
+        return -1;
+    }
+
+    if (!ws->opts.nonblock) {
+        websocket_handshake_done(ws);
+        return 0;
+    }
+
+    ws->handshake = 1;
+
+    return websocket_connect_continue(ws);
+}
+
+static void websocket_sleep_ms(unsigned int ms)
+{
+    struct timespec ts;
+
+    ts.tv_sec = ms / 1000;
+    ts.tv_nsec = (long)(ms % 1000) * 1000000;
+    while (nanosleep(&ts, &ts) == -1 && errno == EINTR)
+        ;
+}
+
+int websocket_connect_retry(websocket_t *ws, const char *host, uint16_t port,
+                            const char *path, int tls,
+                            const struct proxy *proxy,
+                            const struct websocket_options *opts,
+                            const struct websocket_backoff *backoff)
+{
+    unsigned int base = 100, cap = 30000, bound, jitter;
+    int attempt, i, max = 0, ret;
+
+    if (backoff) {
+        if (backoff->initial_ms)
+            base = backoff->initial_ms;
+        if (backoff->max_ms)
+            cap = backoff->max_ms;
+        max = backoff->max_attempts;
+    }
+
+    for (attempt = 1;; attempt++) {
+        ret = websocket_connect_opts(ws, host, port, path, tls, proxy, opts);
+        if (ret != -1)
+            return ret;
+        if (max > 0 && attempt >= max) {
+            websocket_log("websocket_connect gave up after %d attempts\n",
+                    attempt);
+            return -1;
+        }
+
+        /* Full jitter, the delay is uniform in [0, bound] */
+        bound = base;
+        for (i = 1; i < attempt && bound < cap; i++)
+            bound = bound > cap / 2 ? cap : bound * 2;
+        if (bound > cap)
+            bound = cap;
+        if (websocket_getrandom(&jitter, sizeof(jitter)) == -1)
+            jitter = bound;
+        websocket_sleep_ms(jitter % (bound + 1));
+    }
+}
+
+int websocket_connect(websocket_t *ws, const char *host, uint16_t port,
+                      const char *path, int tls, const struct proxy *proxy)
+{
+    return websocket_connect_opts(ws, host, port, path, tls, proxy, NULL);
+}
+
+int websocket_connect_start(websocket_t *ws, const char *host, uint16_t port,
+                            const char *path, int tls,
+                            const struct proxy *proxy)
+{
+    struct websocket_options opts;
+
+    memset(&opts, 0, sizeof(opts));
+    opts.nonblock = 1;
+
+    return websocket_connect_opts(ws, host, port, path, tls, proxy, &opts);
+}
+
+int websocket_connect_continue(websocket_t *ws)
+{
+    int ret = 0;
+
+    if (!ws->handshake)
+        return 0;
+
+    /* A server reads the request first, then writes the response out */
+    if (ws->server) {
+        if (ws->handshake == 1) {
+            ret = websocket_accept_request(ws);
+            if (ret == 0)
+                ws->handshake = 2;
+        }
+        if (ret == 0)
+            ret = websocket_flush(ws);
+    } else {
+        ret = websocket_flush(ws);
+        if (ret == 0)
+            ret = websocket_handshake_response(ws);
+    }
+    if (ret == -1) {
+        websocket_destroy(ws);
+        websocket_log("websocket_handshake error\n");
+        return -1;
+    }
+    if (ret < 0)
+        return ret;
+
+    ws->handshake = 0;
+    websocket_handshake_done(ws);
+
+    return 0;
+}
+
+int websocket_accept_opts(websocket_t *ws, int fd,
+                          const struct websocket_options *opts)
+{
+    websocket_init(ws, opts);
+
+    /* Plain TCP, the net layer only needs the descriptor */
+    ws->net.fd = fd;
+    ws->fd = fd;
+    ws->server = 1;
+    ws->handshake = 1;
+
+    websocket_tune(ws);
+
+    if (ws->opts.nonblock && websocket_set_nonblock(ws, 1) == -1) {
+        websocket_destroy(ws);
+        return -1;
+    }
+
+    return websocket_connect_continue(ws);
+}
+
+int websocket_accept(websocket_t *ws, int fd)
+{
+    return websocket_accept_opts(ws, fd, NULL);
+}
+
+const char *websocket_path(const websocket_t *ws)
+{
+    return ws->path;
+}
+
+const char *websocket_protocol(const websocket_t *ws)
+{
+    return ws->protocol[0] ? ws->protocol : NULL;
+}
+
+int websocket_fd(const websocket_t *ws)
+{
+    return ws->fd;
+}
+
+int websocket_set_nonblock(websocket_t *ws, int on)
+{
+    int flags;
+
+    flags = fcntl(ws->fd, F_GETFL, 0);
+    if (flags == -1) {
+        websocket_log("fcntl error\n");
+        return -1;
+    }
+
+    flags = on ? flags | O_NONBLOCK : flags & ~O_NONBLOCK;
+    if (fcntl(ws->fd, F_SETFL, flags) == -1) {
+        websocket_log("fcntl error\n");
+        return -1;
+    }
+
+    ws->nonblock = on;
+
+    /* Blocking callers expect nothing to be left behind */
+    if (!on)
+        return websocket_flush(ws);
+
+    return 0;
+}
+
+/*
+ *   0                   1                   2                   3
+ *  0 1 2 3 4 5 6 7 8 9 0 1 2 3 4 5 6 7 8 9 0 1 2 3 4 5 6 7 8 9 0 1
+ * +-+-+-+-+-------+-+-------------+-------------------------------+
+ * |F|R|R|R| opcode|M| Payload len |    Extended payload length    |
+ * |I|S|S|S|  (4)  |A|     (7)     |             (16/64)           |
+ * |N|V|V|V|       |S|             |   (if payload len==126/127)   |
+ * | |1|2|3|       |K|             |                               |
+ * +-+-+-+-+-------+-+-------------+ - - - - - - - - - - - - - - - +
+ * |     Extended payload length continued, if payload len == 127  |
+ * + - - - - - - - - - - - - - - - +-------------------------------+
+ * |                               |Masking-key, if MASK set to 1  |
+ * +-------------------------------+-------------------------------+
+ * | Masking-key (continued)       |          Payload Data         |
+ * +-------------------------------- - - - - - - - - - - - - - - - +
+ * :                     Payload Data continued ...                :
+ * + - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - +
+ * |                     Payload Data continued ...                |
+ * +---------------------------------------------------------------+
+ */
+
+/*
+ * Fail the WebSocket Connection: tell the peer why with a CLOSE, unless one
+ * was already sent. The caller reports the error and the connection is done
+ */
+static void websocket_fail(websocket_t *ws, int code)
+{
+    if (!ws->close_sent && websocket_send_close(ws, code, NULL) == 0)
+        websocket_flush(ws);
+}
+
+/* https://datatracker.ietf.org/doc/html/rfc6455#section-7.4 */
+static int websocket_close_code_valid(unsigned int code)
+{
+    if (code >= 3000 && code <= 4999)
+        return 1;
+    return code >= 1000 && code <= 1014 && (code < 1004 || code > 1006);
+}
+
+/*
+ * Check the next piece of a received message when it is TEXT and the
+ * connection validates UTF-8, fin marks the end of the message
+ */
+static int websocket_check_utf8(websocket_t *ws, int type, const void *buf,
+                                size_t n, int fin)
+{
+    if (!ws->opts.validate_utf8 || type != WEBSOCKET_TEXT)
+        return 0;
+
+    if (websocket_utf8(&ws->utf8, buf, n) == 0 && (!fin || ws->utf8 == 0))
+        return 0;
+
+    ws->utf8 = 0;
+    websocket_log("invalid UTF-8 in text message\n");
+    websocket_fail(ws, WEBSOCKET_CLOSE_INVALID_DATA);
+    return -1;
+}
+
+/*
+ * Parse the next frame header out of the buffer without consuming it, buf
+ * holds avail bytes. Return 0, 1 when it needs hdr->size bytes to be
+ * buffered or -1 on a protocol error
+ */
+static int websocket_parse_frame_hdr(websocket_t *ws, const unsigned char *buf,
+                                     size_t avail, struct frame_hdr *hdr)
+{
+    size_t hdr_len;
+    uint64_t len;
+
+    if (avail < 2) {
+        hdr->size = 2;
+        return 1;
+    }
+
+    hdr->fin = buf[0] & FRAME_FIN;
+    hdr->rsv1 = buf[0] & FRAME_RSV1;
+    hdr->opcode = buf[0] & FRAME_OPCODE;
+
+    /*
+     * MUST be 0 unless an extension is negotiated that defines meanings
+     * for non-zero values.  If a nonzero value is received and none of
+     * the negotiated extensions defines the meaning of such a nonzero
+     * value, the receiving endpoint MUST _Fail the WebSocket Connection_.
+     * permessage-deflate gives RSV1 a meaning on the first frame of a data
+     * message.
+     */
+    if ((buf[0] & (FRAME_RSV2 | FRAME_RSV3)) != 0 ||
+        (hdr->rsv1 && (!ws->zctx || (hdr->opcode & 0x8) ||
+                       hdr->opcode == WEBSOCKET_CONTINUATION))) {
+        websocket_log("RSVx reserved field, must be 0\n");
+        websocket_fail(ws, WEBSOCKET_CLOSE_PROTOCOL_ERROR);
+        return -1;
+    }
+
+    hdr->mask = buf[1] & FRAME_MASK;
+
+    /*
+     * The server MUST close the connection upon receiving a frame that is
+     * not masked. A client MUST close a connection if it detects a masked
+     * frame.
+     */
+    if (!hdr->mask != !ws->server) {
+        websocket_log(ws->server ? "unmasked frame from the client\n"
+                                 : "masked frame from the server\n");
+        websocket_fail(ws, WEBSOCKET_CLOSE_PROTOCOL_ERROR);
+        return -1;
+    }
+    /* 0x7f = 0111 1111, Take the value of the lower seven bits */
+    /* if 0-125, that is the payload length. */
+    len = buf[1] & 0x7f;
+
+    /* The whole header is parsed out of the buffer in one go */
+    hdr_len = 2;
+    if (len == 126)
+        hdr_len += 2;
+    else if (len == 127)
+        hdr_len += 8;
+    if (hdr->mask)
+        hdr_len += 4;
+
+    if (avail < hdr_len) {
+        hdr->size = hdr_len;
+        return 1;
+    }
+
+    buf += 2;
+
+    /* Multibyte length quantities are expressed in network byte order. */
+
+    if (len == 126) {
+        /*
+         * If 126, the following 2 bytes interpreted as a 16-bit unsigned
+         * integer are the payload length.
+         */
+        len = (uint64_t)buf[0] << 8 | buf[1];
+        buf += 2;
+    } else if (len == 127) {
+        /*
+         * If 127, the following 8 bytes interpreted as a 64-bit unsigned
+         * integer (the most significant bit MUST be 0) are the payload length.
+         */
+        len = websocket_load_be64(buf);
+        buf += 8;
+        if (len >> 63) {
+            websocket_log("invalid payload length\n");
+            websocket_fail(ws, WEBSOCKET_CLOSE_PROTOCOL_ERROR);
+            return -1;
+        }
+    }
+
+    hdr->len = len;
+
+    /*
+     * Masking-key: 0 or 4 bytes
+     * All frames sent from the client to the server are masked by a
+     * 32-bit value that is contained within the frame.  This field is
+     * present if the mask bit is set to 1 and is absent if the mask bit
+     * is set to 0.
+     * See Section 5.3 for further information on client-to-server masking.
+     */
+    if (hdr->mask)
+        memcpy(hdr->mask_key, buf, 4);
+
+    hdr->size = hdr_len;
+
+    return 0;
+}
+
+static int websocket_peek_frame_hdr(websocket_t *ws, struct frame_hdr *hdr)
+{
+    size_t need = 2;
+    int ret;
+
+    for (;;) {
+        ret = websocket_fill(ws, need);
+        if (ret < 0)
+            return ret;
+
+        ret = websocket_parse_frame_hdr(ws, ws->rbuf + ws->rpos,
+                                        ws->rlen - ws->rpos, hdr);
+        if (ret != 1)
+            return ret;
+        need = hdr->size;
+    }
+}
+
+/*
+ * Check the next n bytes of the TEXT frame websocket_recv left unread. They
+ * are unmasked in place at their offset in the payload, they are dropped
+ * anyway
+ */
+static int websocket_check_rest(websocket_t *ws, uint8_t *buf, size_t n)
+{
+    if (ws->rest_mask)
+        websocket_mask(buf, buf, n, ws->rest_key, ws->rest_pos);
+    ws->rest_pos += n;
+
+    return websocket_check_utf8(ws, WEBSOCKET_TEXT, buf, n,
+                                ws->remaining == 0);
+}
+
+/*
+ * Drop the rest of a frame the caller did not read. Over plain TCP with
+ * nothing to validate the kernel discards it with MSG_TRUNC without copying
+ * it out, otherwise it is read through the whole receive buffer and what
+ * follows the frame stays buffered
+ */
+static int websocket_skip_remaining(websocket_t *ws)
+{
+    size_t n;
+    int ret;
+
+    /* Drop what is already buffered before reading more */
+    n = ws->rlen - ws->rpos;
+    if (n > ws->remaining)
+        n = (size_t)ws->remaining;
+    ws->rpos += n;
+    ws->remaining -= n;
+    ws->stats.skipped_bytes += n;
+
+    /* The discarded rest of a TEXT frame still has to be valid */
+    if (ws->utf8_rest &&
+        websocket_check_rest(ws, ws->rbuf + ws->rpos - n, n) == -1)
+        return -1;
+
+#if defined(__linux__)
+    while (!ws->tls && !ws->fed && !ws->utf8_rest && ws->remaining > 0) {
+        n = ws->remaining > 0x40000000 ? 0x40000000 : (size_t)ws->remaining;
+        ret = (int)recv(ws->fd, NULL, n, MSG_TRUNC);
+        ws->stats.reads++;
+        if (ret == -1 && errno == EINTR)
+            continue;
+        if (ret <= 0) {
+            websocket_log("recv error\n");
+            return -1;
+        }
+        ws->stats.bytes_in += ret;
+        ws->stats.skipped_bytes += ret;
+        ws->remaining -= ret;
+    }
+#endif
+
+    if (ws->remaining > 0 &&
+        websocket_rbuf_reserve(ws, WEBSOCKET_RBUF_SIZE) == -1)
+        return -1;
+
+    while (ws->remaining > 0) {
+        ws->rpos = ws->rlen = 0;
+        ret = websocket_io_read(ws, ws->rbuf, ws->rsize);
+        if (ret < 0)
+            return -1;
+        ws->rlen = (size_t)ret;
+        n = ws->rlen > ws->remaining ? (size_t)ws->remaining : ws->rlen;
+        ws->rpos = n;
+        ws->stats.skipped_bytes += n;
+        ws->remaining -= n;
+        if (ws->utf8_rest && websocket_check_rest(ws, ws->rbuf, n) == -1)
+            return -1;
+    }
+
+    ws->utf8_rest = 0;
+
+    return 0;
+}
+
+static size_t websocket_max_message(const websocket_t *ws)
+{
+    return ws->max_message ? ws->max_message : WEBSOCKET_MAX_MESSAGE;
+}
+
+/* Grow the reassembly arena and read the current fragment into it */
+static int websocket_arena_append(websocket_t *ws, const struct frame_hdr *hdr)
+{
+    size_t max, cap;
+    unsigned char *msg;
+    int ret;
+
+    max = websocket_max_message(ws);
+    if (hdr->len > max - ws->msg_len) {
+        websocket_log("message exceeds the maximum size %zu\n", max);
+        websocket_fail(ws, WEBSOCKET_CLOSE_TOO_BIG);
+        return -1;
+    }
+
+    if (ws->msg_len + hdr->len > ws->msg_cap) {
+        cap = ws->msg_cap ? ws->msg_cap : 4096;
+        while (cap < ws->msg_len + hdr->len)
+            cap *= 2;
+        if (cap > max)
+            cap = max;
+        msg = websocket_realloc(ws, ws->msg, ws->msg_cap, cap);
+        if (!msg) {
+            websocket_log("realloc error\n");
+            return -1;
+        }
+        ws->msg = msg;
+        ws->msg_cap = cap;
+    }
+
+    ret = websocket_readn(ws, ws->msg + ws->msg_len, (size_t)hdr->len);
+    if (ret == -1) {
+        websocket_log("websocket_readn error\n");
+        return -1;
+    }
+
+    /* https://datatracker.ietf.org/doc/html/rfc6455#section-5.3 */
+    if (hdr->mask)
+        websocket_mask(ws->msg + ws->msg_len, ws->msg + ws->msg_len,
+                       (size_t)hdr->len, hdr->mask_key, 0);
+
+    if (websocket_check_utf8(ws, ws->msg_type, ws->msg + ws->msg_len,
+                             (size_t)hdr->len, hdr->fin) == -1)
+        return -1;
+
+    ws->msg_len += (size_t)hdr->len;
+    ws->remaining = 0;
+
+    return 0;
+}
+
+/*
+ * Inflate one piece of a compressed message into the arena, or through a
+ * bounded scratch buffer to the streaming callback. On the last piece the
+ * 0x00 0x00 0xff 0xff tail the sender removed is fed in as well
+ * (RFC 7692 section 7.2.2)
+ */
+static int websocket_inflate(websocket_t *ws, const uint8_t *in, size_t n,
+                             int fin)
+{
+    static const uint8_t tail[4] = {0x00, 0x00, 0xff, 0xff};
+    struct websocket_deflate *z = ws->zctx;
+    unsigned char tmp[16384], *msg;
+    size_t max = websocket_max_message(ws), cap, out;
+    int pass, ret;
+
+    for (pass = 0; pass < (fin ? 2 : 1); pass++) {
+        z->rx.next_in = (Bytef *)(pass ? tail : in);
+        z->rx.avail_in = pass ? sizeof(tail) : (uInt)n;
+
+        do {
+            if (ws->on_fragment) {
+                z->rx.next_out = tmp;
+                z->rx.avail_out = sizeof(tmp);
+            } else {
+                if (ws->msg_len == ws->msg_cap) {
+                    if (ws->msg_cap >= max) {
+                        websocket_log("message exceeds the maximum size "
+                                      "%zu\n", max);
+                        websocket_fail(ws, WEBSOCKET_CLOSE_TOO_BIG);
+                        return -1;
+                    }
+                    cap = ws->msg_cap ? ws->msg_cap * 2 : 4096;
+                    if (cap > max)
+                        cap = max;
+                    msg = websocket_realloc(ws, ws->msg, ws->msg_cap, cap);
+                    if (!msg) {
+                        websocket_log("realloc error\n");
+                        return -1;
+                    }
+                    ws->msg = msg;
+                    ws->msg_cap = cap;
+                }
+                z->rx.next_out = ws->msg + ws->msg_len;
+                z->rx.avail_out = (uInt)(ws->msg_cap - ws->msg_len);
+            }
+
+            out = z->rx.avail_out;
+            ret = inflate(&z->rx, Z_SYNC_FLUSH);
+            if (ret == Z_STREAM_END) {
+                /* The sender closed the deflate stream with BFINAL */
+                inflateReset(&z->rx);
+            } else if (ret != Z_OK && ret != Z_BUF_ERROR) {
+                websocket_log("inflate error\n");
+                return -1;
+            }
+            out -= z->rx.avail_out;
+
+            if (websocket_check_utf8(ws, ws->msg_type,
+                                     ws->on_fragment ? tmp
+                                                     : ws->msg + ws->msg_len,
+                                     out, 0) == -1)
+                return -1;
+
+            if (ws->on_fragment) {
+                if (out > 0 && ws->on_fragment(ws, ws->msg_type, tmp, out, 0,
+                                               ws->fragment_arg) == -1) {
+                    websocket_log("on_fragment callback error\n");
+                    return -1;
+                }
+            } else {
+                ws->msg_len += out;
+            }
+
+            /* No room was the only reason to stop, or input is left */
+        } while (z->rx.avail_out == 0 || (z->rx.avail_in > 0 && out > 0));
+
+        if (z->rx.avail_in > 0) {
+            websocket_log("inflate error\n");
+            return -1;
+        }
+    }
+
+    if (fin) {
+        if (z->rx_no_takeover)
+            inflateReset(&z->rx);
+        if (websocket_check_utf8(ws, ws->msg_type, tmp, 0, 1) == -1)
+            return -1;
+        if (ws->on_fragment && ws->on_fragment(ws, ws->msg_type, tmp, 0, 1,
+                                               ws->fragment_arg) == -1) {
+            websocket_log("on_fragment callback error\n");
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Hand the current fragment to the streaming callback, or to the inflater
+ * for a compressed message, piece by piece as it arrives
+ */
+static int websocket_stream_fragment(websocket_t *ws,
+                                     const struct frame_hdr *hdr)
+{
+    unsigned char *ptr;
+    uint64_t pos = 0;
+    size_t n;
+    int ret;
+
+    do {
+        n = ws->rlen - ws->rpos;
+        if (n == 0 && ws->remaining > 0) {
+            if (websocket_fill(ws, 1) == -1) {
+                websocket_log("websocket_fill error\n");
+                return -1;
+            }
+            n = ws->rlen - ws->rpos;
+        }
+        if (n > ws->remaining)
+            n = (size_t)ws->remaining;
+
+        ptr = ws->rbuf + ws->rpos;
+        if (hdr->mask)
+            websocket_mask(ptr, ptr, n, hdr->mask_key, pos);
+
+        ws->rpos += n;
+        ws->remaining -= n;
+        pos += n;
+
+        if (ws->msg_deflate) {
+            ret = websocket_inflate(ws, ptr, n,
+                                    hdr->fin && ws->remaining == 0);
+            if (ret == -1)
+                return -1;
+            continue;
+        }
+
+        if (websocket_check_utf8(ws, ws->msg_type, ptr, n,
+                                 hdr->fin && ws->remaining == 0) == -1)
+            return -1;
+
+        ret = ws->on_fragment(ws, ws->msg_type, ptr, n,
+                              hdr->fin && ws->remaining == 0,
+                              ws->fragment_arg);
+        if (ret == -1) {
+            websocket_log("on_fragment callback error\n");
+            return -1;
+        }
+    } while (ws->remaining > 0);
+
+    return 0;
+}
+
+/*
+ * The peer's CLOSE. If an endpoint receives a Close frame and did not
+ * previously send a Close frame, the endpoint MUST send a Close frame in
+ * response, typically echoing the status code it received.
+ */
+static int websocket_close_received(websocket_t *ws, const unsigned char *buf,
+                                    size_t n)
+{
+    int code = 0;
+
+    ws->close_recv = 1;
+    ws->close_code = WEBSOCKET_CLOSE_NO_STATUS;
+
+    if (n >= 2) {
+        ws->close_code = (uint16_t)(buf[0] << 8 | buf[1]);
+        code = ws->close_code;
+    }
+    if (n == 1 || (n >= 2 && !websocket_close_code_valid(ws->close_code)))
+        code = WEBSOCKET_CLOSE_PROTOCOL_ERROR;
+
+    if (!ws->close_sent && websocket_send_close(ws, code, NULL) == -1) {
+        websocket_log("websocket_send_close error\n");
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Handle a control frame in place. Its payload is unmasked inside the
+ * receive buffer, where the PONG echo is framed from, so a control frame in
+ * the middle of a fragmented message costs no copy. Return 1 once PING or
+ * PONG is consumed, 0 for a CLOSE left for the caller (already unmasked)
+ */
+static int websocket_control(websocket_t *ws, struct frame_hdr *hdr)
+{
+    unsigned char *payload;
+    size_t n = (size_t)hdr->len;
+    int ret;
+
+    /* At most 14 + 125 bytes, the receive buffer always holds it */
+    ret = websocket_fill(ws, hdr->size + n);
+    if (ret < 0) {
+        if (ret == -1)
+            websocket_log("websocket_fill error\n");
+        return ret;
+    }
+
+    payload = ws->rbuf + ws->rpos + hdr->size;
+    if (hdr->mask) {
+        websocket_mask(payload, payload, n, hdr->mask_key, 0);
+        hdr->mask = 0;
+    }
+
+    if (ws->on_control &&
+        ws->on_control(ws, hdr->opcode, payload, n, ws->control_arg) == -1)
+        return -1;
+
+    switch (hdr->opcode) {
+    case WEBSOCKET_PING:
+        /*
+         * Upon receipt of a Ping frame, an endpoint MUST send a Pong frame
+         * in response, unless it already received a Close frame.  The Pong
+         * frame MUST have the same "Application data" as the Ping.
+         */
+        if (!ws->close_sent &&
+            websocket_send(ws, WEBSOCKET_PONG, payload, n) == -1) {
+            websocket_log("websocket_send pong error\n");
+            return -1;
+        }
+        break;
+    case WEBSOCKET_PONG:
+        /* A Pong frame MAY be sent unsolicited, no response is expected */
+        if (ws->ping_usec) {
+            ws->stats.rtt_usec = websocket_now_usec() - ws->ping_usec;
+            ws->ping_usec = 0;
+        }
+        break;
+    case WEBSOCKET_CLOSE:
+        return websocket_close_received(ws, payload, n);
+    default:
+        websocket_log("unknown control frame opcode %d\n", hdr->opcode);
+        websocket_fail(ws, WEBSOCKET_CLOSE_PROTOCOL_ERROR);
+        return -1;
+    }
+
+    ws->rpos += hdr->size + n;
+
+    return 1;
+}
+
+/*
+ * Read frames until something can be handed to the caller. Return 0 when the
+ * next frame, whose header is peeked into hdr but not consumed, is a control
+ * frame or a single-frame message. Return 1 when a fragmented message has
+ * been assembled in the arena (or passed to the streaming callback).
+ * Return -1 on failure
+ */
+static int websocket_next_message(websocket_t *ws, struct frame_hdr *hdr)
+{
+    int ret;
+
+    if (ws->handshake) {
+        websocket_log("websocket handshake in progress\n");
+        return -1;
+    }
+
+    websocket_release(ws);
+
+    if (ws->rx_failed) {
+        websocket_log("websocket connection failed\n");
+        return -1;
+    }
+
+    /* Skip the remaining unread data */
+    if (ws->remaining > 0) {
+        ret = websocket_skip_remaining(ws);
+        if (ret == -1) {
+            websocket_log("websocket_skip_remaing error\n");
+            return -1;
+        }
+    }
+
+    /* Nothing follows the peer's CLOSE */
+    if (ws->close_recv) {
+        websocket_log("websocket connection closed\n");
+        return -1;
+    }
+
+    for (;;) {
+        ret = websocket_peek_frame_hdr(ws, hdr);
+        if (ret < 0) {
+            if (ret == -1)
+                websocket_log("websocket_peek_frame_hdr error\n");
+            return ret;
+        }
+
+        /*
+         * In non-blocking mode a frame is only looked at once it is fully
+         * resident, so nothing below has to wait and an incomplete frame is
+         * simply picked up again on the next call
+         */
+        if (ws->nonblock) {
+            if (hdr->len > websocket_max_message(ws)) {
+                websocket_log("frame exceeds the maximum message size\n");
+                websocket_fail(ws, WEBSOCKET_CLOSE_TOO_BIG);
+                return -1;
+            }
+            ret = websocket_fill(ws, hdr->size + (size_t)hdr->len);
+            if (ret < 0)
+                return ret;
+        }
+
+        ws->stats.frames_in++;
+        if (ws->on_trace)
+            ws->on_trace(ws, WEBSOCKET_TRACE_FRAME_IN, hdr->opcode, hdr->len,
+                         ws->trace_arg);
+
+        /*
+         * Control frames MAY be injected in the middle of a fragmented
+         * message, but they MUST NOT be fragmented themselves and their
+         * payload is at most 125 bytes.
+         */
+        if (hdr->opcode & 0x8) {
+            if (!hdr->fin || hdr->len > 125) {
+                websocket_log("invalid control frame\n");
+                websocket_fail(ws, WEBSOCKET_CLOSE_PROTOCOL_ERROR);
+                return -1;
+            }
+            ret = websocket_control(ws, hdr);
+            if (ret == 1)
+                continue;
+            return ret;
+        }
+
+        if (hdr->opcode == WEBSOCKET_CONTINUATION) {
+            if (ws->msg_type == 0) {
+                websocket_log("unexpected continuation frame\n");
+                websocket_fail(ws, WEBSOCKET_CLOSE_PROTOCOL_ERROR);
+                return -1;
+            }
+        } else if (ws->msg_type != 0) {
+            websocket_log("expected continuation frame\n");
+            websocket_fail(ws, WEBSOCKET_CLOSE_PROTOCOL_ERROR);
+            return -1;
+        } else if (hdr->fin && !ws->on_fragment && !hdr->rsv1) {
+            ws->utf8 = 0;
+            return 0;
+        } else {
+            ws->msg_type = hdr->opcode;
+            ws->msg_deflate = hdr->rsv1;
+            ws->msg_len = 0;
+            ws->utf8 = 0;
+        }
+
+        ws->rpos += hdr->size;
+        ws->remaining = hdr->len;
+
+        if (ws->on_fragment || ws->msg_deflate)
+            ret = websocket_stream_fragment(ws, hdr);
+        else
+            ret = websocket_arena_append(ws, hdr);
+        if (ret == -1)
+            return -1;
+
+        if (hdr->fin) {
+            ws->msg_deflate = 0;
+            return 1;
+        }
+    }
+}
+
+int websocket_recv_view(websocket_t *ws, int *type, void **ptr, size_t *len)
+{
+    struct frame_hdr hdr;
+    int ret;
+
+    ret = websocket_next_message(ws, &hdr);
+    if (ret < 0) {
+        if (ret == -1)
+            websocket_log("websocket_next_message error\n");
+        return ret;
+    }
+
+    /* A reassembled message is lent straight out of the arena */
+    if (ret == 1) {
+        if (type)
+            *type = ws->msg_type;
+        ws->msg_type = 0;
+        *ptr = ws->msg;
+        *len = ws->on_fragment ? 0 : ws->msg_len;
+        return 0;
+    }
+
+    /* Leave the frame in place, websocket_recv can still read it */
+    if (hdr.len > ws->rsize - hdr.size) {
+        websocket_log("frame does not fit in the receive buffer\n");
+        return -1;
+    }
+
+    ret = websocket_fill(ws, hdr.size + (size_t)hdr.len);
+    if (ret < 0) {
+        if (ret == -1)
+            websocket_log("websocket_fill error\n");
+        return ret;
+    }
+
+    *ptr = ws->rbuf + ws->rpos + hdr.size;
+    *len = (size_t)hdr.len;
+
+    /* https://datatracker.ietf.org/doc/html/rfc6455#section-5.3 */
+    if (hdr.mask)
+        websocket_mask(*ptr, *ptr, *len, hdr.mask_key, 0);
+
+    if (websocket_check_utf8(ws, hdr.opcode, *ptr, *len, 1) == -1)
+        return -1;
+
+    if (type)
+        *type = hdr.opcode;
+
+    ws->view = hdr.size + (size_t)hdr.len;
+
+    return 0;
+}
+
+/*
+ * Read whatever the socket already holds into the free tail of the receive
+ * buffer, without waiting and without moving the views lent out. Return the
+ * number of bytes read, 0 when there is nothing or no way to tell
+ */
+static size_t websocket_read_ready(websocket_t *ws)
+{
+    size_t room = ws->rsize - ws->rlen;
+    ssize_t ret;
+
+    if (room == 0 || ws->fed)
+        return 0;
+
+    /* A blocking TLS read could wait, records are only read on demand */
+    if (ws->nonblock)
+        ret = websocket_sock_read(ws, ws->rbuf + ws->rlen, room);
+    else if (ws->ktls_rx)
+        ret = websocket_ktls_recv(ws, ws->rbuf + ws->rlen, room, MSG_DONTWAIT);
+    else if (!ws->tls)
+        ret = recv(ws->fd, ws->rbuf + ws->rlen, room, MSG_DONTWAIT);
+    else
+        return 0;
+    ws->stats.reads++;
+
+    /* Errors and EOF are reported by the next receive */
+    if (ret <= 0)
+        return 0;
+
+    ws->rlen += (size_t)ret;
+    ws->stats.bytes_in += (uint64_t)ret;
+
+    return (size_t)ret;
+}
+
+int websocket_recv_batch(websocket_t *ws, struct websocket_msg *msgs, int max)
+{
+    struct frame_hdr hdr;
+    unsigned char *ptr;
+    size_t pos, avail;
+    int n = 1, ret, topped = 0;
+
+    if (max < 1)
+        return 0;
+
+    /* The first message takes the general path, it may wait or reassemble */
+    ret = websocket_recv_view(ws, &msgs[0].type, &msgs[0].data,
+                              &msgs[0].len);
+    if (ret < 0) {
+        if (ret == -1)
+            websocket_log("websocket_recv_view error\n");
+        return ret;
+    }
+    if (ws->view == 0 || msgs[0].type == WEBSOCKET_CLOSE)
+        return 1;
+
+    /*
+     * Then every data frame that is complete in the buffer is lent out as
+     * well. Anything else, a control frame, a fragment, a compressed or a
+     * partial frame, ends the batch and is left for the next call
+     */
+    pos = ws->rpos + ws->view;
+    while (n < max) {
+        avail = ws->rlen - pos;
+        ret = websocket_parse_frame_hdr(ws, ws->rbuf + pos, avail, &hdr);
+        if (ret == -1)
+            break;
+
+        /* At the end of the buffer, the socket may already hold more */
+        if (ret == 1 || hdr.size + hdr.len > avail) {
+            if (topped || websocket_read_ready(ws) == 0)
+                break;
+            topped = 1;
+            continue;
+        }
+
+        if ((hdr.opcode & 0x8) || !hdr.fin || hdr.rsv1 ||
+            hdr.opcode == WEBSOCKET_CONTINUATION)
+            break;
+
+        ptr = ws->rbuf + pos + hdr.size;
+        if (hdr.mask)
+            websocket_mask(ptr, ptr, (size_t)hdr.len, hdr.mask_key, 0);
+        if (websocket_check_utf8(ws, hdr.opcode, ptr, (size_t)hdr.len, 1) ==
+            -1) {
+            ret = -1;
+            break;
+        }
+
+        ws->stats.frames_in++;
+        if (ws->on_trace)
+            ws->on_trace(ws, WEBSOCKET_TRACE_FRAME_IN, hdr.opcode, hdr.len,
+                         ws->trace_arg);
+
+        msgs[n].type = hdr.opcode;
+        msgs[n].data = ptr;
+        msgs[n].len = (size_t)hdr.len;
+        n++;
+
+        pos += hdr.size + (size_t)hdr.len;
+        ws->view += hdr.size + (size_t)hdr.len;
+    }
+
+    /* What was lent out stays valid, the error is for the next call */
+    if (ret == -1)
+        ws->rx_failed = 1;
+
+    return n;
+}
+
+/*
+ * Look through the buffered frames for the end of the next message. PING
+ * and PONG at the front are answered and consumed the way websocket_recv
+ * would, the rest is only looked at. Return 1 when a whole data message or
+ * a CLOSE is buffered, 0 with the bytes needed from rpos in *need, -1 on
+ * error
+ */
+static int websocket_poll_scan(websocket_t *ws, size_t *need)
+{
+    struct frame_hdr hdr;
+    size_t pos, avail, len;
+    int ret;
+
+    /* The unread rest of a frame is dropped first, it has to be here too */
+    if (ws->remaining > 0) {
+        if (ws->rlen - ws->rpos - ws->view < ws->remaining) {
+            *need = ws->view + (size_t)ws->remaining + 2;
+            return 0;
+        }
+        if (ws->view == 0 && websocket_skip_remaining(ws) == -1)
+            return -1;
+    }
+
+    pos = ws->rpos + ws->view + (size_t)ws->remaining;
+    for (;;) {
+        avail = ws->rlen - pos;
+        ret = websocket_parse_frame_hdr(ws, ws->rbuf + pos, avail, &hdr);
+        if (ret == -1)
+            return -1;
+        len = ret == 1 ? hdr.size : hdr.size + (size_t)hdr.len;
+        if (len > avail) {
+            /* Past the maximum websocket_recv does not wait, it fails */
+            if (ret == 0 && hdr.len > websocket_max_message(ws))
+                return 1;
+            *need = pos - ws->rpos + len;
+            return 0;
+        }
+
+        if (!(hdr.opcode & 0x8)) {
+            if (hdr.fin)
+                return 1;
+            pos += len;
+            continue;
+        }
+        if (hdr.opcode == WEBSOCKET_CLOSE)
+            return 1;
+
+        /* An invalid control frame fails websocket_recv right away */
+        if (!hdr.fin || hdr.len > 125)
+            return 1;
+        if (pos != ws->rpos || ws->view > 0) {
+            pos += len;
+            continue;
+        }
+
+        ws->stats.frames_in++;
+        if (ws->on_trace)
+            ws->on_trace(ws, WEBSOCKET_TRACE_FRAME_IN, hdr.opcode, hdr.len,
+                         ws->trace_arg);
+        ret = websocket_control(ws, &hdr);
+        if (ret < 0)
+            return -1;
+        pos = ws->rpos;
+    }
+}
+
+int websocket_poll(websocket_t *ws)
+{
+    size_t need = 0;
+    int ret, tries;
+
+    if (ws->handshake) {
+        websocket_log("websocket handshake in progress\n");
+        return -1;
+    }
+
+    /* Nothing follows the peer's CLOSE */
+    if (ws->close_recv || ws->rx_failed) {
+        websocket_log("websocket connection closed\n");
+        return -1;
+    }
+
+    if (websocket_rbuf_reserve(ws, WEBSOCKET_RBUF_SIZE) == -1)
+        return -1;
+
+    for (tries = 0;; tries++) {
+        ret = websocket_poll_scan(ws, &need);
+        if (ret != 0 || tries == 1)
+            return ret;
+
+        /* Make room at the tail when nothing is lent out */
+        if (ws->view == 0) {
+            if (ws->rpos > 0) {
+                memmove(ws->rbuf, ws->rbuf + ws->rpos, ws->rlen - ws->rpos);
+                ws->rlen -= ws->rpos;
+                ws->rpos = 0;
+            }
+            if (websocket_rbuf_reserve(ws, need) == -1)
+                return -1;
+        }
+        if (websocket_read_ready(ws) == 0)
+            return 0;
+    }
+}
+
+void websocket_release(websocket_t *ws)
+{
+    ws->rpos += ws->view;
+    ws->view = 0;
+
+    /* The arena is only needed again by the next fragmented message */
+    if (websocket_pooled(ws) && ws->msg && ws->msg_type == 0) {
+        websocket_free(ws, ws->msg, ws->msg_cap);
+        ws->msg = NULL;
+        ws->msg_cap = 0;
+    }
+}
+
+int websocket_feed(websocket_t *ws, const void *buf, size_t n)
+{
+    size_t avail = ws->rlen - ws->rpos;
+
+    ws->fed = 1;
+    if (n == 0)
+        return 0;
+
+    if (ws->rlen + n > ws->rsize) {
+        if (ws->view > 0) {
+            websocket_log("no room for the input while a view is lent out\n");
+            return -1;
+        }
+        /* Move the unread bytes to the front before growing the buffer */
+        if (ws->rpos > 0) {
+            memmove(ws->rbuf, ws->rbuf + ws->rpos, avail);
+            ws->rpos = 0;
+            ws->rlen = avail;
+        }
+        if (websocket_rbuf_reserve(ws, avail + n) == -1)
+            return -1;
+    }
+
+    memcpy(ws->rbuf + ws->rlen, buf, n);
+    ws->rlen += n;
+    ws->stats.reads++;
+    ws->stats.bytes_in += n;
+
+    return 0;
+}
+
+int websocket_recv(websocket_t *ws, int *type, void *buf, size_t n)
+{
+    struct frame_hdr hdr;
+    int ret;
+
+    ret = websocket_next_message(ws, &hdr);
+    if (ret < 0) {
+        if (ret == -1)
+            websocket_log("websocket_next_message error\n");
+        return ret;
+    }
+
+    /* Copy out of the arena, whatever does not fit is discarded */
+    if (ret == 1) {
+        if (type)
+            *type = ws->msg_type;
+        ws->msg_type = 0;
+        if (ws->on_fragment)
+            return 0;
+        n = n > ws->msg_len ? ws->msg_len : n;
+        if (n > 0)
+            memcpy(buf, ws->msg, n);
+        return (int)n;
+    }
+
+    if (type)
+        *type = hdr.opcode;
+
+    ws->rpos += hdr.size;
+    ws->remaining = hdr.len;
+
+    n = n > ws->remaining ? (size_t)ws->remaining : n;
+    ret = websocket_readn(ws, buf, n);
+    if (ret == -1) {
+        websocket_log("websocket_readn error\n");
+        return -1;
+    }
+
+    /* https://datatracker.ietf.org/doc/html/rfc6455#section-5.3 */
+    if (hdr.mask)
+        websocket_mask(buf, buf, (size_t)ret, hdr.mask_key, 0);
+
+    ws->remaining -= ret;
+
+    if (websocket_check_utf8(ws, hdr.opcode, buf, (size_t)ret,
+                             ws->remaining == 0) == -1)
+        return -1;
+    ws->utf8_rest = ws->opts.validate_utf8 && hdr.opcode == WEBSOCKET_TEXT &&
+                    ws->remaining > 0;
+
+    /* The rest is checked as it is skipped, it has to be unmasked first */
+    if (ws->utf8_rest) {
+        ws->rest_mask = hdr.mask;
+        memcpy(ws->rest_key, hdr.mask_key, 4);
+        ws->rest_pos = (uint64_t)ret;
+    }
+
+    return ret;
+}
+
+void websocket_set_max_message_size(websocket_t *ws, size_t size)
+{
+    ws->max_message = size;
+}
+
+void websocket_set_control_cb(websocket_t *ws, websocket_control_cb cb,
+                              void *arg)
+{
+    ws->on_control = cb;
+    ws->control_arg = arg;
+}
+
+int websocket_close_code(const websocket_t *ws)
+{
+    return ws->close_recv ? ws->close_code : 0;
+}
+
+const struct websocket_stats *websocket_stats(const websocket_t *ws)
+{
+    return &ws->stats;
+}
+
+void websocket_set_trace(websocket_t *ws, websocket_trace_cb cb, void *arg)
+{
+    ws->on_trace = cb;
+    ws->trace_arg = arg;
+}
+
+void websocket_set_fragment_cb(websocket_t *ws, websocket_fragment_cb cb,
+                               void *arg)
+{
+    ws->on_fragment = cb;
+    ws->fragment_arg = arg;
+}
+
+/*
+ * Build a frame header into header (at least 14 bytes), b0 carries FIN, RSVx
+ * and the opcode. mask_key is NULL for an unmasked frame. Returns the header
+ * length.
+ */
+static size_t websocket_build_frame_hdr(uint8_t *header, uint8_t b0,
+                                        uint64_t n, const uint8_t *mask_key)
+{
+    size_t len;
+
+    header[0] = b0;
+    header[1] = mask_key ? FRAME_MASK : 0;
+
+    if (n <= 125) {
+        header[1] |= (uint8_t)n; /* payload length */
+        len = 2;
+    } else if (n <= 0xffff) {
+        header[1] |= 126; /* payload length */
+        header[2] = (uint8_t)(n >> 8);
+        header[3] = (uint8_t)n;
+        len = 4;
+    } else {
+        header[1] |= 127; /* payload length */
+        websocket_store_be64(&header[2], n);
+        len = 10;
+    }
+
+    if (mask_key) {
+        memcpy(&header[len], mask_key, 4);
+        len += 4;
+    }
+
+    return len;
+}
+
+/* Account for a frame we send, n is its payload length */
+static void websocket_frame_out(websocket_t *ws, uint8_t b0, uint64_t n)
+{
+    ws->stats.frames_out++;
+    if ((b0 & FRAME_OPCODE) == WEBSOCKET_PING)
+        ws->ping_usec = websocket_now_usec();
+    if (ws->on_trace)
+        ws->on_trace(ws, WEBSOCKET_TRACE_FRAME_OUT, b0 & FRAME_OPCODE, n,
+                     ws->trace_arg);
+}
+
+/* Allocate the send staging buffer on first use */
+static int websocket_wbuf_alloc(websocket_t *ws)
+{
+    if (ws->wbuf)
+        return 0;
+
+    ws->wbuf = websocket_alloc(ws, WEBSOCKET_WBUF_SIZE);
+    if (!ws->wbuf) {
+        websocket_log("malloc error\n");
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Hand the staging buffer back between messages when it is pooled */
+static void websocket_wbuf_idle(websocket_t *ws)
+{
+    if (websocket_pooled(ws) && ws->wbuf && ws->send_type == 0) {
+        websocket_free(ws, ws->wbuf, WEBSOCKET_WBUF_SIZE);
+        ws->wbuf = NULL;
+    }
+}
+
+/*
+ * The masking key is a 32-bit value chosen at random by the client, it
+ * MUST be derived from a strong source of entropy
+ */
+static int websocket_make_mask_key(websocket_t *ws, uint8_t mask_key[4])
+{
+    /* Frames sent by a server are not masked */
+    if (ws->server)
+        return 0;
+
+    if (websocket_random(ws, mask_key, 4) == -1) {
+        websocket_log("websocket_random error\n");
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Write iov[0..iovcnt) in order. A blocking plain TCP (or kernel TLS)
+ * connection that is not corked sends them with one sendmsg, anything else goes through
+ * websocket_output, which copies only what it has to queue
+ */
+static int websocket_output_iov(websocket_t *ws, const struct iovec *iov,
+                                int iovcnt)
+{
+    struct iovec vec[WEBSOCKET_IOV_MAX];
+    struct msghdr msg;
+    ssize_t ret;
+    int i = 0;
+
+    if (ws->nonblock || !websocket_raw_tx(ws) || ws->cork ||
+        iovcnt > WEBSOCKET_IOV_MAX) {
+        for (i = 0; i < iovcnt; i++) {
+            if (websocket_output(ws, iov[i].iov_base, iov[i].iov_len) == -1)
+                return -1;
+        }
+        return 0;
+    }
+
+    if (websocket_queued(ws) > 0 && websocket_flush(ws) == -1)
+        return -1;
+
+    memcpy(vec, iov, sizeof(struct iovec) * (size_t)iovcnt);
+
+    while (i < iovcnt) {
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = vec + i;
+        msg.msg_iovlen = iovcnt - i;
+        ret = sendmsg(ws->fd, &msg, MSG_NOSIGNAL);
+        ws->stats.writes++;
+        if (ret == -1) {
+            if (errno == EINTR)
+                continue;
+            websocket_log("sendmsg error\n");
+            return -1;
+        }
+        ws->stats.bytes_out += ret;
+        while (i < iovcnt && (size_t)ret >= vec[i].iov_len)
+            ret -= (ssize_t)vec[i++].iov_len;
+        if (i < iovcnt) {
+            vec[i].iov_base = (uint8_t *)vec[i].iov_base + ret;
+            vec[i].iov_len -= (size_t)ret;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * A server sends unmasked frames, the header goes out in front of the
+ * caller's buffers without any staging copy
+ */
+static int websocket_send_unmasked(websocket_t *ws, uint8_t b0,
+                                   const struct iovec *iov, int iovcnt,
+                                   size_t n)
+{
+    struct iovec vec[WEBSOCKET_IOV_MAX];
+    uint8_t header[10];
+    int i;
+
+    vec[0].iov_base = header;
+    vec[0].iov_len = websocket_build_frame_hdr(header, b0, n, NULL);
+    websocket_frame_out(ws, b0, n);
+
+    if (iovcnt < WEBSOCKET_IOV_MAX) {
+        memcpy(vec + 1, iov, sizeof(struct iovec) * (size_t)iovcnt);
+        if (websocket_output_iov(ws, vec, iovcnt + 1) == -1)
+            return -1;
+    } else {
+        if (websocket_output_iov(ws, vec, 1) == -1)
+            return -1;
+        for (i = 0; i < iovcnt; i++) {
+            if (websocket_output(ws, iov[i].iov_base, iov[i].iov_len) == -1)
+                return -1;
+        }
+    }
+
+    if ((b0 & FRAME_OPCODE) == WEBSOCKET_CLOSE)
+        ws->close_sent = 1;
+
+    return (int)n;
+}
+
+#if defined(__linux__) && defined(MSG_ZEROCOPY) && defined(SO_ZEROCOPY)
+static int websocket_zerocopy_ok(websocket_t *ws, uint8_t b0, int iovcnt,
+                                 size_t n)
+{
+    int one = 1;
+
+    /* A server sends from zbuf after compressing, and zbuf is reused */
+    if (!ws->opts.zerocopy || n < ws->opts.zerocopy || ws->zc_state < 0 ||
+        ws->nonblock || ws->cork || ws->tls || (b0 & 0x8) ||
+        (ws->server && ((b0 & FRAME_RSV1) || iovcnt >= WEBSOCKET_IOV_MAX)))
+        return 0;
+
+    if (ws->zc_state == 0) {
+        if (setsockopt(ws->fd, SOL_SOCKET, SO_ZEROCOPY, &one,
+                       sizeof(one)) == -1) {
+            websocket_log("SO_ZEROCOPY error\n");
+            ws->zc_state = -1;
+            return 0;
+        }
+        ws->zc_state = 1;
+    }
+
+    return 1;
+}
+
+/*
+ * One frame with MSG_ZEROCOPY. The kernel reads the pages after sendmsg
+ * returns, so the header lives in a node that is freed on completion, and
+ * on a client the payload is masked into the same node
+ */
+static int websocket_send_zerocopy(websocket_t *ws, uint8_t b0,
+                                   const struct iovec *iov, int iovcnt,
+                                   size_t n)
+{
+    struct iovec vec[WEBSOCKET_IOV_MAX];
+    struct websocket_zc *node;
+    uint8_t mask_key[4], *hdr;
+    struct msghdr msg;
+    size_t len, off, sent = 0;
+    ssize_t ret;
+    int i, cnt;
+
+    websocket_zerocopy_reap(ws);
+
+    if (!ws->server && websocket_make_mask_key(ws, mask_key) == -1)
+        return -1;
+
+    node = websocket_alloc(ws, sizeof(struct websocket_zc) + 14 +
+                                   (ws->server ? 0 : n));
+    if (!node) {
+        websocket_log("malloc error\n");
+        return -1;
+    }
+    hdr = (uint8_t *)(node + 1);
+    len = websocket_build_frame_hdr(hdr, b0, n, ws->server ? NULL : mask_key);
+    node->size = 14 + (ws->server ? 0 : n);
+    websocket_frame_out(ws, b0, n);
+
+    if (ws->server) {
+        vec[0].iov_base = hdr;
+        vec[0].iov_len = len;
+        memcpy(vec + 1, iov, sizeof(struct iovec) * (size_t)iovcnt);
+        cnt = iovcnt + 1;
+    } else {
+        for (i = 0, off = 0; i < iovcnt; off += iov[i++].iov_len)
+            websocket_mask(hdr + len + off, iov[i].iov_base, iov[i].iov_len,
+                           mask_key, off);
+        vec[0].iov_base = hdr;
+        vec[0].iov_len = len + n;
+        cnt = 1;
+    }
+
+    if (websocket_queued(ws) > 0 && websocket_flush(ws) == -1)
+        goto err;
+
+    i = 0;
+    while (i < cnt) {
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = vec + i;
+        msg.msg_iovlen = cnt - i;
+        ret = sendmsg(ws->fd, &msg, MSG_NOSIGNAL | MSG_ZEROCOPY);
+        ws->stats.writes++;
+        if (ret == -1 && errno == EINTR)
+            continue;
+        /* Out of locked memory, this frame is too big for zerocopy */
+        if (ret == -1 && errno == ENOBUFS && sent == 0)
+            goto copy;
+        if (ret == -1) {
+            websocket_log("sendmsg error\n");
+            goto err;
+        }
+        ws->zc_next++;
+        ws->stats.bytes_out += (uint64_t)ret;
+        sent += (size_t)ret;
+        while (i < cnt && (size_t)ret >= vec[i].iov_len)
+            ret -= (ssize_t)vec[i++].iov_len;
+        if (i < cnt) {
+            vec[i].iov_base = (uint8_t *)vec[i].iov_base + ret;
+            vec[i].iov_len -= (size_t)ret;
+        }
+    }
+
+    node->id = ws->zc_next - 1;
+    node->next = NULL;
+    if (ws->zc_tail)
+        ws->zc_tail->next = node;
+    else
+        ws->zc_head = node;
+    ws->zc_tail = node;
+
+    if ((b0 & FRAME_OPCODE) == WEBSOCKET_CLOSE)
+        ws->close_sent = 1;
+
+    return (int)n;
+
+copy:
+    /* Nothing went out yet, the frame is sent from a copy like any other */
+    ret = ws->server ? websocket_output_iov(ws, vec, cnt)
+                     : websocket_output(ws, hdr, len + n);
+    websocket_free(ws, node, sizeof(struct websocket_zc) + node->size);
+    return ret == -1 ? -1 : (int)n;
+
+err:
+    websocket_free(ws, node, sizeof(struct websocket_zc) + node->size);
+    return -1;
+}
+#else
+static int websocket_zerocopy_ok(websocket_t *ws, uint8_t b0, int iovcnt,
+                                 size_t n)
+{
+    (void)ws;
+    (void)b0;
+    (void)iovcnt;
+    (void)n;
+    return 0;
+}
+
+static int websocket_send_zerocopy(websocket_t *ws, uint8_t b0,
+                                   const struct iovec *iov, int iovcnt,
+                                   size_t n)
+{
+    (void)ws;
+    (void)b0;
+    (void)iov;
+    (void)iovcnt;
+    (void)n;
+    return -1;
+}
+#endif
+
+int websocket_zerocopy_pending(websocket_t *ws)
+{
+    websocket_zerocopy_reap(ws);
+    return (int)(ws->zc_next - ws->zc_done);
+}
+
+/* Frame and send one complete message, b0 carries FIN, RSV1 and the opcode */
+static int websocket_send_frame(websocket_t *ws, uint8_t b0,
+                                const struct iovec *iov, int iovcnt)
+{
+    uint8_t mask_key[4], ctrl[14 + 125], *out;
+    const uint8_t *ptr;
+    size_t n = 0, len, off = 0, take, cap;
+    uint64_t pos = 0;
+    int idx = 0, ret;
+
+    /* The application MUST NOT send any more data frames after the Close */
+    if (ws->close_sent) {
+        websocket_log("close frame already sent\n");
+        return -1;
+    }
+
+    for (idx = 0; idx < iovcnt; idx++)
+        n += iov[idx].iov_len;
+
+    /* Large data frames skip the copy into the socket, see zerocopy */
+    if (!(b0 & 0x8) && ws->send_type == 0 &&
+        websocket_zerocopy_ok(ws, b0, iovcnt, n))
+        return websocket_send_zerocopy(ws, b0, iov, iovcnt, n);
+
+    if (ws->server) {
+        if ((b0 & 0x8) && n > 125) {
+            websocket_log("control frame payload too long\n");
+            return -1;
+        }
+        if (!(b0 & 0x8) && ws->send_type != 0) {
+            websocket_log("a streamed message is in progress\n");
+            return -1;
+        }
+        return websocket_send_unmasked(ws, b0, iov, iovcnt, n);
+    }
+
+    /*
+     * Control frames are framed on the stack, they may be sent between the
+     * fragments of a streamed message that owns the staging buffer
+     */
+    if (b0 & 0x8) {
+        if (n > 125) {
+            websocket_log("control frame payload too long\n");
+            return -1;
+        }
+        out = ctrl;
+        cap = sizeof(ctrl);
+    } else {
+        if (ws->send_type != 0) {
+            websocket_log("a streamed message is in progress\n");
+            return -1;
+        }
+        if (websocket_wbuf_alloc(ws) == -1)
+            return -1;
+        out = ws->wbuf;
+        cap = WEBSOCKET_WBUF_SIZE;
+    }
+
+    /* set mask key */
+    if (websocket_make_mask_key(ws, mask_key) == -1)
+        return -1;
+
+    /* All frames sent from client to server have the mask bit set to 1 */
+    len = websocket_build_frame_hdr(out, b0, n, mask_key);
+    websocket_frame_out(ws, b0, n);
+
+    /*
+     * Gather and transform the payload behind the header, so a frame that
+     * fits in the buffer leaves with a single write and larger frames go out
+     * in WEBSOCKET_WBUF_SIZE pieces
+     */
+    idx = 0;
+    do {
+        while (len < cap && idx < iovcnt) {
+            ptr = iov[idx].iov_base;
+            take = iov[idx].iov_len - off;
+            if (take > cap - len)
+                take = cap - len;
+            websocket_mask(out + len, ptr + off, take, mask_key, pos);
+            len += take;
+            off += take;
+            pos += take;
+            if (off == iov[idx].iov_len) {
+                idx++;
+                off = 0;
+            }
+        }
+
+        ret = websocket_output(ws, out, len);
+        if (ret == -1) {
+            websocket_log("websocket_output error\n");
+            return -1;
+        }
+        len = 0; /* Reset the buffer length and start filling again */
+    } while (idx < iovcnt);
+
+    if ((b0 & FRAME_OPCODE) == WEBSOCKET_CLOSE)
+        ws->close_sent = 1;
+    if (out == ws->wbuf)
+        websocket_wbuf_idle(ws);
+
+    return (int)n;
+}
+
+/*
+ * Compress a message into zbuf with one sync flush and drop the trailing
+ * 0x00 0x00 0xff 0xff (RFC 7692 section 7.2.1). zbuf only grows when a
+ * message is larger than any seen before
+ */
+static int websocket_deflate(websocket_t *ws, const struct iovec *iov,
+                             int iovcnt, size_t n, size_t *olen)
+{
+    struct websocket_deflate *z = ws->zctx;
+    unsigned char *zbuf;
+    size_t need, out = 0;
+    int i, flush, ret;
+
+    need = deflateBound(&z->tx, (uLong)n) + 16;
+    if (need > z->zcap) {
+        zbuf = websocket_realloc(ws, z->zbuf, z->zcap, need);
+        if (!zbuf) {
+            websocket_log("realloc error\n");
+            return -1;
+        }
+        z->zbuf = zbuf;
+        z->zcap = need;
+    }
+
+    /* The extra pass with no input does the sync flush */
+    for (i = 0; i <= iovcnt; i++) {
+        flush = i < iovcnt ? Z_NO_FLUSH : Z_SYNC_FLUSH;
+        z->tx.next_in = i < iovcnt ? iov[i].iov_base : NULL;
+        z->tx.avail_in = i < iovcnt ? (uInt)iov[i].iov_len : 0;
+
+        do {
+            if (z->zcap - out < 64) {
+                zbuf = websocket_realloc(ws, z->zbuf, z->zcap, z->zcap * 2);
+                if (!zbuf) {
+                    websocket_log("realloc error\n");
+                    return -1;
+                }
+                z->zbuf = zbuf;
+                z->zcap *= 2;
+            }
+            z->tx.next_out = z->zbuf + out;
+            z->tx.avail_out = (uInt)(z->zcap - out);
+            ret = deflate(&z->tx, flush);
+            if (ret == Z_STREAM_ERROR) {
+                websocket_log("deflate error\n");
+                return -1;
+            }
+            out = z->zcap - z->tx.avail_out;
+        } while (z->tx.avail_in > 0 ||
+                 (flush == Z_SYNC_FLUSH && z->tx.avail_out == 0));
+    }
+
+    /* Remove 4 octets (that are 0x00 0x00 0xff 0xff) from the tail end */
+    *olen = out - 4;
+
+    if (z->tx_no_takeover)
+        deflateReset(&z->tx);
+
+    return 0;
+}
+
+int websocket_sendv(websocket_t *ws, int type, const struct iovec *iov,
+                    int iovcnt)
+{
+    struct iovec ziov;
+    size_t n = 0;
+    int i, ret;
+
+    if (!ws->zctx || (type & 0x8))
+        return websocket_send_frame(ws, FRAME_FIN | (uint8_t)type, iov, iovcnt);
+
+    for (i = 0; i < iovcnt; i++)
+        n += iov[i].iov_len;
+
+    /* Compression is per message, small ones go out as they are */
+    if (n < DEFLATE_MIN_SIZE)
+        return websocket_send_frame(ws, FRAME_FIN | (uint8_t)type, iov, iovcnt);
+
+    if (ws->send_type != 0) {
+        websocket_log("a streamed message is in progress\n");
+        return -1;
+    }
+
+    ret = websocket_deflate(ws, iov, iovcnt, n, &ziov.iov_len);
+    if (ret == -1) {
+        websocket_log("websocket_deflate error\n");
+        return -1;
+    }
+    ziov.iov_base = ((struct websocket_deflate *)ws->zctx)->zbuf;
+
+    ret = websocket_send_frame(ws, FRAME_FIN | FRAME_RSV1 | (uint8_t)type,
+                               &ziov, 1);
+    if (ret == -1)
+        return -1;
+
+    return (int)n;
+}
+
+/*
+ * Frames of at most 125 bytes, the common case for feeds and control
+ * frames, have a fixed 2-byte header, followed by the key on the client.
+ * They are framed on the stack with a few stores and leave in one write,
+ * without the length switch, the staging buffer or a vector kernel
+ */
+#define WEBSOCKET_SMALL_MAX 125
+
+static int websocket_send_small(websocket_t *ws, uint8_t b0, const void *buf,
+                                size_t n)
+{
+    uint8_t frame[6 + WEBSOCKET_SMALL_MAX];
+    uint32_t key;
+    size_t len;
+
+    if (ws->close_sent) {
+        websocket_log("close frame already sent\n");
+        return -1;
+    }
+    if (!(b0 & 0x8) && ws->send_type != 0) {
+        websocket_log("a streamed message is in progress\n");
+        return -1;
+    }
+
+    frame[0] = b0;
+    if (ws->server) {
+        /* Server: the header template is b0 and the length */
+        frame[1] = (uint8_t)n;
+        memcpy(frame + 2, buf, n);
+        len = 2 + n;
+    } else {
+        /* Client: b0, MASK and the length, then the key */
+        frame[1] = FRAME_MASK | (uint8_t)n;
+        if (websocket_make_mask_key(ws, frame + 2) == -1)
+            return -1;
+        memcpy(&key, frame + 2, sizeof(key));
+        mask_word(frame + 6, buf, n, key);
+        len = 6 + n;
+    }
+    websocket_frame_out(ws, b0, n);
+
+    if (websocket_output(ws, frame, len) == -1) {
+        websocket_log("websocket_output error\n");
+        return -1;
+    }
+
+    if ((b0 & FRAME_OPCODE) == WEBSOCKET_CLOSE)
+        ws->close_sent = 1;
+
+    return (int)n;
+}
+
+int websocket_send(websocket_t *ws, int type, const void *buf, size_t n)
+{
+    struct iovec iov;
+
+    /* Never compressed, that starts at DEFLATE_MIN_SIZE */
+    if (n <= WEBSOCKET_SMALL_MAX)
+        return websocket_send_small(ws, FRAME_FIN | (uint8_t)type, buf, n);
+
+    iov.iov_base = (void *)buf;
+    iov.iov_len = n;
+
+    return websocket_sendv(ws, type, &iov, 1);
+}
+
+int websocket_send_inplace(websocket_t *ws, int type, void *buf, size_t n,
+                           int restore)
+{
+    uint8_t header[14], mask_key[4];
+    struct iovec iov[2];
+    size_t len;
+    int ret;
+
+    /* A compressed message needs an output buffer anyway */
+    if (ws->zctx && !(type & 0x8) && n >= DEFLATE_MIN_SIZE)
+        return websocket_send(ws, type, buf, n);
+
+    if (ws->close_sent) {
+        websocket_log("close frame already sent\n");
+        return -1;
+    }
+    if ((type & 0x8) && n > 125) {
+        websocket_log("control frame payload too long\n");
+        return -1;
+    }
+    if (!(type & 0x8) && ws->send_type != 0) {
+        websocket_log("a streamed message is in progress\n");
+        return -1;
+    }
+
+    if (ws->server) {
+        iov[0].iov_base = buf;
+        iov[0].iov_len = n;
+        return websocket_send_unmasked(ws, FRAME_FIN | (uint8_t)type, iov, 1,
+                                       n);
+    }
+
+    if (websocket_make_mask_key(ws, mask_key) == -1)
+        return -1;
+
+    len = websocket_build_frame_hdr(header, FRAME_FIN | (uint8_t)type, n,
+                                    mask_key);
+    websocket_frame_out(ws, FRAME_FIN | (uint8_t)type, n);
+
+    iov[0].iov_base = header;
+    iov[0].iov_len = len;
+    iov[1].iov_base = buf;
+    iov[1].iov_len = n;
+
+    websocket_mask(buf, buf, n, mask_key, 0);
+    ret = websocket_output_iov(ws, iov, 2);
+    /* Masking twice with the same key gives the original bytes back */
+    if (restore)
+        websocket_mask(buf, buf, n, mask_key, 0);
+    if (ret == -1) {
+        websocket_log("websocket_output_iov error\n");
+        return -1;
+    }
+
+    if (type == WEBSOCKET_CLOSE)
+        ws->close_sent = 1;
+
+    return (int)n;
+}
+
+/* A message framed once and shared by reference, see websocket_prepare */
+struct websocket_prepared {
+    int refs;
+    int type;
+    size_t len;             /* payload length */
+    unsigned char *frame;   /* header and payload, unmasked */
+    size_t frame_len, hdr_len;
+    unsigned char *zbase;   /* compressed variant, NULL if there is none */
+    unsigned char *zframe;
+    size_t zframe_len, zhdr_len;
+};
+
+/*
+ * Compress buf as one message with a fresh 15-bit window, so it does not
+ * depend on what a connection sent before. Return the compressed length,
+ * 0 when it is not worth it
+ */
+static size_t websocket_prepare_deflate(const void *buf, size_t n,
+                                        unsigned char *out, size_t size)
+{
+    z_stream zs;
+    size_t zlen;
+    int ret;
+
+    memset(&zs, 0, sizeof(zs));
+    if (deflateInit2(&zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -15, 8,
+                     Z_DEFAULT_STRATEGY) != Z_OK)
+        return 0;
+
+    zs.next_in = (Bytef *)buf;
+    zs.avail_in = (uInt)n;
+    zs.next_out = out;
+    zs.avail_out = (uInt)size;
+    ret = deflate(&zs, Z_SYNC_FLUSH);
+    zlen = size - zs.avail_out;
+    deflateEnd(&zs);
+
+    /* The message ends with an empty stored block, 00 00 ff ff is dropped */
+    if (ret != Z_OK || zs.avail_in != 0 || zs.avail_out == 0 || zlen < 4 ||
+        zlen - 4 >= n)
+        return 0;
+
+    return zlen - 4;
+}
+
+websocket_prepared_t *websocket_prepare(int type, const void *buf, size_t n,
+                                        int compress)
+{
+    websocket_prepared_t *p;
+    uint8_t header[10];
+    size_t bound, zlen;
+
+    if (type != WEBSOCKET_TEXT && type != WEBSOCKET_BINARY &&
+        !((type & 0x8) && n <= 125)) {
+        websocket_log("invalid message type or length\n");
+        return NULL;
+    }
+
+    p = calloc(1, sizeof(websocket_prepared_t) + sizeof(header) + n);
+    if (!p) {
+        websocket_log("calloc error\n");
+        return NULL;
+    }
+
+    p->refs = 1;
+    p->type = type;
+    p->len = n;
+    p->frame = (unsigned char *)(p + 1);
+    p->hdr_len = websocket_build_frame_hdr(p->frame, FRAME_FIN | (uint8_t)type,
+                                           n, NULL);
+    if (n > 0)
+        memcpy(p->frame + p->hdr_len, buf, n);
+    p->frame_len = p->hdr_len + n;
+
+    if (!compress || (type & 0x8) || n < DEFLATE_MIN_SIZE)
+        return p;
+
+    /* Room for the header in front, it is only known once compressed */
+    bound = compressBound((uLong)n) + 16;
+    p->zbase = malloc(sizeof(header) + bound);
+    if (!p->zbase) {
+        websocket_log("malloc error\n");
+        websocket_prepared_unref(p);
+        return NULL;
+    }
+
+    zlen = websocket_prepare_deflate(buf, n, p->zbase + sizeof(header), bound);
+    if (zlen == 0) {
+        free(p->zbase);
+        p->zbase = NULL;
+        return p;
+    }
+
+    p->zhdr_len = websocket_build_frame_hdr(
+        header, FRAME_FIN | FRAME_RSV1 | (uint8_t)type, zlen, NULL);
+    p->zframe = p->zbase + sizeof(header) - p->zhdr_len;
+    memcpy(p->zframe, header, p->zhdr_len);
+    p->zframe_len = p->zhdr_len + zlen;
+
+    return p;
+}
+
+websocket_prepared_t *websocket_prepared_ref(websocket_prepared_t *p)
+{
+    __atomic_add_fetch(&p->refs, 1, __ATOMIC_RELAXED);
+    return p;
+}
+
+void websocket_prepared_unref(websocket_prepared_t *p)
+{
+    if (__atomic_sub_fetch(&p->refs, 1, __ATOMIC_ACQ_REL) != 0)
+        return;
+    free(p->zbase);
+    free(p);
+}
+
+/*
+ * Queue a prepared frame by reference behind what is queued already. With
+ * nothing ahead of it the socket is tried first, only a remainder is queued
  */
-static int generate_websocket_key(unsigned char *buf, size_t size)
+static int websocket_output_ref(websocket_t *ws, websocket_prepared_t *p,
+                                const unsigned char *frame, size_t len)
 {
-    unsigned char tmp[16];
-    size_t i, olen;
+    struct websocket_oref *ref;
+    size_t off = 0;
+    int ret;
 
-    for (i = 0; i < sizeof(tmp); i++)
-        tmp[i] = xrand() % 0xff;
+    if (!ws->on_output && websocket_queued(ws) == 0) {
+        ret = websocket_io_write(ws, frame, len);
+        if (ret == -1)
+            return -1;
+        if (ret > 0)
+            off = (size_t)ret;
+        if (off == len)
+            return 0;
+    }
 
-    if (mbedtls_base64_encode(buf, size, &olen, tmp, sizeof(tmp)) != 0) {
-        fprintf(stderr, "mbedtls_base64_encode error\n");
+    ref = malloc(sizeof(struct websocket_oref));
+    if (!ref) {
+        websocket_log("malloc error\n");
         return -1;
     }
 
-    return olen;
+    ref->p = websocket_prepared_ref(p);
+    ref->frame = frame;
+    ref->len = len;
+    ref->off = off;
+    ref->at = ws->olen;
+    ref->next = NULL;
+    if (ws->oref_tail)
+        ws->oref_tail->next = ref;
+    else
+        ws->oref_head = ref;
+    ws->oref_tail = ref;
+    ws->oref_bytes += len - off;
+
+    websocket_watermark(ws);
+    if (ws->on_output)
+        ws->on_output(ws);
+
+    return 0;
 }
 
-/* https://datatracker.ietf.org/doc/html/rfc6455#section-1.3 */
-static int generate_websocket_accept(const unsigned char *ws_key,
-                                     unsigned char ac_key[128])
+int websocket_send_prepared(websocket_t *ws, websocket_prepared_t *p)
 {
-    char buf[256] = {0};
-    unsigned char output[20];
+    struct websocket_deflate *z = ws->zctx;
+    const unsigned char *frame = p->frame;
+    size_t len = p->frame_len, hdr_len = p->hdr_len;
+    struct iovec iov;
     int ret;
-    mbedtls_sha1_context sha1;
-    size_t olen;
 
-    ret = snprintf(buf, sizeof(buf), "%s%s", ws_key, WEBSOCKET_GUID);
-    if (ret <= 0 || (size_t)ret >= sizeof(buf)) {
-        fprintf(stderr, "websocke-key or GUID length limit\n");
-        return -1;
+    /*
+     * The compressed variant needs a peer that expects independent
+     * messages, with context takeover our own compressor would lose sync
+     */
+    if (p->zframe && z && z->tx_no_takeover && z->tx_bits == 15) {
+        frame = p->zframe;
+        len = p->zframe_len;
+        hdr_len = p->zhdr_len;
     }
 
-    mbedtls_sha1_init(&sha1);
-    mbedtls_sha1_starts(&sha1);
-    mbedtls_sha1_update(&sha1, (unsigned char *)buf, (size_t)ret);
-    mbedtls_sha1_finish(&sha1, output);
-    mbedtls_sha1_free(&sha1);
+    /* A client masks every frame with its own key, only the header is new */
+    if (!ws->server) {
+        iov.iov_base = (void *)(frame + hdr_len);
+        iov.iov_len = len - hdr_len;
+        ret = websocket_send_frame(ws, frame[0], &iov, 1);
+        return ret == -1 ? -1 : (int)p->len;
+    }
 
-    if (mbedtls_base64_encode(ac_key, 128, &olen, output, 20) != 0) {
-        fprintf(stderr, "mbedtls_base64_encode error\n");
+    if (ws->close_sent) {
+        websocket_log("close frame already sent\n");
+        return -1;
+    }
+    if (!(p->type & 0x8) && ws->send_type != 0) {
+        websocket_log("a streamed message is in progress\n");
         return -1;
     }
 
-    return (int)olen;
+    websocket_frame_out(ws, frame[0], p->len);
+    if (!ws->nonblock || (ws->cork && !ws->on_output))
+        ret = websocket_output(ws, frame, len);
+    else
+        ret = websocket_output_ref(ws, p, frame, len);
+    if (ret == -1) {
+        websocket_log("websocket_output error\n");
+        return -1;
+    }
+
+    if (p->type == WEBSOCKET_CLOSE)
+        ws->close_sent = 1;
+
+    return (int)p->len;
 }
 
-static int websocket_handshake(websocket_t *ws, const char *host,
-                               const char *path)
+/*
+ * A streamed message is staged in wbuf behind WBUF_HDR bytes of headroom, the
+ * frame header is written right in front of the payload once its length is
+ * known, and the payload is masked while it is copied in
+ */
+#define WBUF_HDR 14
+
+static size_t websocket_frag_size(const websocket_t *ws)
 {
-    unsigned char ws_key[128] = {0}, ac_key[128] = {0};
-    char buf[4096] = {0}, *ptr;
-    int ret;
+    size_t max = WEBSOCKET_WBUF_SIZE - WBUF_HDR;
 
-    /* Generate sec-websocket-key */
-    ret = generate_websocket_key(ws_key, sizeof(ws_key));
-    if (ret == -1) {
-        fprintf(stderr, "generate_websocket_key error\n");
-        return -1;
-    }
+    if (ws->frag_size == 0 || ws->frag_size > max)
+        return max;
+    return ws->frag_size;
+}
 
-    /*
-     * the WebSocket client's handshake is an HTTP Upgrade request:
-     * GET /chat HTTP/1.1
-     * Host: server.example.com
-     * Upgrade: websocket
-     * Connection: Upgrade
-     * Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==
-     * Origin: http://example.com
-     * Sec-WebSocket-Protocol: chat, superchat
-     * Sec-WebSocket-Version: 13
-     */
+/* Stage payload of a streamed message, masked unless we are the server */
+static void websocket_mask_out(websocket_t *ws, uint8_t *dst,
+                               const uint8_t *src, size_t n, uint64_t offset)
+{
+    if (!ws->server)
+        websocket_mask(dst, src, n, ws->send_key, offset);
+    else if (dst != src)
+        memcpy(dst, src, n);
+}
 
-    /* Build request message */
-    ret = snprintf(buf, sizeof(buf),
-                   "GET %s HTTP/1.1\r\nHost: %s\r\nUpgrade: websocket\r\n"
-                   "Connection: Upgrade\r\nSec-WebSocket-Key: %s\r\n"
-                   "Sec-WebSocket-Version: %s\r\n\r\n",
-                   path, host, ws_key, WEBSOCKET_VERSION);
-    if (ret <= 0 || (size_t)ret >= sizeof(buf)) {
-        fprintf(stderr, "snprintf error\n");
-        return -1;
-    }
+/* Emit the staged payload as one fragment */
+static int websocket_send_fragment(websocket_t *ws, int fin)
+{
+    uint8_t header[14], b0;
+    size_t len;
+    int ret;
 
-    /* Send websocket handshake request */
-    ret = net_write(&ws->net, buf, ret);
-    if (ret == -1) {
-        fprintf(stderr, "net_write error\n");
+    if (ws->close_sent) {
+        websocket_log("close frame already sent\n");
         return -1;
     }
 
-    memset(buf, 0, sizeof(buf));
+    b0 = ws->send_cont ? WEBSOCKET_CONTINUATION : (uint8_t)ws->send_type;
+    if (fin)
+        b0 |= FRAME_FIN;
 
-    /* Receive the status returned by the websocket server and parse it */
-    /* -1 is to prevent overflow of string operations */
-    ret = net_read(&ws->net, buf, sizeof(buf) - 1);
+    len = websocket_build_frame_hdr(header, b0, ws->send_len,
+                                    ws->server ? NULL : ws->send_key);
+    websocket_frame_out(ws, b0, ws->send_len);
+    memcpy(ws->wbuf + WBUF_HDR - len, header, len);
+
+    ret = websocket_output(ws, ws->wbuf + WBUF_HDR - len, len + ws->send_len);
     if (ret == -1) {
-        fprintf(stderr, "net_read error\n");
+        websocket_log("websocket_output error\n");
         return -1;
     }
 
-    /* TODO: Strictly check the websocket handshake response */
+    ws->send_cont = 1;
+    ws->send_len = 0;
 
-    /* Check status */
-    if (memcmp(buf, "HTTP/1.1 101 Switching Protocols", 32) != 0) {
-        fprintf(stderr, "request failed, invalid status: %s\n", buf);
-        return -1;
-    }
+    return websocket_make_mask_key(ws, ws->send_key);
+}
 
-    ret = generate_websocket_accept(ws_key, ac_key);
-    if (ret == -1) {
-        fprintf(stderr, "generate_websocket_accept error\n");
+int websocket_send_begin(websocket_t *ws, int type)
+{
+    if (ws->send_type != 0) {
+        websocket_log("a streamed message is in progress\n");
         return -1;
     }
 
-    ptr = strstr(buf, "Sec-WebSocket-Accept: ");
-    if (!ptr) {
-        fprintf(
-            stderr,
-            "the handshake failed and the required Sec-WebSocket-Accept was "
-            "not found: %s\n",
-            buf);
+    if (type != WEBSOCKET_TEXT && type != WEBSOCKET_BINARY) {
+        websocket_log("only data messages can be streamed\n");
         return -1;
     }
 
-    ptr += 22; /* strlen("Sec-WebSocket-Accept: "); */
-
-    /* Verify WebSocket-Accept */
-    if (memcmp(ptr, ac_key, ret) != 0) {
-        fprintf(stderr, "Sec-WebSocket-Accept verification failed: %s\n", buf);
+    if (websocket_wbuf_alloc(ws) == -1 ||
+        websocket_make_mask_key(ws, ws->send_key) == -1)
         return -1;
-    }
+
+    ws->send_type = type;
+    ws->send_cont = 0;
+    ws->send_len = 0;
 
     return 0;
 }
 
-int websocket_connect(websocket_t *ws, const char *host, uint16_t port,
-                      const char *path, int tls, const struct proxy *proxy)
+int websocket_send_append(websocket_t *ws, const void *buf, size_t n)
 {
-    int ret;
-
-    memset(ws, 0, sizeof(websocket_t));
+    const uint8_t *ptr = buf;
+    size_t frag, take, i;
 
-    /* Connect to server */
-    ret = net_connect(&ws->net, host, port, proxy);
-    if (ret == -1) {
-        net_close(&ws->net);
-        fprintf(stderr, "net_connect error\n");
+    if (ws->send_type == 0) {
+        websocket_log("no streamed message in progress\n");
         return -1;
     }
 
-    if (tls) {
-        ret = net_tls_handshake(&ws->net);
-        if (ret == -1) {
-            net_close(&ws->net);
-            fprintf(stderr, "net_tls_handshake error\n");
+    frag = websocket_frag_size(ws);
+
+    for (i = 0; i < n; i += take) {
+        /* Only emit a full fragment once more data shows up */
+        if (ws->send_len == frag && websocket_send_fragment(ws, 0) == -1)
             return -1;
-        }
+
+        take = frag - ws->send_len;
+        if (take > n - i)
+            take = n - i;
+        websocket_mask_out(ws, ws->wbuf + WBUF_HDR + ws->send_len, ptr + i,
+                           take, ws->send_len);
+        ws->send_len += take;
     }
 
-    ret = websocket_handshake(ws, host, path);
-    if (ret == -1) {
-        net_close(&ws->net);
-        fprintf(stderr, "websocket_handshake error\n");
+    return (int)n;
+}
+
+int websocket_send_finish(websocket_t *ws)
+{
+    int ret;
+
+    if (ws->send_type == 0) {
+        websocket_log("no streamed message in progress\n");
         return -1;
     }
 
-    return 0;
+    ret = websocket_send_fragment(ws, 1);
+    ws->send_type = 0;
+    websocket_wbuf_idle(ws);
+
+    return ret;
 }
 
+#if defined(__linux__)
 /*
- *   0                   1                   2                   3
- *  0 1 2 3 4 5 6 7 8 9 0 1 2 3 4 5 6 7 8 9 0 1 2 3 4 5 6 7 8 9 0 1
- * +-+-+-+-+-------+-+-------------+-------------------------------+
- * |F|R|R|R| opcode|M| Payload len |    Extended payload length    |
- * |I|S|S|S|  (4)  |A|     (7)     |             (16/64)           |
- * |N|V|V|V|       |S|             |   (if payload len==126/127)   |
- * | |1|2|3|       |K|             |                               |
- * +-+-+-+-+-------+-+-------------+ - - - - - - - - - - - - - - - +
- * |     Extended payload length continued, if payload len == 127  |
- * + - - - - - - - - - - - - - - - +-------------------------------+
- * |                               |Masking-key, if MASK set to 1  |
- * +-------------------------------+-------------------------------+
- * | Masking-key (continued)       |          Payload Data         |
- * +-------------------------------- - - - - - - - - - - - - - - - +
- * :                     Payload Data continued ...                :
- * + - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - +
- * |                     Payload Data continued ...                |
- * +---------------------------------------------------------------+
+ * A server does not mask, so over plain TCP or kernel TLS the payload goes
+ * from the file to the socket with sendfile as one frame, without a copy
  */
-
-static int websocket_read_frame_hdr(websocket_t *ws, struct frame_hdr *hdr)
+static int websocket_sendfile(websocket_t *ws, int type, int fd, off_t offset,
+                              uint64_t count)
 {
-    unsigned char buf[8] = {0};
-    int ret;
-    uint64_t len;
+    uint8_t header[10], b0 = FRAME_FIN | (uint8_t)type;
+    size_t len;
+    ssize_t ret;
 
-    ret = net_readn(&ws->net, buf, 2);
-    if (ret == -1) {
-        fprintf(stderr, "net_readn error\n");
+    if (ws->close_sent) {
+        websocket_log("close frame already sent\n");
         return -1;
     }
-
-    hdr->fin = buf[0] & FRAME_FIN;
-    hdr->opcode = buf[0] & FRAME_OPCODE;
-
-    /*
-     * MUST be 0 unless an extension is negotiated that defines meanings
-     * for non-zero values.  If a nonzero value is received and none of
-     * the negotiated extensions defines the meaning of such a nonzero
-     * value, the receiving endpoint MUST _Fail the WebSocket Connection_.
-     */
-    if ((buf[0] & (FRAME_RSV1 | FRAME_RSV2 | FRAME_RSV3)) != 0) {
-        fprintf(stderr, "RSVx reserved field, must be 0\n");
+    if (ws->send_type != 0) {
+        websocket_log("a streamed message is in progress\n");
         return -1;
     }
 
-    hdr->mask = buf[1] & FRAME_MASK;
-    /* 0x7f = 0111 1111, Take the value of the lower seven bits */
-    /* if 0-125, that is the payload length. */
-    len = buf[1] & 0x7f;
-
-    /* Multibyte length quantities are expressed in network byte order. */
+    len = websocket_build_frame_hdr(header, b0, count, NULL);
+    websocket_frame_out(ws, b0, count);
+    if (websocket_output(ws, header, len) == -1) {
+        websocket_log("websocket_output error\n");
+        return -1;
+    }
 
-    if (len == 126) {
-        /*
-         * If 126, the following 2 bytes interpreted as a 16-bit unsigned
-         * integer are the payload length.
-         */
-        ret = net_readn(&ws->net, buf, 2);
-        if (ret == -1) {
-            fprintf(stderr, "net_readn error\n");
-            return -1;
-        }
-        len = ntohs(*(uint16_t *)buf);
-    } else if (len == 127) {
-        /*
-         * If 127, the following 8 bytes interpreted as a 64-bit unsigned
-         * integer (the most significant bit MUST be 0) are the payload length.
-         */
-        ret = net_readn(&ws->net, buf, 8);
-        if (ret == -1) {
-            fprintf(stderr, "net_readn error\n");
+    while (count > 0) {
+        ret = sendfile(ws->fd, fd, &offset,
+                       count > 0x7ffff000 ? 0x7ffff000 : (size_t)count);
+        ws->stats.writes++;
+        if (ret == -1 && errno == EINTR)
+            continue;
+        /* The frame is cut short, the connection is unusable */
+        if (ret <= 0) {
+            websocket_log("sendfile error\n");
             return -1;
         }
-        len = ((uint64_t)ntohl((*(uint64_t *)buf) & 0xffffffff)) << 32;
-        len |= ntohl((uint32_t)((*(uint64_t *)buf) >> 32));
+        ws->stats.bytes_out += (uint64_t)ret;
+        count -= (uint64_t)ret;
     }
 
-    hdr->len = len;
-
     return 0;
 }
+#endif
 
-static int websocket_skip_remaining(websocket_t *ws)
+/*
+ * Client frames must be masked, so the file goes through the staging buffer:
+ * pread straight into it, mask in place, then send. sendfile would put the
+ * raw file bytes on the wire, which is only valid for unmasked frames, so
+ * only a blocking server on a plain or kernel TLS socket takes that path
+ */
+int websocket_send_file(websocket_t *ws, int type, int fd, off_t offset,
+                        uint64_t count)
 {
-    char buf[1024];
-    size_t n;
-    int ret;
+    uint8_t *ptr;
+    size_t frag, n;
+    ssize_t ret;
 
-    while (ws->remaining > 0) {
-        n = ws->remaining > sizeof(buf) ? sizeof(buf) : (size_t)ws->remaining;
-        ret = net_readn(&ws->net, buf, n);
-        if (ret == -1) {
-            fprintf(stderr, "net_readn error\n");
-            return -1;
+#if defined(__linux__)
+    if (ws->server && !ws->nonblock && !ws->cork && websocket_raw_tx(ws) &&
+        (type == WEBSOCKET_TEXT || type == WEBSOCKET_BINARY))
+        return websocket_sendfile(ws, type, fd, offset, count);
+#endif
+
+    if (websocket_send_begin(ws, type) == -1)
+        return -1;
+
+    frag = websocket_frag_size(ws);
+
+    while (count > 0) {
+        if (ws->send_len == frag && websocket_send_fragment(ws, 0) == -1)
+            goto err;
+
+        n = frag - ws->send_len;
+        if (n > count)
+            n = (size_t)count;
+
+        ptr = ws->wbuf + WBUF_HDR + ws->send_len;
+        ret = pread(fd, ptr, n, offset);
+        if (ret <= 0) {
+            websocket_log("pread error\n");
+            goto err;
         }
-        ws->remaining -= ret;
+
+        websocket_mask_out(ws, ptr, ptr, (size_t)ret, ws->send_len);
+        ws->send_len += (size_t)ret;
+        offset += ret;
+        count -= (uint64_t)ret;
     }
 
-    return 0;
+    return websocket_send_finish(ws);
+
+err:
+    /* The message can not be completed, the connection is unusable */
+    ws->send_type = 0;
+    return -1;
 }
 
-int websocket_recv(websocket_t *ws, int *type, void *buf, size_t n)
+int websocket_post(websocket_t *ws, int type, const void *buf, size_t n)
 {
-    struct frame_hdr hdr;
-    unsigned char mask_key[4];
-    int ret;
-
-    /* Skip the remaining unread data */
-    if (ws->remaining > 0) {
-        ret = websocket_skip_remaining(ws);
-        if (ret == -1) {
-            fprintf(stderr, "websocket_skip_remaing error\n");
-            return -1;
-        }
-    }
+    struct websocket_post *node;
 
-    ret = websocket_read_frame_hdr(ws, &hdr);
-    if (ret == -1) {
-        fprintf(stderr, "websocket_read_frame_hdr error\n");
+    if (type != WEBSOCKET_TEXT && type != WEBSOCKET_BINARY &&
+        !((type & 0x8) && n <= 125)) {
+        websocket_log("invalid message type or length\n");
         return -1;
     }
 
-    /*
-     * For the current project, the size of the data transmitted in one frame is
-     * sufficient, and the frame transmission is not supported for the time
-     * being
-     */
-    if (hdr.fin == 0) {
-        fprintf(stderr, "no support continuation frame\n");
+    node = websocket_alloc(ws, sizeof(struct websocket_post) + n);
+    if (!node) {
+        websocket_log("malloc error\n");
         return -1;
     }
 
-    if (type)
-        *type = hdr.opcode;
+    node->type = type;
+    node->len = n;
+    if (n > 0)
+        memcpy(node + 1, buf, n);
 
-    ws->remaining = hdr.len;
+    websocket_post_push(ws, node);
 
     /*
-     * Masking-key: 0 or 4 bytes
-     * All frames sent from the client to the server are masked by a
-     * 32-bit value that is contained within the frame.  This field is
-     * present if the mask bit is set to 1 and is absent if the mask bit
-     * is set to 0.
-     * See Section 5.3 for further information on client-to-server masking.
+     * Counted only once linked, so the writer can always reach a counted
+     * node. Whoever moves the count off zero wakes the writer up
      */
-    if (hdr.mask) {
-        ret = net_readn(&ws->net, mask_key, sizeof(mask_key));
-        if (ret == -1) {
-            fprintf(stderr, "net_readn error\n");
-            return -1;
+    if (__atomic_fetch_add(&ws->post_count, 1, __ATOMIC_ACQ_REL) == 0 &&
+        ws->on_post)
+        ws->on_post(ws, ws->post_arg);
+
+    return 0;
+}
+
+int websocket_drain(websocket_t *ws)
+{
+    struct websocket_post *node;
+    int cork = ws->cork, total = 0, ret = 0;
+    size_t cork_bytes = ws->cork_bytes;
+    unsigned int cork_usec = ws->cork_usec;
+    long n, left;
+
+    /* The whole batch leaves in as few writes as the queue allows */
+    if (!cork)
+        websocket_set_cork(ws, 1, 0, 0);
+
+    do {
+        for (n = 0; ret != -1 && (node = websocket_post_pop(ws)); n++) {
+            ret = websocket_send(ws, node->type, node + 1, node->len);
+            websocket_free(ws, node, sizeof(struct websocket_post) + node->len);
         }
-    }
+        total += (int)n;
+        /* Posted while the batch ran, their producers saw a non-zero count */
+        left = __atomic_sub_fetch(&ws->post_count, n, __ATOMIC_ACQ_REL);
+    } while (left > 0 && ret != -1);
+
+    if (!cork && websocket_set_cork(ws, 0, cork_bytes, cork_usec) == -1)
+        ret = -1;
 
-    /* TODO: https://datatracker.ietf.org/doc/html/rfc6455#section-5.3 */
-    n = n > ws->remaining ? (size_t)ws->remaining : n;
-    ret = net_readn(&ws->net, buf, n);
     if (ret == -1) {
-        fprintf(stderr, "net_readn error\n");
+        websocket_log("websocket_send error\n");
         return -1;
     }
 
-    ws->remaining -= ret;
-
-    return ret;
+    return total;
 }
 
-int websocket_send(websocket_t *ws, int type, const void *buf, size_t n)
+void websocket_set_post_cb(websocket_t *ws, websocket_post_cb cb, void *arg)
 {
-    uint8_t header[14] = {0}, *mask_key;
-    uint8_t payload[2048];
-    const uint8_t *ptr;
-    size_t i, len = 0;
-    int ret, nwrite;
-
-    header[0] |= FRAME_FIN;           /* set fin */
-    header[0] |= (unsigned char)type; /* opcode */
+    ws->on_post = cb;
+    ws->post_arg = arg;
+}
 
-    /* All frames sent from client to server have this bit set to 1 */
-    header[1] |= FRAME_MASK; /* set mask */
+void websocket_set_fragment_size(websocket_t *ws, size_t size)
+{
+    ws->frag_size = size;
+}
 
-    if (n <= 125) {
-        header[1] |= n; /* payload length */
-        len = 2;
-    } else if (n <= 0xffff) {
-        header[1] |= 126; /* payload length */
-        *(uint16_t *)&header[2] = htons((uint16_t)n);
-        len = 4;
-    } else {
-        header[1] |= 127; /* payload length */
-        /*
-         * Because n is a size_t type, it has only 32 bits, and the higher 32
-         * bits are always 1
-         */
-        *(uint32_t *)&header[2] = htonl(0);
-        *(uint32_t *)&header[6] = htonl((uint32_t)(n & 0xffffffff));
-        len = 10;
-    }
+int websocket_send_close(websocket_t *ws, int code, const char *reason)
+{
+    unsigned char buf[125];
+    size_t n = 0, len;
 
-    /* set mask key */
-    mask_key = &header[len];
-    for (i = 0; i < 4; i++) {
-        mask_key[i] = (uint8_t)(xrand() % 0xff);
-        len++;
+    /*
+     * If there is a body, the first two bytes of the body MUST be a 2-byte
+     * unsigned integer (in network byte order) representing a status code
+     */
+    if (code != 0) {
+        if (!websocket_close_code_valid((unsigned int)code)) {
+            websocket_log("invalid close status code %d\n", code);
+            return -1;
+        }
+        buf[0] = (unsigned char)(code >> 8);
+        buf[1] = (unsigned char)code;
+        n = 2;
+        if (reason) {
+            len = strlen(reason);
+            if (len > sizeof(buf) - 2) {
+                websocket_log("close reason too long\n");
+                return -1;
+            }
+            memcpy(buf + 2, reason, len);
+            n += len;
+        }
     }
 
-    ret = net_write(&ws->net, header, len); /* send header */
-    if (ret == -1) {
-        fprintf(stderr, "net_write error\n");
+    if (websocket_send(ws, WEBSOCKET_CLOSE, buf, n) == -1) {
+        websocket_log("websocket_send close error\n");
         return -1;
     }
 
-    /* transformed data and send payload */
-    nwrite = 0;
-    len = 0;
-    ptr = buf;
-    for (i = 0; i < n; i++) {
-        payload[len++] = ptr[i] ^ mask_key[i % 4];
-        if (len < sizeof(payload) && (i + 1) < n) {
-            /* The buffer is not full and there is still data */
-            continue;
-        }
-        ret = net_write(&ws->net, payload, len);
-        if (ret == -1) {
-            fprintf(stderr, "net_write error\n");
-            return -1;
-        }
-        len = 0; /* Reset the buffer length and start filling again */
-        nwrite += ret;
-    }
-
-    return nwrite;
+    return 0;
 }
 
 void websocket_close(websocket_t *ws)
 {
-    websocket_send(ws, WEBSOCKET_CLOSE, NULL, 0);
-    net_close(&ws->net);
+    /* A non-blocking socket gets one attempt at the queued bytes */
+    if (ws->close_sent ||
+        websocket_send_close(ws, WEBSOCKET_CLOSE_NORMAL, NULL) == 0)
+        websocket_flush(ws);
+    websocket_destroy(ws);
 }
@@ -5,6 +5,8 @@
 
 #include <stdint.h>
 #include <stddef.h>
+#include <sys/types.h>
+#include <sys/uio.h>
 
 /*
  * %x0 denotes a continuation frame
@@ -23,26 +25,627 @@
 #define WEBSOCKET_PING 0x9
 #define WEBSOCKET_PONG 0xa
 
+/* Returned in non-blocking mode when the call has to wait for the socket */
+#define WEBSOCKET_WANT_READ -2
+#define WEBSOCKET_WANT_WRITE -3
+
+/* https://datatracker.ietf.org/doc/html/rfc6455#section-7.4.1 */
+#define WEBSOCKET_CLOSE_NORMAL 1000
+#define WEBSOCKET_CLOSE_GOING_AWAY 1001
+#define WEBSOCKET_CLOSE_PROTOCOL_ERROR 1002
+#define WEBSOCKET_CLOSE_UNSUPPORTED 1003
+#define WEBSOCKET_CLOSE_NO_STATUS 1005 /* never sent, no code was received */
+#define WEBSOCKET_CLOSE_INVALID_DATA 1007
+#define WEBSOCKET_CLOSE_POLICY 1008
+#define WEBSOCKET_CLOSE_TOO_BIG 1009
+#define WEBSOCKET_CLOSE_EXTENSION 1010
+#define WEBSOCKET_CLOSE_INTERNAL_ERROR 1011
+
+struct proxy;
+
+/*
+ * Memory hooks for the per-connection buffers. The size of a buffer comes
+ * back on realloc and free, so a pool can file it by size class. All three
+ * may be called from any thread that uses the connection
+ */
+struct websocket_allocator {
+    void *(*alloc)(size_t size, void *arg);
+    void *(*realloc)(void *ptr, size_t old_size, size_t size, void *arg);
+    void (*free)(void *ptr, size_t size, void *arg);
+    void *arg;
+};
+
+struct websocket;
+
+/* One direction of a TLS session, as the kernel takes it for AES-GCM */
+struct websocket_ktls_dir {
+    unsigned char key[32];
+    unsigned char iv[8];      /* explicit part of the nonce */
+    unsigned char salt[4];    /* implicit part */
+    unsigned char rec_seq[8]; /* sequence number of the next record */
+};
+
+/* Session keys exported by the TLS layer once its handshake is done */
+struct websocket_ktls_keys {
+    int version;          /* 0x0303 for TLS 1.2, 0x0304 for TLS 1.3 */
+    size_t key_len;       /* 16 for AES-128-GCM, 32 for AES-256-GCM */
+    struct websocket_ktls_dir tx, rx;
+    int rx_valid;         /* rx is filled in, else only TX is offloaded */
+};
+
+/*
+ * Fill keys from the TLS session of ws (mbedtls exports them through its
+ * key export callback). Return -1 when they are not available or the TLS
+ * layer already buffered records, the connection then stays in userspace
+ */
+typedef int (*websocket_ktls_cb)(struct websocket *ws,
+                                 struct websocket_ktls_keys *keys, void *arg);
+
+/*
+ * Export the TLS session of ws after its handshake into buf, at most size
+ * bytes, and return its length or -1 (mbedtls_ssl_get_session, then
+ * mbedtls_ssl_session_save). Load hands one back to the TLS layer of ws
+ * before its handshake (mbedtls_ssl_session_load, then
+ * mbedtls_ssl_set_session) and returns -1 when it can not be used
+ */
+typedef int (*websocket_session_save_cb)(struct websocket *ws,
+                                         unsigned char *buf, size_t size,
+                                         void *arg);
+typedef int (*websocket_session_load_cb)(struct websocket *ws,
+                                         const unsigned char *buf,
+                                         size_t len, void *arg);
+
+/* Connection options, a zeroed struct gives the defaults */
+struct websocket_options {
+    int nonblock; /* return after sending the upgrade, see connect_start */
+
+    /* Sec-WebSocket-Protocol offer, "chat, superchat", NULL for none */
+    const char *protocols;
+
+    /*
+     * Seconds a resolved address is reused by later connects, 0 disables
+     * the cache. Only plain TCP without a proxy uses it, TLS needs the name
+     */
+    int dns_cache_ttl;
+
+    /*
+     * Linux TCP Fast Open for a blocking plain TCP connect without a proxy:
+     * the socket is connected with TCP_FASTOPEN_CONNECT and the upgrade
+     * request rides in the SYN once the server has handed out a cookie.
+     * Without one the kernel does the normal handshake first
+     */
+    int fastopen;
+
+    /*
+     * Nonzero seeds a reproducible generator for the masking keys and the
+     * Sec-WebSocket-Key. The keys are then predictable, so this is only for
+     * trusted test harnesses and benchmarks
+     */
+    uint64_t mask_seed;
+
+    /*
+     * Linux kernel TLS: after the TLS handshake the keys from ktls are
+     * installed as TLS_TX and TLS_RX, and framing then uses plain send,
+     * sendmsg and sendfile on the socket. Needs the tls kernel module
+     */
+    websocket_ktls_cb ktls;
+    void *ktls_arg;
+
+    /*
+     * TLS session resumption. After a full handshake the session is exported
+     * with tls_session_save and cached per host and port, the next connect
+     * there hands it to tls_session_load between net_connect and
+     * net_tls_handshake, which then resumes it with the ticket. Both are
+     * needed. The cache is process-wide and holds the latest session of
+     * each of 16 servers
+     */
+    websocket_session_save_cb tls_session_save;
+    websocket_session_load_cb tls_session_load;
+    void *tls_session_arg;
+
+    /*
+     * Data frames of at least zerocopy bytes (64 KB is a good start, 0 is
+     * off) leave with MSG_ZEROCOPY on a blocking plain TCP connection. A
+     * client sends a masked copy it frees on completion, a server sends the
+     * caller's buffer, which must then stay untouched until
+     * websocket_zerocopy_pending says so. When the kernel reports that it
+     * copied anyway, as on loopback, the connection goes back to copying.
+     * Closing waits up to a second for the sends still in flight
+     */
+    size_t zerocopy;
+
+    /*
+     * Low latency, Linux only. pin_cpu pins the thread that opens or accepts
+     * the connection to cpu, before its buffers are allocated so they come
+     * from the local NUMA node, and tags the socket with SO_INCOMING_CPU.
+     * busy_poll is the SO_BUSY_POLL time in microseconds, blocking reads then
+     * spin on the device queue instead of sleeping. See websocket_poll
+     */
+    int pin_cpu;
+    int cpu;
+    int busy_poll;
+
+    /*
+     * Check that received TEXT messages are valid UTF-8, as they arrive and
+     * across fragments, and fail the connection with 1007 when one is not
+     */
+    int validate_utf8;
+
+    /*
+     * permessage-deflate (RFC 7692). A server accepts the first valid offer
+     * instead, server_max_window_bits caps its window and
+     * server_no_context_takeover resets its compressor per message, which
+     * websocket_prepare with compress needs for a broadcast
+     */
+    int deflate;                    /* offer (server: accept) the extension */
+    int deflate_level;              /* zlib level, 0 for the zlib default */
+    int client_max_window_bits;     /* 9-15, 0 lets the server choose */
+    int server_max_window_bits;     /* 8-15, 0 does not restrict it */
+    int client_no_context_takeover; /* reset our compressor per message */
+    int server_no_context_takeover; /* ask the server to do the same */
+
+    /*
+     * NULL uses malloc. With an allocator every buffer is handed back as
+     * soon as it is idle, so idle connections hold no buffers at all
+     */
+    const struct websocket_allocator *allocator;
+};
+
+/*
+ * Counters of one connection, kept on every call at the cost of a few adds.
+ * Socket calls are counted as issued to the net layer
+ */
+struct websocket_stats {
+    uint64_t frames_in, frames_out;
+    uint64_t bytes_in, bytes_out; /* on the wire, headers included */
+    uint64_t reads, writes;       /* socket calls */
+    uint64_t partial_reads;       /* reads that left a frame incomplete */
+    uint64_t skipped_bytes;       /* payload discarded unread */
+    uint64_t handshake_usec;      /* from connect or accept to open */
+    uint64_t rtt_usec;            /* our last PING to its PONG */
+};
+
+/* Events passed to the trace callback, see websocket_set_trace */
+#define WEBSOCKET_TRACE_FRAME_IN 1  /* a frame header was parsed */
+#define WEBSOCKET_TRACE_FRAME_OUT 2 /* a frame header was built */
+#define WEBSOCKET_TRACE_HANDSHAKE 3 /* len is the handshake time in usec */
+
+typedef void (*websocket_trace_cb)(struct websocket *ws, int event,
+                                   int opcode, uint64_t len, void *arg);
+
+/*
+ * Receives each error message of the library as one line. The default
+ * writes it to stderr
+ */
+typedef void (*websocket_log_cb)(const char *msg, void *arg);
+
+/*
+ * Streaming receive callback, called for each piece of a data message as it
+ * arrives, fin is set on the last piece. Return -1 to fail the receive
+ */
+typedef int (*websocket_fragment_cb)(struct websocket *ws, int type,
+                                     const void *buf, size_t n, int fin,
+                                     void *arg);
+
+/*
+ * Control frame hook, called with the unmasked payload of every PING, PONG
+ * and CLOSE before the library answers it. Return -1 to fail the receive
+ */
+typedef int (*websocket_control_cb)(struct websocket *ws, int type,
+                                    const void *buf, size_t n, void *arg);
+
+/*
+ * Backpressure hook, above is 1 when the output queue reaches the high
+ * watermark and 0 once it has drained down to the low watermark
+ */
+typedef void (*websocket_watermark_cb)(struct websocket *ws, int above,
+                                       void *arg);
+
+/* A message posted by websocket_post, its payload follows the node */
+struct websocket_post {
+    struct websocket_post *next;
+    int type;
+    size_t len;
+};
+
+/* Tells the writer thread that websocket_post queued work, see post */
+typedef void (*websocket_post_cb)(struct websocket *ws, void *arg);
+
+/* A message framed once for many connections, see websocket_prepare */
+typedef struct websocket_prepared websocket_prepared_t;
+
+/* A prepared frame queued by reference, written from frame[off..len) */
+struct websocket_oref {
+    struct websocket_oref *next;
+    websocket_prepared_t *p;
+    const unsigned char *frame;
+    size_t len, off;
+    size_t at; /* goes out once obuf has been written up to here */
+};
+
+/* A zerocopy send the kernel may still read from, see zerocopy */
+struct websocket_zc {
+    struct websocket_zc *next;
+    uint32_t id;   /* MSG_ZEROCOPY notification that completes it */
+    size_t size;   /* the frame header, then the masked copy on a client */
+};
+
 typedef struct websocket {
     int fd;
+    int tls;
+    int ktls_tx, ktls_rx; /* the kernel encrypts or decrypts, see ktls */
+    int nonblock;
+    int handshake;            /* non-blocking handshake in progress */
+    int server;               /* accepted, we are the server end */
+    char *path;               /* Request-URI a server was asked for */
+    struct websocket_options opts;
+    void *zctx;               /* permessage-deflate state, NULL if off */
+    unsigned char ws_key[32]; /* Sec-WebSocket-Key sent in the handshake */
+    unsigned char rnd[256];   /* random bytes handed out by websocket_random */
+    size_t rnd_left;          /* the last rnd_left bytes of rnd are unused */
+    uint64_t rnd_state;       /* generator state with mask_seed */
+    size_t head_scan;         /* response head bytes searched so far */
+    char protocol[64];        /* subprotocol the server selected */
     uint64_t remaining;
+    unsigned char *wbuf; /* send staging buffer */
+    unsigned char *rbuf; /* receive buffer */
+    size_t rsize;
+    size_t rpos, rlen;   /* unread bytes are rbuf[rpos..rlen) */
+    size_t view;         /* bytes lent out by recv_view and recv_batch */
+    unsigned char *msg;  /* fragmented message reassembly arena */
+    size_t msg_len, msg_cap;
+    size_t max_message; /* 0 means WEBSOCKET_MAX_MESSAGE */
+    int msg_type;       /* opcode of the message being reassembled */
+    int msg_deflate;    /* that message is compressed */
+    uint32_t utf8;      /* UTF-8 state of the TEXT message being received */
+    int utf8_rest;      /* the unread rest of the frame is TEXT to check */
+    int rest_mask;      /* that rest is masked with rest_key */
+    uint8_t rest_key[4];
+    uint64_t rest_pos;  /* payload offset the unread rest starts at */
+    websocket_fragment_cb on_fragment;
+    void *fragment_arg;
+    websocket_control_cb on_control;
+    void *control_arg;
+    int close_sent;      /* our CLOSE is out, no more frames may follow */
+    int close_recv;      /* the peer's CLOSE has been received */
+    int rx_failed;       /* a batch hit an error, the next receive fails */
+    uint16_t close_code; /* status code of the peer's CLOSE */
+    int send_type;      /* opcode of the message being streamed out */
+    int send_cont;      /* the first fragment has been sent */
+    size_t send_len;    /* payload bytes staged in wbuf */
+    size_t frag_size;   /* 0 means as large as wbuf allows */
+    uint8_t send_key[4];
+    unsigned char *obuf; /* output queue of a non-blocking connection */
+    size_t opos, olen, ocap;
+    struct websocket_oref *oref_head, *oref_tail;
+    size_t oref_bytes;   /* queued bytes of prepared frames */
+    int zc_state;        /* 1 SO_ZEROCOPY is on, -1 not used any more */
+    uint32_t zc_next;    /* notification id of the next zerocopy send */
+    uint32_t zc_done;    /* every id below this one has completed */
+    struct websocket_zc *zc_head, *zc_tail;
+    int cork;            /* coalesce output in obuf, see set_cork */
+    size_t cork_bytes;   /* flush once this much is queued */
+    unsigned int cork_usec; /* or once the oldest byte is this old */
+    uint64_t cork_start;    /* when the oldest queued byte was queued */
+    size_t high_wm, low_wm;
+    int above_wm;        /* the high watermark was hit and not yet cleared */
+    websocket_watermark_cb on_watermark;
+    void *watermark_arg;
+    /* Multi-producer queue, producers swap post_head, the writer pops */
+    struct websocket_post *post_head;
+    struct websocket_post *post_tail;
+    struct websocket_post post_stub;
+    long post_count;     /* posted and not yet drained */
+    websocket_post_cb on_post;
+    void *post_arg;
+    struct websocket_stats stats;
+    uint64_t handshake_start;
+    uint64_t ping_usec;  /* when our unanswered PING went out */
+    websocket_trace_cb on_trace;
+    void *trace_arg;
+    void *loop_data;     /* owned by websocket_loop */
+    int fed;             /* input comes from websocket_feed, see feed */
+    /* When set, output is only queued and the hook is told to flush later */
+    void (*on_output)(struct websocket *ws);
 } websocket_t;
 
 int websocket_connect(websocket_t *ws, const char *host, uint16_t port,
-                      const char *path);
+                      const char *path, int tls, const struct proxy *proxy);
+
+/* websocket_connect with options, opts may be NULL */
+int websocket_connect_opts(websocket_t *ws, const char *host, uint16_t port,
+                           const char *path, int tls,
+                           const struct proxy *proxy,
+                           const struct websocket_options *opts);
+
+/* Retry policy of websocket_connect_retry, a zeroed struct gives the defaults */
+struct websocket_backoff {
+    unsigned int initial_ms; /* bound of the first delay, 0 for 100 ms */
+    unsigned int max_ms;     /* the bound stops doubling here, 0 for 30 s */
+    int max_attempts;        /* 0 retries until it succeeds */
+};
+
+/*
+ * websocket_connect_opts until it succeeds, sleeping a random delay up to an
+ * exponentially growing bound between the attempts so clients that lost the
+ * same server do not reconnect in lockstep. backoff may be NULL. Return what
+ * the last websocket_connect_opts returned
+ */
+int websocket_connect_retry(websocket_t *ws, const char *host, uint16_t port,
+                            const char *path, int tls,
+                            const struct proxy *proxy,
+                            const struct websocket_options *opts,
+                            const struct websocket_backoff *backoff);
+
+/*
+ * Non-blocking connect. The TCP connection and TLS handshake are done by the
+ * net layer, then the socket is put in non-blocking mode and the upgrade is
+ * driven by websocket_connect_continue until it returns 0. Both return 0,
+ * WEBSOCKET_WANT_READ, WEBSOCKET_WANT_WRITE or -1, the connection is released
+ * on failure
+ */
+int websocket_connect_start(websocket_t *ws, const char *host, uint16_t port,
+                            const char *path, int tls,
+                            const struct proxy *proxy);
+int websocket_connect_continue(websocket_t *ws);
+
+/*
+ * Server side: take over the accepted plain TCP socket fd and run the
+ * opening handshake. Incoming frames must be masked, frames we send are
+ * not. opts.protocols lists the subprotocols we support, the first one the
+ * client offers is selected. ws owns fd from now on, also on failure. With
+ * opts.nonblock the handshake is finished by websocket_connect_continue.
+ * Return 0, WEBSOCKET_WANT_READ, WEBSOCKET_WANT_WRITE or -1
+ */
+int websocket_accept(websocket_t *ws, int fd);
+int websocket_accept_opts(websocket_t *ws, int fd,
+                          const struct websocket_options *opts);
+
+/* Request-URI of an accepted connection, NULL on the client side */
+const char *websocket_path(const websocket_t *ws);
+
+/* The subprotocol the server selected, NULL if it selected none */
+const char *websocket_protocol(const websocket_t *ws);
+
+/* The socket descriptor, for registering with epoll/kqueue */
+int websocket_fd(const websocket_t *ws);
+
+/*
+ * In non-blocking mode receiving returns WEBSOCKET_WANT_READ until a whole
+ * frame is buffered, sending queues whatever the socket does not take
+ */
+int websocket_set_nonblock(websocket_t *ws, int on);
+
+/*
+ * Write the queued output, return 0 once it is empty, WEBSOCKET_WANT_WRITE
+ * while a non-blocking socket still has data pending, -1 on failure
+ */
+int websocket_flush(websocket_t *ws);
+
+/*
+ * Cork the connection: framed messages are coalesced in the output queue
+ * and written together on websocket_flush, once bytes are queued or once the
+ * oldest queued byte is usec old (checked when the next frame is queued).
+ * bytes 0 means 64 KB, usec 0 means no age limit. A blocking receive flushes
+ * first. Uncorking flushes. Return -1 on failure
+ */
+int websocket_set_cork(websocket_t *ws, int on, size_t bytes,
+                       unsigned int usec);
+
+/* Bytes in the output queue, not yet handed to the socket */
+size_t websocket_queued(const websocket_t *ws);
+
+/*
+ * For an owner that writes the output queue itself, an io_uring loop: fill
+ * iov with up to max spans of the queue, oldest first, and return how many.
+ * Spans inside obuf move when more output is queued, those of prepared
+ * frames stay put until websocket_output_done drops them
+ */
+int websocket_output_spans(const websocket_t *ws, struct iovec *iov, int max);
+
+/* The first n queued bytes were written by the owner, drop them */
+void websocket_output_done(websocket_t *ws, size_t n);
+
+/*
+ * Call cb when the output queue grows to high bytes and again once it is
+ * back to low bytes, so producers can hold off instead of queueing without
+ * bound. high 0 disables it
+ */
+void websocket_set_watermarks(websocket_t *ws, size_t high, size_t low,
+                              websocket_watermark_cb cb, void *arg);
 
 /*
  * type: WebSocket message type
- * Read a frame of data, if it is not read, discard the unread data
+ * Read a message, if it is not read, discard the unread data. Fragmented
+ * messages are reassembled first. PING is answered with a PONG and PONG is
+ * consumed, both without reaching the caller, CLOSE is answered and then
+ * returned. With a fragment callback set, data messages go to the callback
+ * and 0 is returned once the message is complete
  */
 int websocket_recv(websocket_t *ws, int *type, void *buf, size_t n);
 
+/*
+ * Receive the next frame without copying, *ptr points at the payload inside
+ * the receive buffer and stays valid until websocket_release or the next
+ * receive call. A fragmented message is lent out of the reassembly arena. A
+ * frame larger than the receive buffer fails with -1 and is left unread for
+ * websocket_recv. Return 0 on success, -1 on failure
+ */
+int websocket_recv_view(websocket_t *ws, int *type, void **ptr, size_t *len);
+
+/* A message lent out by websocket_recv_batch */
+struct websocket_msg {
+    int type;
+    void *data;
+    size_t len;
+};
+
+/*
+ * Receive up to max messages in one call. The first one is received like
+ * websocket_recv_view, then every further data frame that is already
+ * complete in the receive buffer is lent out too, after one read of what
+ * the socket holds without waiting. The views stay valid until
+ * websocket_release or the next receive call. Return the number of
+ * messages, or what websocket_recv_view returns on failure. An error after
+ * the first message ends the batch and fails the next receive call
+ */
+int websocket_recv_batch(websocket_t *ws, struct websocket_msg *msgs, int max);
+
+/* Hand the payload lent by websocket_recv_view back to the connection */
+void websocket_release(websocket_t *ws);
+
+/*
+ * Append n bytes the owner read off the socket to the receive buffer. From
+ * the first call on the library never reads the socket itself, receiving
+ * returns WEBSOCKET_WANT_READ once the buffered bytes run out, until the
+ * owner clears ws->fed. While a view is lent out the bytes have to fit the
+ * free tail of the buffer. Return -1 on failure
+ */
+int websocket_feed(websocket_t *ws, const void *buf, size_t n);
+
+/*
+ * Never blocks: return 1 when a whole data message or a CLOSE is buffered,
+ * so websocket_recv returns it without waiting, 0 when not yet, -1 on error
+ * or once the connection is closed. PING and PONG are answered and consumed
+ * on the way. At most one read of what the socket already holds. Spinning
+ * on it with busy_poll set keeps the thread off the scheduler
+ */
+int websocket_poll(websocket_t *ws);
+
+/*
+ * Reap MSG_ZEROCOPY completions and return how many zerocopy sends the
+ * kernel has not finished with yet. A server may reuse the buffers it
+ * passed to websocket_send once this is 0
+ */
+int websocket_zerocopy_pending(websocket_t *ws);
+
+/* Bound the size of a reassembled fragmented message, 0 restores 16 MB */
+void websocket_set_max_message_size(websocket_t *ws, size_t size);
+
+/* Stream data messages to cb instead of buffering them, NULL disables it */
+void websocket_set_fragment_cb(websocket_t *ws, websocket_fragment_cb cb,
+                               void *arg);
+
+/* See websocket_control_cb, NULL disables it */
+void websocket_set_control_cb(websocket_t *ws, websocket_control_cb cb,
+                              void *arg);
+
+/*
+ * Status code of the peer's CLOSE, WEBSOCKET_CLOSE_NO_STATUS if it carried
+ * none, 0 if no CLOSE has been received
+ */
+int websocket_close_code(const websocket_t *ws);
+
+/* Counters of ws, see struct websocket_stats */
+const struct websocket_stats *websocket_stats(const websocket_t *ws);
+
+/*
+ * Call cb at every frame boundary and when the handshake completes. It runs
+ * inline on the I/O path and should only record the event. NULL disables it
+ */
+void websocket_set_trace(websocket_t *ws, websocket_trace_cb cb, void *arg);
+
+/*
+ * Route the library's error messages to cb for every connection, NULL
+ * silences them without formatting. Set it before connections are used
+ */
+void websocket_set_logger(websocket_log_cb cb, void *arg);
+
+/* Format a message for the logger, used by the library's own modules */
+void websocket_log(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
+
+/*
+ * Start the closing handshake with a status code and an optional reason of
+ * at most 123 bytes, code 0 sends a CLOSE without a body. Nothing may be sent
+ * afterwards, keep receiving until the peer's CLOSE arrives and then call
+ * websocket_close. Return 0 on success, -1 on failure
+ */
+int websocket_send_close(websocket_t *ws, int code, const char *reason);
+
 /*
  * Send data to the websocket server, return the number of bytes sent
  * successfully, return -1 on failure
  */
 int websocket_send(websocket_t *ws, int type, const void *buf, size_t n);
 
+/*
+ * Send the concatenation of iov[0..iovcnt) as one message, return the number
+ * of payload bytes sent successfully, return -1 on failure
+ */
+int websocket_sendv(websocket_t *ws, int type, const struct iovec *iov,
+                    int iovcnt);
+
+/*
+ * Send buf as one message without a staging copy: the payload is masked in
+ * place inside buf and written directly, restore masks it back afterwards.
+ * Without restore buf holds masked bytes on return. Compressed messages go
+ * through websocket_send. Return the number of bytes sent, -1 on failure
+ */
+int websocket_send_inplace(websocket_t *ws, int type, void *buf, size_t n,
+                           int restore);
+
+/*
+ * Broadcast: frame a message once and send it to any number of connections.
+ * Server connections queue the shared frame by reference, clients still
+ * mask their own copy. With compress a deflated variant is kept as well, it
+ * goes to connections that compress without context takeover over a 15-bit
+ * window and the plain frame to the others. Return NULL on failure
+ */
+websocket_prepared_t *websocket_prepare(int type, const void *buf, size_t n,
+                                        int compress);
+
+/* Take a reference, the prepared message lives until the last unref */
+websocket_prepared_t *websocket_prepared_ref(websocket_prepared_t *p);
+void websocket_prepared_unref(websocket_prepared_t *p);
+
+/*
+ * Send a prepared message on ws, p may be unref'ed right after. Return the
+ * number of payload bytes sent, -1 on failure
+ */
+int websocket_send_prepared(websocket_t *ws, websocket_prepared_t *p);
+
+/*
+ * Streamed send: begin a TEXT or BINARY message, append data in any number
+ * of pieces and finish it. The data goes out as fragments of the configured
+ * fragment size, control frames may be sent in between. Streamed messages
+ * are not compressed. Return -1 on failure
+ */
+int websocket_send_begin(websocket_t *ws, int type);
+int websocket_send_append(websocket_t *ws, const void *buf, size_t n);
+int websocket_send_finish(websocket_t *ws);
+
+/*
+ * Send count bytes of fd starting at offset as one fragmented message,
+ * return 0 on success, -1 on failure
+ */
+int websocket_send_file(websocket_t *ws, int type, int fd, off_t offset,
+                        uint64_t count);
+
+/*
+ * Thread-safe send. Any thread may post a message, it is copied into a
+ * lock-free queue and framed later by the one writer thread in
+ * websocket_drain, so frames from different threads never interleave. Every
+ * other call on ws (sends included) belongs to the writer thread. Return 0
+ * once the message is queued, -1 on failure
+ */
+int websocket_post(websocket_t *ws, int type, const void *buf, size_t n);
+
+/*
+ * Writer side: frame and send every posted message as one corked batch.
+ * Return the number of messages sent, -1 on failure
+ */
+int websocket_drain(websocket_t *ws);
+
+/*
+ * cb runs on the posting thread whenever the queue goes from empty to
+ * non-empty, it should wake the writer up to call websocket_drain
+ */
+void websocket_set_post_cb(websocket_t *ws, websocket_post_cb cb, void *arg);
+
+/* Payload bytes per fragment of a streamed message, 0 for the default */
+void websocket_set_fragment_size(websocket_t *ws, size_t size);
+
+/* Send CLOSE 1000 unless a CLOSE was already sent, then release ws */
 void websocket_close(websocket_t *ws);
 
 #endif /* websocket.h */
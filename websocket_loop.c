@@ -0,0 +1,1315 @@
+/* MIT License Copyright (c) 2021, h1zzz */
+
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE /* CPU_SET, pthread_setaffinity_np */
+#endif
+
+#include "websocket_loop.h"
+
+#if defined(__linux__)
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <poll.h>
+#include <sched.h>
+#if defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#endif
+#endif
+#if defined(__NR_io_uring_setup) && defined(IORING_RECV_MULTISHOT)
+#define LOOP_URING
+#endif
+#else
+#include <sys/types.h>
+#include <sys/event.h>
+#include <sys/time.h>
+#endif
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <errno.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#define LOOP_MAX_EVENTS 256
+
+#define LOOP_URING_ENTRIES 256
+#define LOOP_URING_BUFS 128      /* receive buffers in the ring, a power of 2 */
+#define LOOP_URING_BUF_SIZE 16384
+#define LOOP_SEND_SPANS 16       /* linked SENDs in one chain */
+#define LOOP_SEND_MAX 1048576    /* bytes one chain takes at most */
+
+struct websocket_loop_conn {
+    websocket_t *ws;
+    websocket_loop_t *loop;
+    int writing; /* write interest is registered */
+    int dirty;   /* on the dirty list */
+    struct websocket_loop_conn *prev, *next;
+    struct websocket_loop_conn *dirty_next;
+    /* io_uring only */
+    int recving;        /* the multishot recv is armed */
+    int sending;        /* SENDs of the chain not completed yet */
+    int send_next;      /* the chain's next SEND to complete */
+    int send_failed;    /* a SEND of the chain failed or came up short */
+    size_t send_len[LOOP_SEND_SPANS];
+    unsigned char *stage; /* copies of the obuf spans in flight */
+    size_t stage_cap;
+};
+
+struct loop_event {
+    void *ptr; /* NULL for the wakeup pipe */
+    int readable;
+    int writable;
+};
+
+/*
+ * Poller backend, epoll on Linux and kqueue elsewhere. Connections are
+ * always watched for reading, write interest is only registered while
+ * output is queued
+ */
+#if defined(__linux__)
+static int poller_create(void)
+{
+    return epoll_create1(EPOLL_CLOEXEC);
+}
+
+static int poller_ctl(websocket_loop_t *loop, int op, int fd, void *ptr,
+                      int writing)
+{
+    struct epoll_event ev;
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN | (writing ? EPOLLOUT : 0);
+    ev.data.ptr = ptr;
+
+    return epoll_ctl(loop->fd, op, fd, &ev);
+}
+
+static int poller_add(websocket_loop_t *loop, int fd, void *ptr)
+{
+    return poller_ctl(loop, EPOLL_CTL_ADD, fd, ptr, 0);
+}
+
+static int poller_set_write(websocket_loop_t *loop, int fd, void *ptr, int on)
+{
+    return poller_ctl(loop, EPOLL_CTL_MOD, fd, ptr, on);
+}
+
+static void poller_del(websocket_loop_t *loop, int fd)
+{
+    epoll_ctl(loop->fd, EPOLL_CTL_DEL, fd, NULL);
+}
+
+static int poller_wait(websocket_loop_t *loop, struct loop_event *out, int max)
+{
+    struct epoll_event events[LOOP_MAX_EVENTS];
+    int i, n;
+
+    n = epoll_wait(loop->fd, events, max, -1);
+    for (i = 0; i < n; i++) {
+        out[i].ptr = events[i].data.ptr;
+        out[i].readable = events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP);
+        out[i].writable = events[i].events & EPOLLOUT;
+    }
+
+    return n;
+}
+#else
+static int poller_create(void)
+{
+    return kqueue();
+}
+
+static int poller_add(websocket_loop_t *loop, int fd, void *ptr)
+{
+    struct kevent ev[2];
+
+    EV_SET(&ev[0], fd, EVFILT_READ, EV_ADD, 0, 0, ptr);
+    EV_SET(&ev[1], fd, EVFILT_WRITE, EV_ADD | EV_DISABLE, 0, 0, ptr);
+
+    return kevent(loop->fd, ev, ptr ? 2 : 1, NULL, 0, NULL);
+}
+
+static int poller_set_write(websocket_loop_t *loop, int fd, void *ptr, int on)
+{
+    struct kevent ev;
+
+    EV_SET(&ev, fd, EVFILT_WRITE, on ? EV_ENABLE : EV_DISABLE, 0, 0, ptr);
+
+    return kevent(loop->fd, &ev, 1, NULL, 0, NULL);
+}
+
+static void poller_del(websocket_loop_t *loop, int fd)
+{
+    struct kevent ev[2];
+
+    EV_SET(&ev[0], fd, EVFILT_READ, EV_DELETE, 0, 0, NULL);
+    EV_SET(&ev[1], fd, EVFILT_WRITE, EV_DELETE, 0, 0, NULL);
+    kevent(loop->fd, ev, 2, NULL, 0, NULL);
+}
+
+static int poller_wait(websocket_loop_t *loop, struct loop_event *out, int max)
+{
+    struct kevent events[LOOP_MAX_EVENTS];
+    int i, n;
+
+    n = kevent(loop->fd, NULL, 0, events, max, NULL);
+    for (i = 0; i < n; i++) {
+        out[i].ptr = events[i].udata;
+        out[i].readable = events[i].filter == EVFILT_READ;
+        out[i].writable = events[i].filter == EVFILT_WRITE;
+    }
+
+    return n;
+}
+#endif
+
+#if defined(LOOP_URING)
+/*
+ * io_uring backend, on the raw system calls. Every connection keeps one
+ * multishot recv armed that picks buffers from a ring registered with the
+ * kernel, the bytes are handed to the connection with websocket_feed. Queued
+ * output leaves as a chain of linked SENDs, one per span of the queue, and
+ * the whole batch of chains is submitted with the next io_uring_enter. The
+ * user_data of an operation is its connection with the operation in the low
+ * bits
+ */
+#define LOOP_OP_MASK 7
+#define LOOP_OP_RECV 1
+#define LOOP_OP_SEND 2
+#define LOOP_OP_WAKEUP 3
+#define LOOP_OP_CANCEL 4
+
+struct loop_uring {
+    unsigned int *sq_head, *sq_tail, *sq_mask;
+    unsigned int sq_entries;
+    unsigned int tail;      /* local SQ tail, published with each SQE */
+    unsigned int to_submit; /* SQEs io_uring_enter has not taken yet */
+    struct io_uring_sqe *sqes;
+    unsigned int *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_cqe *cqes;
+    void *ring;
+    size_t ring_size, sqes_size;
+    struct io_uring_buf_ring *br; /* receive buffers, registered */
+    size_t br_size;
+    unsigned char *bufs;
+    unsigned short br_tail;
+    int br_registered;
+    /* Completions reaped and not handled yet, user_data 0 once handled */
+    struct io_uring_cqe *backlog;
+    size_t pos, n, cap;
+};
+
+static uint64_t uring_data(struct websocket_loop_conn *conn, int op)
+{
+    return (uint64_t)(uintptr_t)conn | (uint64_t)op;
+}
+
+static struct websocket_loop_conn *uring_conn(const struct io_uring_cqe *cqe)
+{
+    return (void *)(uintptr_t)(cqe->user_data & ~(uint64_t)LOOP_OP_MASK);
+}
+
+/* Submit what is pending, and wait for a completion when wait is set */
+static int uring_enter(websocket_loop_t *loop, int wait)
+{
+    struct loop_uring *u = loop->uring;
+    long ret;
+
+    ret = syscall(__NR_io_uring_enter, loop->fd, u->to_submit, wait ? 1 : 0,
+                  wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+    if (ret == -1)
+        return -1;
+    u->to_submit -= (unsigned int)ret;
+
+    return 0;
+}
+
+/* Room for n SQEs, a chain split across two submissions can be reordered */
+static int uring_reserve(websocket_loop_t *loop, unsigned int n)
+{
+    struct loop_uring *u = loop->uring;
+    unsigned int used;
+
+    used = u->tail - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE);
+    if (u->sq_entries - used >= n)
+        return 0;
+
+    if (uring_enter(loop, 0) == -1) {
+        websocket_log("io_uring_enter error\n");
+        return -1;
+    }
+    used = u->tail - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE);
+    if (u->sq_entries - used < n) {
+        websocket_log("io_uring submission queue full\n");
+        return -1;
+    }
+
+    return 0;
+}
+
+static struct io_uring_sqe *uring_sqe(websocket_loop_t *loop)
+{
+    struct loop_uring *u = loop->uring;
+    struct io_uring_sqe *sqe;
+
+    if (uring_reserve(loop, 1) == -1)
+        return NULL;
+
+    sqe = &u->sqes[u->tail & *u->sq_mask];
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    u->tail++;
+    u->to_submit++;
+    __atomic_store_n(u->sq_tail, u->tail, __ATOMIC_RELEASE);
+
+    return sqe;
+}
+
+/* Move the completions out of the ring, to the end of the backlog */
+static int uring_reap(websocket_loop_t *loop)
+{
+    struct loop_uring *u = loop->uring;
+    struct io_uring_cqe *backlog;
+    unsigned int head, tail;
+    size_t cap;
+
+    head = *u->cq_head;
+    tail = __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE);
+    for (; head != tail; head++) {
+        if (u->n == u->cap) {
+            cap = u->cap ? u->cap * 2 : LOOP_URING_ENTRIES;
+            backlog = realloc(u->backlog, cap * sizeof(struct io_uring_cqe));
+            if (!backlog) {
+                websocket_log("realloc error\n");
+                break;
+            }
+            u->backlog = backlog;
+            u->cap = cap;
+        }
+        u->backlog[u->n++] = u->cqes[head & *u->cq_mask];
+    }
+    __atomic_store_n(u->cq_head, head, __ATOMIC_RELEASE);
+
+    return head == tail ? 0 : -1;
+}
+
+static unsigned char *uring_buf(struct loop_uring *u, unsigned int bid)
+{
+    return u->bufs + (size_t)bid * LOOP_URING_BUF_SIZE;
+}
+
+/* Give receive buffer bid back to the kernel */
+static void uring_recycle(websocket_loop_t *loop, unsigned int bid)
+{
+    struct loop_uring *u = loop->uring;
+    struct io_uring_buf *buf;
+
+    buf = &u->br->bufs[u->br_tail & (LOOP_URING_BUFS - 1)];
+    buf->addr = (uint64_t)(uintptr_t)uring_buf(u, bid);
+    buf->len = LOOP_URING_BUF_SIZE;
+    buf->bid = (unsigned short)bid;
+    u->br_tail++;
+    __atomic_store_n(&u->br->tail, u->br_tail, __ATOMIC_RELEASE);
+}
+
+static int uring_recv(websocket_loop_t *loop, struct websocket_loop_conn *conn)
+{
+    struct io_uring_sqe *sqe;
+
+    sqe = uring_sqe(loop);
+    if (!sqe)
+        return -1;
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = websocket_fd(conn->ws);
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = 0;
+    sqe->user_data = uring_data(conn, LOOP_OP_RECV);
+    conn->recving = 1;
+
+    return 0;
+}
+
+static int uring_poll_wakeup(websocket_loop_t *loop)
+{
+    struct io_uring_sqe *sqe;
+
+    sqe = uring_sqe(loop);
+    if (!sqe)
+        return -1;
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = loop->wakeup[0];
+    sqe->len = IORING_POLL_ADD_MULTI;
+    sqe->poll32_events = POLLIN;
+    sqe->user_data = LOOP_OP_WAKEUP;
+
+    return 0;
+}
+
+static int uring_cancel(websocket_loop_t *loop,
+                        struct websocket_loop_conn *conn, int op)
+{
+    struct io_uring_sqe *sqe;
+
+    sqe = uring_sqe(loop);
+    if (!sqe)
+        return -1;
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->addr = uring_data(conn, op);
+    sqe->cancel_flags = IORING_ASYNC_CANCEL_ALL;
+    sqe->user_data = LOOP_OP_CANCEL;
+
+    return 0;
+}
+
+/*
+ * Account for a completion of conn: received bytes go to the connection,
+ * written ones leave its queue. Return -1 when the connection failed
+ */
+static int uring_account(websocket_loop_t *loop,
+                         struct websocket_loop_conn *conn,
+                         const struct io_uring_cqe *cqe)
+{
+    struct loop_uring *u = loop->uring;
+    unsigned int bid;
+    int ret = 0;
+
+    if ((cqe->user_data & LOOP_OP_MASK) == LOOP_OP_SEND) {
+        conn->sending--;
+        if (!conn->send_failed && cqe->res > 0)
+            websocket_output_done(conn->ws, (size_t)cqe->res);
+        if (cqe->res < 0 ||
+            (size_t)cqe->res < conn->send_len[conn->send_next])
+            conn->send_failed = 1;
+        conn->send_next++;
+        return conn->send_failed ? -1 : 0;
+    }
+
+    if (cqe->flags & IORING_CQE_F_BUFFER) {
+        bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+        if (cqe->res > 0 &&
+            websocket_feed(conn->ws, uring_buf(u, bid), (size_t)cqe->res) == -1)
+            ret = -1;
+        uring_recycle(loop, bid);
+    }
+    if (!(cqe->flags & IORING_CQE_F_MORE))
+        conn->recving = 0;
+
+    return ret;
+}
+
+/*
+ * Cancel what conn has in flight and wait until none of it can complete
+ * any more. Bytes that still arrive are fed to the connection without being
+ * dispatched, completions of other connections stay in the backlog
+ */
+static void uring_settle(websocket_loop_t *loop,
+                         struct websocket_loop_conn *conn)
+{
+    struct loop_uring *u = loop->uring;
+    size_t i;
+
+    if (conn->recving && uring_cancel(loop, conn, LOOP_OP_RECV) == -1)
+        websocket_log("uring_cancel error\n");
+    if (conn->sending && uring_cancel(loop, conn, LOOP_OP_SEND) == -1)
+        websocket_log("uring_cancel error\n");
+
+    for (;;) {
+        for (i = u->pos; i < u->n; i++) {
+            if (!u->backlog[i].user_data || uring_conn(&u->backlog[i]) != conn)
+                continue;
+            uring_account(loop, conn, &u->backlog[i]);
+            u->backlog[i].user_data = 0;
+        }
+        if (!conn->recving && !conn->sending)
+            return;
+
+        if (uring_enter(loop, 1) == -1 && errno != EINTR && errno != EBUSY) {
+            websocket_log("io_uring_enter error\n");
+            return;
+        }
+        uring_reap(loop);
+    }
+}
+
+static void uring_free(websocket_loop_t *loop)
+{
+    struct loop_uring *u = loop->uring;
+    struct io_uring_buf_reg reg;
+
+    if (u->br_registered) {
+        memset(&reg, 0, sizeof(reg));
+        reg.bgid = 0;
+        syscall(__NR_io_uring_register, loop->fd, IORING_UNREGISTER_PBUF_RING,
+                &reg, 1);
+    }
+    if (u->ring)
+        munmap(u->ring, u->ring_size);
+    if (u->sqes)
+        munmap(u->sqes, u->sqes_size);
+    if (u->br)
+        munmap(u->br, u->br_size);
+    if (loop->fd != -1)
+        close(loop->fd);
+    free(u->bufs);
+    free(u->backlog);
+    free(u);
+    loop->uring = NULL;
+}
+
+/* The rings, and the receive buffers registered as buffer group 0 */
+static int uring_setup(websocket_loop_t *loop)
+{
+    struct loop_uring *u = loop->uring;
+    struct io_uring_params p;
+    struct io_uring_buf_reg reg;
+    unsigned char *ring;
+    size_t cq_size;
+    unsigned int i;
+
+    memset(&p, 0, sizeof(p));
+    p.flags = IORING_SETUP_CQSIZE;
+    p.cq_entries = LOOP_URING_ENTRIES * 4;
+    loop->fd = (int)syscall(__NR_io_uring_setup, LOOP_URING_ENTRIES, &p);
+    if (loop->fd == -1) {
+        websocket_log("io_uring_setup error\n");
+        return -1;
+    }
+    fcntl(loop->fd, F_SETFD, FD_CLOEXEC);
+
+    /* Completions must never be dropped, one mmap covers both rings */
+    if (!(p.features & IORING_FEAT_SINGLE_MMAP) ||
+        !(p.features & IORING_FEAT_NODROP)) {
+        websocket_log("io_uring is too old\n");
+        return -1;
+    }
+
+    u->ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+    cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (cq_size > u->ring_size)
+        u->ring_size = cq_size;
+    u->ring = mmap(NULL, u->ring_size, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, loop->fd, IORING_OFF_SQ_RING);
+    if (u->ring == MAP_FAILED) {
+        u->ring = NULL;
+        websocket_log("mmap error\n");
+        return -1;
+    }
+    u->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    u->sqes = mmap(NULL, u->sqes_size, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, loop->fd, IORING_OFF_SQES);
+    if (u->sqes == MAP_FAILED) {
+        u->sqes = NULL;
+        websocket_log("mmap error\n");
+        return -1;
+    }
+
+    ring = u->ring;
+    u->sq_head = (unsigned int *)(ring + p.sq_off.head);
+    u->sq_tail = (unsigned int *)(ring + p.sq_off.tail);
+    u->sq_mask = (unsigned int *)(ring + p.sq_off.ring_mask);
+    u->sq_entries = p.sq_entries;
+    u->tail = *u->sq_tail;
+    for (i = 0; i < p.sq_entries; i++)
+        ((unsigned int *)(ring + p.sq_off.array))[i] = i;
+    u->cq_head = (unsigned int *)(ring + p.cq_off.head);
+    u->cq_tail = (unsigned int *)(ring + p.cq_off.tail);
+    u->cq_mask = (unsigned int *)(ring + p.cq_off.ring_mask);
+    u->cqes = (struct io_uring_cqe *)(ring + p.cq_off.cqes);
+
+    /* The buffer ring has to be page aligned */
+    u->br_size = LOOP_URING_BUFS * sizeof(struct io_uring_buf);
+    u->br = mmap(NULL, u->br_size, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (u->br == MAP_FAILED) {
+        u->br = NULL;
+        websocket_log("mmap error\n");
+        return -1;
+    }
+    u->bufs = malloc((size_t)LOOP_URING_BUFS * LOOP_URING_BUF_SIZE);
+    if (!u->bufs) {
+        websocket_log("malloc error\n");
+        return -1;
+    }
+
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t)(uintptr_t)u->br;
+    reg.ring_entries = LOOP_URING_BUFS;
+    reg.bgid = 0;
+    if (syscall(__NR_io_uring_register, loop->fd, IORING_REGISTER_PBUF_RING,
+                &reg, 1) == -1) {
+        websocket_log("io_uring_register error\n");
+        return -1;
+    }
+    u->br_registered = 1;
+    for (i = 0; i < LOOP_URING_BUFS; i++)
+        uring_recycle(loop, i);
+
+    return 0;
+}
+#endif
+
+/* The wakeup pipe, non-blocking on both ends */
+static int loop_init_wakeup(websocket_loop_t *loop)
+{
+    int i;
+
+    if (pipe(loop->wakeup) == -1) {
+        websocket_log("pipe error\n");
+        return -1;
+    }
+
+    for (i = 0; i < 2; i++) {
+        fcntl(loop->wakeup[i], F_SETFL,
+              fcntl(loop->wakeup[i], F_GETFL, 0) | O_NONBLOCK);
+        fcntl(loop->wakeup[i], F_SETFD, FD_CLOEXEC);
+    }
+
+    return 0;
+}
+
+int websocket_loop_init(websocket_loop_t *loop,
+                        const struct websocket_loop_cbs *cbs, void *arg)
+{
+    memset(loop, 0, sizeof(websocket_loop_t));
+
+    loop->fd = poller_create();
+    if (loop->fd == -1) {
+        websocket_log("poller_create error\n");
+        return -1;
+    }
+
+    if (loop_init_wakeup(loop) == -1) {
+        close(loop->fd);
+        return -1;
+    }
+
+    if (poller_add(loop, loop->wakeup[0], NULL) == -1) {
+        websocket_log("poller_add error\n");
+        close(loop->wakeup[0]);
+        close(loop->wakeup[1]);
+        close(loop->fd);
+        return -1;
+    }
+
+    pthread_mutex_init(&loop->lock, NULL);
+    loop->cbs = *cbs;
+    loop->arg = arg;
+
+    return 0;
+}
+
+int websocket_loop_init_uring(websocket_loop_t *loop,
+                              const struct websocket_loop_cbs *cbs, void *arg)
+{
+#if defined(LOOP_URING)
+    memset(loop, 0, sizeof(websocket_loop_t));
+
+    loop->fd = -1;
+    loop->uring = calloc(1, sizeof(struct loop_uring));
+    if (!loop->uring) {
+        websocket_log("calloc error\n");
+        return -1;
+    }
+
+    if (uring_setup(loop) == -1) {
+        uring_free(loop);
+        return -1;
+    }
+
+    if (loop_init_wakeup(loop) == -1) {
+        uring_free(loop);
+        return -1;
+    }
+
+    if (uring_poll_wakeup(loop) == -1) {
+        websocket_log("uring_poll_wakeup error\n");
+        close(loop->wakeup[0]);
+        close(loop->wakeup[1]);
+        uring_free(loop);
+        return -1;
+    }
+
+    pthread_mutex_init(&loop->lock, NULL);
+    loop->cbs = *cbs;
+    loop->arg = arg;
+
+    return 0;
+#else
+    (void)loop;
+    (void)cbs;
+    (void)arg;
+    websocket_log("io_uring is not available\n");
+    return -1;
+#endif
+}
+
+static void loop_wakeup(websocket_loop_t *loop)
+{
+    char c = 0;
+
+    /* A full pipe already guarantees a wakeup */
+    if (write(loop->wakeup[1], &c, 1) == -1 && errno != EAGAIN)
+        websocket_log("write error\n");
+}
+
+/*
+ * Output hook of loop connections: sends only queue, and each connection
+ * that queued something is written once when the current batch of events
+ * is done, so a burst of sends costs one write per connection per batch
+ */
+static void loop_on_output(websocket_t *ws)
+{
+    struct websocket_loop_conn *conn = ws->loop_data;
+
+    if (conn->dirty)
+        return;
+
+    conn->dirty = 1;
+    conn->dirty_next = conn->loop->dirty;
+    conn->loop->dirty = conn;
+}
+
+int websocket_loop_add(websocket_loop_t *loop, websocket_t *ws)
+{
+    struct websocket_loop_conn *conn;
+
+    /* io_uring reads and writes the socket, there is no TLS layer on it */
+    if (loop->uring && ws->tls && !(ws->ktls_tx && ws->ktls_rx)) {
+        websocket_log("io_uring needs plain TCP or kernel TLS\n");
+        return -1;
+    }
+
+    if (websocket_set_nonblock(ws, 1) == -1) {
+        websocket_log("websocket_set_nonblock error\n");
+        return -1;
+    }
+
+    conn = calloc(1, sizeof(struct websocket_loop_conn));
+    if (!conn) {
+        websocket_log("calloc error\n");
+        return -1;
+    }
+    conn->ws = ws;
+    conn->loop = loop;
+    ws->loop_data = conn;
+
+    /* Registration happens on the loop's thread */
+    pthread_mutex_lock(&loop->lock);
+    conn->next = loop->pending;
+    loop->pending = conn;
+    loop->nconn++;
+    pthread_mutex_unlock(&loop->lock);
+
+    loop_wakeup(loop);
+
+    return 0;
+}
+
+static void loop_unlink(websocket_loop_t *loop, struct websocket_loop_conn *conn)
+{
+    if (conn->prev)
+        conn->prev->next = conn->next;
+    else
+        loop->conns = conn->next;
+    if (conn->next)
+        conn->next->prev = conn->prev;
+}
+
+void websocket_loop_remove(websocket_loop_t *loop, websocket_t *ws)
+{
+    struct websocket_loop_conn *conn = ws->loop_data;
+
+    if (!conn)
+        return;
+
+#if defined(LOOP_URING)
+    if (loop->uring)
+        uring_settle(loop, conn);
+    else
+#endif
+        poller_del(loop, websocket_fd(ws));
+    loop_unlink(loop, conn);
+    ws->loop_data = NULL;
+    ws->on_output = NULL;
+    ws->fed = 0;
+
+    /*
+     * Events of the current batch may still point at conn, it is freed once
+     * the batch is done
+     */
+    conn->ws = NULL;
+    conn->next = loop->garbage;
+    loop->garbage = conn;
+
+    pthread_mutex_lock(&loop->lock);
+    loop->nconn--;
+    pthread_mutex_unlock(&loop->lock);
+}
+
+static void loop_drop(websocket_loop_t *loop, websocket_t *ws)
+{
+    websocket_loop_remove(loop, ws);
+    if (loop->cbs.on_close)
+        loop->cbs.on_close(ws, loop->arg);
+}
+
+/* Register write interest only while output is queued */
+static int loop_update(websocket_loop_t *loop, struct websocket_loop_conn *conn)
+{
+    websocket_t *ws = conn->ws;
+    int writing = websocket_queued(ws) > 0;
+
+    if (writing == conn->writing)
+        return 0;
+
+    if (poller_set_write(loop, websocket_fd(ws), conn, writing) == -1) {
+        websocket_log("poller_set_write error\n");
+        return -1;
+    }
+    conn->writing = writing;
+
+    return 0;
+}
+
+/*
+ * Dispatch every message that can be completed without blocking. The
+ * socket is drained until it would block, so level and edge triggering
+ * both see the next event. Return -1 when the connection has to go
+ */
+static int loop_read(websocket_loop_t *loop, websocket_t *ws)
+{
+    void *ptr;
+    size_t len;
+    int type, ret;
+
+    for (;;) {
+        ret = websocket_recv_view(ws, &type, &ptr, &len);
+        if (ret == WEBSOCKET_WANT_READ)
+            return 0;
+        if (ret < 0)
+            return -1;
+
+        if (loop->cbs.on_message) {
+            ret = loop->cbs.on_message(ws, type, ptr, len, loop->arg);
+            if (ret == -1)
+                return -1;
+        }
+
+        websocket_release(ws);
+
+        if (type == WEBSOCKET_CLOSE)
+            return -1;
+    }
+}
+
+static int loop_flush(websocket_t *ws)
+{
+    int ret;
+
+    ret = websocket_flush(ws);
+
+    return ret == -1 ? -1 : 0;
+}
+
+#if defined(LOOP_URING)
+/*
+ * Send the front of the queue as one chain of linked SENDs. Spans inside
+ * obuf move when more is queued and leave from a copy, prepared frames are
+ * sent from where they are. Only one chain is in flight, its completion
+ * sends what was queued meanwhile
+ */
+static int uring_send(websocket_loop_t *loop, struct websocket_loop_conn *conn)
+{
+    struct iovec iov[LOOP_SEND_SPANS];
+    websocket_t *ws = conn->ws;
+    struct io_uring_sqe *sqe;
+    unsigned char *stage;
+    size_t total = 0, size = 0, off = 0;
+    int i, n;
+
+    if (conn->sending)
+        return 0;
+
+    n = websocket_output_spans(ws, iov, LOOP_SEND_SPANS);
+    for (i = 0; i < n; i++) {
+        if (iov[i].iov_len > LOOP_SEND_MAX - total) {
+            iov[i].iov_len = LOOP_SEND_MAX - total;
+            n = i + 1;
+        }
+        total += iov[i].iov_len;
+        if ((unsigned char *)iov[i].iov_base >= ws->obuf &&
+            (unsigned char *)iov[i].iov_base < ws->obuf + ws->olen)
+            size += iov[i].iov_len;
+    }
+    if (n == 0)
+        return 0;
+
+    if (size > conn->stage_cap) {
+        stage = realloc(conn->stage, size);
+        if (!stage) {
+            websocket_log("realloc error\n");
+            return -1;
+        }
+        conn->stage = stage;
+        conn->stage_cap = size;
+    }
+
+    if (uring_reserve(loop, (unsigned int)n) == -1)
+        return -1;
+
+    for (i = 0; i < n; i++) {
+        if ((unsigned char *)iov[i].iov_base >= ws->obuf &&
+            (unsigned char *)iov[i].iov_base < ws->obuf + ws->olen) {
+            memcpy(conn->stage + off, iov[i].iov_base, iov[i].iov_len);
+            iov[i].iov_base = conn->stage + off;
+            off += iov[i].iov_len;
+        }
+
+        sqe = uring_sqe(loop);
+        sqe->opcode = IORING_OP_SEND;
+        sqe->fd = websocket_fd(ws);
+        sqe->addr = (uint64_t)(uintptr_t)iov[i].iov_base;
+        sqe->len = (uint32_t)iov[i].iov_len;
+        sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+        sqe->flags = i + 1 < n ? IOSQE_IO_LINK : 0;
+        sqe->user_data = uring_data(conn, LOOP_OP_SEND);
+        conn->send_len[i] = iov[i].iov_len;
+    }
+    conn->sending = n;
+    conn->send_next = 0;
+    conn->send_failed = 0;
+
+    return 0;
+}
+
+static void uring_on_recv(websocket_loop_t *loop,
+                          struct websocket_loop_conn *conn,
+                          const struct io_uring_cqe *cqe)
+{
+    websocket_t *ws = conn->ws;
+    int ret;
+
+    if (uring_account(loop, conn, cqe) == -1 ||
+        (cqe->res > 0 && loop_read(loop, ws) == -1)) {
+        loop_drop(loop, ws);
+        return;
+    }
+    if (!conn->ws || (cqe->flags & IORING_CQE_F_MORE))
+        return;
+
+    /* The multishot recv ended, it ran out of buffers or hit a record */
+    if (cqe->res > 0 || cqe->res == -ENOBUFS) {
+        if (uring_recv(loop, conn) == -1)
+            loop_drop(loop, ws);
+        return;
+    }
+
+    /*
+     * A kernel TLS record that is not application data fails recv with
+     * EIO, the library reads it itself, drops a session ticket and fails on
+     * an alert
+     */
+    if (cqe->res == -EIO && ws->ktls_rx) {
+        ws->fed = 0;
+        ret = loop_read(loop, ws);
+        if (!conn->ws)
+            return;
+        ws->fed = 1;
+        if (ret == -1 || uring_recv(loop, conn) == -1)
+            loop_drop(loop, ws);
+        return;
+    }
+
+    if (cqe->res < 0)
+        websocket_log("recv error\n");
+    loop_drop(loop, ws);
+}
+
+static void uring_on_send(websocket_loop_t *loop,
+                          struct websocket_loop_conn *conn,
+                          const struct io_uring_cqe *cqe)
+{
+    uring_account(loop, conn, cqe);
+    if (conn->sending > 0)
+        return;
+
+    if (conn->send_failed) {
+        websocket_log("send error\n");
+        loop_drop(loop, conn->ws);
+        return;
+    }
+    if (websocket_queued(conn->ws) > 0 && uring_send(loop, conn) == -1)
+        loop_drop(loop, conn->ws);
+}
+#endif
+
+/* Write out what conn queued, or start writing it */
+static int loop_write(websocket_loop_t *loop, struct websocket_loop_conn *conn)
+{
+#if defined(LOOP_URING)
+    if (loop->uring)
+        return uring_send(loop, conn);
+#endif
+    if (loop_flush(conn->ws) == -1 || loop_update(loop, conn) == -1)
+        return -1;
+
+    return 0;
+}
+
+/* Start watching a connection that was just registered */
+static int loop_watch(websocket_loop_t *loop, struct websocket_loop_conn *conn)
+{
+#if defined(LOOP_URING)
+    if (loop->uring) {
+        conn->ws->fed = 1;
+        return uring_recv(loop, conn);
+    }
+#endif
+    return poller_add(loop, websocket_fd(conn->ws), conn);
+}
+
+/* Write out everything queued during the batch */
+static void loop_flush_dirty(websocket_loop_t *loop)
+{
+    struct websocket_loop_conn *conn;
+
+    while ((conn = loop->dirty) != NULL) {
+        loop->dirty = conn->dirty_next;
+        conn->dirty = 0;
+        if (!conn->ws)
+            continue;
+        if (loop_write(loop, conn) == -1)
+            loop_drop(loop, conn->ws);
+    }
+}
+
+/* Register what websocket_loop_add queued */
+static void loop_register_pending(websocket_loop_t *loop)
+{
+    struct websocket_loop_conn *conn, *next;
+
+    pthread_mutex_lock(&loop->lock);
+    conn = loop->pending;
+    loop->pending = NULL;
+    pthread_mutex_unlock(&loop->lock);
+
+    for (; conn; conn = next) {
+        next = conn->next;
+        conn->prev = NULL;
+        conn->next = loop->conns;
+        if (loop->conns)
+            loop->conns->prev = conn;
+        loop->conns = conn;
+
+        if (loop_watch(loop, conn) == -1) {
+            websocket_log("loop_watch error\n");
+            loop_drop(loop, conn->ws);
+            continue;
+        }
+
+        /* Output queued before the connection was added */
+        conn->ws->on_output = loop_on_output;
+        if (websocket_queued(conn->ws) > 0)
+            loop_on_output(conn->ws);
+
+        /* Frames may already sit in the receive buffer, no event for them */
+        if (loop_read(loop, conn->ws) == -1)
+            loop_drop(loop, conn->ws);
+    }
+}
+
+static void loop_collect(websocket_loop_t *loop)
+{
+    struct websocket_loop_conn *conn;
+
+    while ((conn = loop->garbage) != NULL) {
+        loop->garbage = conn->next;
+        free(conn->stage);
+        free(conn);
+    }
+}
+
+static void loop_drain_wakeup(websocket_loop_t *loop)
+{
+    char buf[64];
+
+    while (read(loop->wakeup[0], buf, sizeof(buf)) > 0)
+        continue;
+}
+
+#if defined(LOOP_URING)
+/*
+ * One batch is whatever io_uring_enter returns with. The dispatch may wait
+ * for more completions while removing a connection, those are appended to
+ * the backlog and handled in the same batch
+ */
+static int loop_uring_run(websocket_loop_t *loop)
+{
+    struct loop_uring *u = loop->uring;
+    struct io_uring_cqe cqe;
+
+    loop_register_pending(loop);
+    loop_flush_dirty(loop);
+    loop_collect(loop);
+
+    while (!__atomic_load_n(&loop->stop, __ATOMIC_ACQUIRE)) {
+        if (uring_enter(loop, 1) == -1 && errno != EINTR && errno != EBUSY) {
+            websocket_log("io_uring_enter error\n");
+            return -1;
+        }
+        uring_reap(loop);
+
+        while (u->pos < u->n) {
+            cqe = u->backlog[u->pos++];
+            switch (cqe.user_data & LOOP_OP_MASK) {
+            case LOOP_OP_RECV:
+                uring_on_recv(loop, uring_conn(&cqe), &cqe);
+                break;
+            case LOOP_OP_SEND:
+                uring_on_send(loop, uring_conn(&cqe), &cqe);
+                break;
+            case LOOP_OP_WAKEUP:
+                if (!(cqe.flags & IORING_CQE_F_MORE) &&
+                    uring_poll_wakeup(loop) == -1) {
+                    websocket_log("uring_poll_wakeup error\n");
+                    return -1;
+                }
+                loop_drain_wakeup(loop);
+                loop_register_pending(loop);
+                break;
+            }
+        }
+        u->pos = u->n = 0;
+
+        loop_flush_dirty(loop);
+        loop_collect(loop);
+    }
+
+    __atomic_store_n(&loop->stop, 0, __ATOMIC_RELEASE);
+
+    return 0;
+}
+#endif
+
+int websocket_loop_run(websocket_loop_t *loop)
+{
+    struct loop_event events[LOOP_MAX_EVENTS];
+    struct websocket_loop_conn *conn;
+    int i, n;
+
+#if defined(LOOP_URING)
+    if (loop->uring)
+        return loop_uring_run(loop);
+#endif
+
+    loop_register_pending(loop);
+    loop_flush_dirty(loop);
+    loop_collect(loop);
+
+    while (!__atomic_load_n(&loop->stop, __ATOMIC_ACQUIRE)) {
+        n = poller_wait(loop, events, LOOP_MAX_EVENTS);
+        if (n == -1) {
+            if (errno == EINTR)
+                continue;
+            websocket_log("poller_wait error\n");
+            return -1;
+        }
+
+        for (i = 0; i < n; i++) {
+            conn = events[i].ptr;
+            if (!conn) {
+                loop_drain_wakeup(loop);
+                loop_register_pending(loop);
+                continue;
+            }
+
+            /* Dropped by an earlier event of this batch */
+            if (!conn->ws)
+                continue;
+
+            if ((events[i].writable && loop_write(loop, conn) == -1) ||
+                (events[i].readable && loop_read(loop, conn->ws) == -1)) {
+                loop_drop(loop, conn->ws);
+            }
+        }
+
+        loop_flush_dirty(loop);
+        loop_collect(loop);
+    }
+
+    __atomic_store_n(&loop->stop, 0, __ATOMIC_RELEASE);
+
+    return 0;
+}
+
+void websocket_loop_stop(websocket_loop_t *loop)
+{
+    __atomic_store_n(&loop->stop, 1, __ATOMIC_RELEASE);
+    loop_wakeup(loop);
+}
+
+void websocket_loop_free(websocket_loop_t *loop)
+{
+    struct websocket_loop_conn *conn;
+
+    loop_register_pending(loop);
+    while ((conn = loop->conns) != NULL)
+        loop_drop(loop, conn->ws);
+    loop->dirty = NULL;
+    loop_collect(loop);
+
+    close(loop->wakeup[0]);
+    close(loop->wakeup[1]);
+#if defined(LOOP_URING)
+    if (loop->uring)
+        uring_free(loop);
+    else
+#endif
+        close(loop->fd);
+    pthread_mutex_destroy(&loop->lock);
+}
+
+static void *loop_thread(void *arg)
+{
+    websocket_loop_run(arg);
+    return NULL;
+}
+
+/* Pin a loop thread to one CPU, Linux only */
+static void loop_pin(pthread_t thread, int cpu)
+{
+#if defined(__linux__)
+    cpu_set_t set;
+
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    if (pthread_setaffinity_np(thread, sizeof(set), &set) != 0)
+        websocket_log("pthread_setaffinity_np error\n");
+#else
+    (void)thread;
+    (void)cpu;
+#endif
+}
+
+int websocket_loop_group_start(websocket_loop_group_t *group, int n,
+                               const struct websocket_loop_cbs *cbs,
+                               void *arg)
+{
+    long ncpu;
+    int i;
+
+    memset(group, 0, sizeof(websocket_loop_group_t));
+
+    ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    if (ncpu < 1)
+        ncpu = 1;
+    if (n <= 0)
+        n = (int)ncpu;
+
+    group->loops = calloc((size_t)n, sizeof(websocket_loop_t));
+    group->threads = calloc((size_t)n, sizeof(pthread_t));
+    if (!group->loops || !group->threads) {
+        websocket_log("calloc error\n");
+        goto err;
+    }
+
+    for (; group->n < n; group->n++) {
+        i = group->n;
+        if (websocket_loop_init(&group->loops[i], cbs, arg) == -1) {
+            websocket_log("websocket_loop_init error\n");
+            goto err;
+        }
+        if (pthread_create(&group->threads[i], NULL, loop_thread,
+                           &group->loops[i]) != 0) {
+            websocket_log("pthread_create error\n");
+            websocket_loop_free(&group->loops[i]);
+            goto err;
+        }
+        loop_pin(group->threads[i], (int)(i % ncpu));
+    }
+    group->ncpu = (int)ncpu;
+
+    return 0;
+
+err:
+    websocket_loop_group_stop(group);
+    return -1;
+}
+
+/* The CPU that handles the socket's receive path, -1 when unknown */
+static int loop_incoming_cpu(websocket_t *ws)
+{
+#if defined(__linux__) && defined(SO_INCOMING_CPU)
+    socklen_t len = sizeof(int);
+    int cpu;
+
+    if (getsockopt(websocket_fd(ws), SOL_SOCKET, SO_INCOMING_CPU, &cpu,
+                   &len) == 0)
+        return cpu;
+#else
+    (void)ws;
+#endif
+    return -1;
+}
+
+/* The loop with the fewest connections, among those on cpu unless -1 */
+static websocket_loop_t *loop_least_loaded(websocket_loop_group_t *group,
+                                           int cpu)
+{
+    websocket_loop_t *best = NULL;
+    int i, nconn, min = 0;
+
+    for (i = 0; i < group->n; i++) {
+        if (cpu >= 0 && i % group->ncpu != cpu)
+            continue;
+        pthread_mutex_lock(&group->loops[i].lock);
+        nconn = group->loops[i].nconn;
+        pthread_mutex_unlock(&group->loops[i].lock);
+        if (!best || nconn < min) {
+            best = &group->loops[i];
+            min = nconn;
+        }
+    }
+
+    return best;
+}
+
+int websocket_loop_group_add(websocket_loop_group_t *group, websocket_t *ws)
+{
+    websocket_loop_t *best = NULL;
+    int cpu;
+
+    cpu = group->ncpu > 1 ? loop_incoming_cpu(ws) : -1;
+    if (cpu >= 0)
+        best = loop_least_loaded(group, cpu);
+    if (!best)
+        best = loop_least_loaded(group, -1);
+
+    if (!best) {
+        websocket_log("no loop in the group\n");
+        return -1;
+    }
+
+    return websocket_loop_add(best, ws);
+}
+
+void websocket_loop_group_stop(websocket_loop_group_t *group)
+{
+    int i;
+
+    for (i = 0; i < group->n; i++)
+        websocket_loop_stop(&group->loops[i]);
+
+    for (i = 0; i < group->n; i++) {
+        pthread_join(group->threads[i], NULL);
+        websocket_loop_free(&group->loops[i]);
+    }
+
+    free(group->loops);
+    free(group->threads);
+    memset(group, 0, sizeof(websocket_loop_group_t));
+}
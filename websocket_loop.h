@@ -0,0 +1,113 @@
+/* MIT License Copyright (c) 2021, h1zzz */
+
+#ifndef _WEBSOCKET_LOOP_H
+#define _WEBSOCKET_LOOP_H
+
+#include "websocket.h"
+
+#include <pthread.h>
+
+struct websocket_loop_conn;
+struct loop_uring;
+
+struct websocket_loop_cbs {
+    /*
+     * A message arrived, buf is only valid during the call. Return -1 to
+     * have the loop drop the connection, on_close follows
+     */
+    int (*on_message)(websocket_t *ws, int type, const void *buf, size_t n,
+                      void *arg);
+    /*
+     * The connection failed, was closed by the peer or was dropped. It is no
+     * longer in the loop, the callback owns it (websocket_close, free...)
+     */
+    void (*on_close)(websocket_t *ws, void *arg);
+};
+
+/*
+ * A reactor that owns many non-blocking connections on epoll (kqueue on BSD
+ * and macOS), or on io_uring, and dispatches their messages. One loop is
+ * driven by one thread
+ */
+typedef struct websocket_loop {
+    int fd;        /* epoll, kqueue or io_uring descriptor */
+    int wakeup[2]; /* pipe used to wake up websocket_loop_run */
+    int stop;
+    int nconn;
+    struct websocket_loop_cbs cbs;
+    void *arg;
+    pthread_mutex_t lock;               /* protects pending and nconn */
+    struct websocket_loop_conn *pending; /* added, not registered yet */
+    struct websocket_loop_conn *conns;
+    struct websocket_loop_conn *garbage; /* removed, freed after the batch */
+    struct websocket_loop_conn *dirty;   /* queued output this batch */
+    struct loop_uring *uring;            /* NULL on epoll and kqueue */
+} websocket_loop_t;
+
+int websocket_loop_init(websocket_loop_t *loop,
+                        const struct websocket_loop_cbs *cbs, void *arg);
+
+/*
+ * A loop on io_uring, Linux 6.0 or later, for plain TCP and kernel TLS
+ * connections. Each connection keeps a multishot recv armed on receive
+ * buffers registered with the kernel, and its output leaves as linked SENDs,
+ * so a batch costs one io_uring_enter for all connections instead of a
+ * system call per read and write. Return -1 when io_uring is not available,
+ * websocket_loop_init still works then
+ */
+int websocket_loop_init_uring(websocket_loop_t *loop,
+                              const struct websocket_loop_cbs *cbs, void *arg);
+
+/*
+ * Hand a connected websocket to the loop, it is switched to non-blocking
+ * mode. May be called from any thread. An io_uring loop refuses TLS that is
+ * not done by the kernel. Return 0 on success, -1 on failure
+ */
+int websocket_loop_add(websocket_loop_t *loop, websocket_t *ws);
+
+/*
+ * Take a connection out of the loop, only from the loop's own thread. On
+ * io_uring what it has in flight is cancelled and waited for first, bytes
+ * received meanwhile stay buffered
+ */
+void websocket_loop_remove(websocket_loop_t *loop, websocket_t *ws);
+
+/* Dispatch events until websocket_loop_stop, return -1 on failure */
+int websocket_loop_run(websocket_loop_t *loop);
+
+/* Ask websocket_loop_run to return, may be called from any thread */
+void websocket_loop_stop(websocket_loop_t *loop);
+
+/* Release the loop, connections still in it are passed to on_close */
+void websocket_loop_free(websocket_loop_t *loop);
+
+/*
+ * N loops, each running on its own thread pinned to one CPU, with new
+ * connections spread across them
+ */
+typedef struct websocket_loop_group {
+    websocket_loop_t *loops;
+    pthread_t *threads;
+    int n;
+    int ncpu; /* loop i runs on CPU i % ncpu */
+} websocket_loop_group_t;
+
+/*
+ * Start n loops, loop i is pinned to CPU i modulo the number of online CPUs.
+ * n <= 0 starts one loop per online CPU
+ */
+int websocket_loop_group_start(websocket_loop_group_t *group, int n,
+                               const struct websocket_loop_cbs *cbs,
+                               void *arg);
+
+/*
+ * Add ws to the loop running on the CPU its packets arrive on, from
+ * SO_INCOMING_CPU, so the socket and its buffers stay on one core and NUMA
+ * node. Without that the loop with the fewest connections takes it
+ */
+int websocket_loop_group_add(websocket_loop_group_t *group, websocket_t *ws);
+
+/* Stop every loop, wait for the threads and release the group */
+void websocket_loop_group_stop(websocket_loop_group_t *group);
+
+#endif /* websocket_loop.h */
@@ -0,0 +1,147 @@
+/* MIT License Copyright (c) 2021, h1zzz */
+
+#include "websocket_pool.h"
+
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#define POOL_MIN_SIZE 4096
+#define POOL_SLAB_SIZE (256 * 1024)
+
+/* Keeps the buffers that follow it 64-byte aligned */
+#define POOL_SLAB_HDR 64
+
+struct websocket_pool_slab {
+    struct websocket_pool_slab *next;
+};
+
+/* Smallest class that holds size, -1 when it is too large for the pool */
+static int pool_class(size_t size)
+{
+    int idx;
+
+    for (idx = 0; idx < WEBSOCKET_POOL_CLASSES; idx++) {
+        if (size <= (size_t)POOL_MIN_SIZE << idx)
+            return idx;
+    }
+    return -1;
+}
+
+/* Carve a new slab into buffers of one class, called with the lock held */
+static int pool_grow(websocket_pool_t *pool, int idx)
+{
+    struct websocket_pool_slab *slab;
+    size_t size = (size_t)POOL_MIN_SIZE << idx, off;
+    unsigned char *ptr;
+
+    slab = malloc(POOL_SLAB_HDR + POOL_SLAB_SIZE);
+    if (!slab) {
+        websocket_log("malloc error\n");
+        return -1;
+    }
+    slab->next = pool->slabs;
+    pool->slabs = slab;
+
+    ptr = (unsigned char *)slab + POOL_SLAB_HDR;
+    for (off = 0; off + size <= POOL_SLAB_SIZE; off += size) {
+        *(void **)(ptr + off) = pool->free[idx];
+        pool->free[idx] = ptr + off;
+        pool->nfree[idx]++;
+    }
+
+    return 0;
+}
+
+static void *pool_alloc(size_t size, void *arg)
+{
+    websocket_pool_t *pool = arg;
+    void *ptr = NULL;
+    int idx;
+
+    idx = pool_class(size);
+    if (idx == -1)
+        return malloc(size);
+
+    pthread_mutex_lock(&pool->lock);
+    if (pool->free[idx] || pool_grow(pool, idx) == 0) {
+        ptr = pool->free[idx];
+        pool->free[idx] = *(void **)ptr;
+        pool->nfree[idx]--;
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    return ptr;
+}
+
+static void pool_release(void *ptr, size_t size, void *arg)
+{
+    websocket_pool_t *pool = arg;
+    int idx;
+
+    idx = pool_class(size);
+    if (idx == -1) {
+        free(ptr);
+        return;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    *(void **)ptr = pool->free[idx];
+    pool->free[idx] = ptr;
+    pool->nfree[idx]++;
+    pthread_mutex_unlock(&pool->lock);
+}
+
+static void *pool_realloc(void *ptr, size_t old_size, size_t size, void *arg)
+{
+    int from = pool_class(old_size), to = pool_class(size);
+    void *nptr;
+
+    /* Growing within a class is free, the buffer is already that large */
+    if (from != -1 && from == to)
+        return ptr;
+    if (from == -1 && to == -1)
+        return realloc(ptr, size);
+
+    nptr = pool_alloc(size, arg);
+    if (!nptr)
+        return NULL;
+    memcpy(nptr, ptr, old_size < size ? old_size : size);
+    pool_release(ptr, old_size, arg);
+
+    return nptr;
+}
+
+int websocket_pool_init(websocket_pool_t *pool)
+{
+    memset(pool, 0, sizeof(websocket_pool_t));
+
+    if (pthread_mutex_init(&pool->lock, NULL) != 0) {
+        websocket_log("pthread_mutex_init error\n");
+        return -1;
+    }
+
+    pool->allocator.alloc = pool_alloc;
+    pool->allocator.realloc = pool_realloc;
+    pool->allocator.free = pool_release;
+    pool->allocator.arg = pool;
+
+    return 0;
+}
+
+const struct websocket_allocator *websocket_pool_allocator(
+    websocket_pool_t *pool)
+{
+    return &pool->allocator;
+}
+
+void websocket_pool_free(websocket_pool_t *pool)
+{
+    struct websocket_pool_slab *slab;
+
+    while ((slab = pool->slabs)) {
+        pool->slabs = slab->next;
+        free(slab);
+    }
+    pthread_mutex_destroy(&pool->lock);
+}
@@ -0,0 +1,37 @@
+/* MIT License Copyright (c) 2021, h1zzz */
+
+#ifndef _WEBSOCKET_POOL_H
+#define _WEBSOCKET_POOL_H
+
+#include "websocket.h"
+
+#include <pthread.h>
+
+/* Size classes of 4, 8, 16, 32 and 64 KB, larger buffers use malloc */
+#define WEBSOCKET_POOL_CLASSES 5
+
+struct websocket_pool_slab;
+
+/*
+ * A slab allocator of fixed-size buffers shared by many connections, in
+ * any number of threads. Memory is carved out of 256 KB slabs and kept in
+ * the pool until websocket_pool_free
+ */
+typedef struct websocket_pool {
+    pthread_mutex_t lock;
+    void *free[WEBSOCKET_POOL_CLASSES]; /* free list of each class */
+    size_t nfree[WEBSOCKET_POOL_CLASSES];
+    struct websocket_pool_slab *slabs;
+    struct websocket_allocator allocator;
+} websocket_pool_t;
+
+int websocket_pool_init(websocket_pool_t *pool);
+
+/* Hooks to put in websocket_options.allocator, valid as long as the pool */
+const struct websocket_allocator *websocket_pool_allocator(
+    websocket_pool_t *pool);
+
+/* Release the slabs, every connection using the pool must be gone */
+void websocket_pool_free(websocket_pool_t *pool);
+
+#endif /* websocket_pool.h */